@@ -0,0 +1,88 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class BlockDevice;
+
+// One transfer of count consecutive blocks starting at first_block, to or from one buffer
+// of count * block_size bytes. The buffer must stay put until the completion is reaped.
+struct IoRequest {
+    bool write;
+    int first_block;
+    int count;
+    char *buffer;
+    unsigned long long tag; // Handed back unchanged in the completion
+};
+
+struct IoCompletion {
+    unsigned long long tag;
+    bool ok;
+};
+
+// Keeps many block transfers in flight at once. Requests are submitted in batches and their
+// completions reaped in whatever order the disk finishes them. The engine runs on an
+// io_uring when the kernel grants one, and otherwise hands requests to a few threads doing
+// pread/pwrite. A request the ring fails or cuts short is redone synchronously on the
+// device, which reports the error and zero-fills a failed read.
+//
+// One thread submits and reaps at a time; BlockDevice keeps a pool of engines so that
+// concurrent callers each get their own.
+class AsyncIo {
+  private:
+    struct Ring; // io_uring mappings, nullptr when running on the thread pool
+
+    BlockDevice *device;
+    int depth;                      // Requests in flight at most
+    std::deque<IoRequest> backlog;  // Submitted but not yet handed to the ring or the pool
+    int outstanding;                // Submitted but not yet reaped
+
+    Ring *ring;
+    std::vector<IoRequest> slots; // In flight on the ring, indexed by user_data
+    std::vector<int> free_slots;
+
+    std::vector<std::thread> workers;
+    std::mutex pool_mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::vector<IoCompletion> finished; // Completed by the pool, waiting to be reaped
+    bool stopping;
+    bool retired; // The ring failed and was closed; requests are done synchronously
+
+    static Ring *open_ring(unsigned entries);
+    static void close_ring(Ring *ring);
+    // Move backlog into free ring slots and tell the kernel about them
+    void fill_ring(std::vector<IoCompletion> &completions);
+    void reap_ring(std::vector<IoCompletion> &completions, int min_complete);
+    void worker_loop();
+    bool run_sync(const IoRequest &request);
+    // Collect every outstanding completion without io_uring_enter; false if some never came
+    bool drain();
+    void retire();
+
+  public:
+    AsyncIo(BlockDevice *device, int depth);
+    ~AsyncIo();
+    AsyncIo(const AsyncIo &) = delete;
+    AsyncIo &operator=(const AsyncIo &) = delete;
+
+    bool uses_io_uring() const;
+    // False once the ring has failed; such an engine shouldn't be reused
+    bool is_usable() const;
+
+    void submit(const std::vector<IoRequest> &requests);
+    // Append at least min_complete completions (fewer only if fewer are outstanding) plus
+    // any others already finished. Returns how many were appended.
+    int reap(std::vector<IoCompletion> &completions, int min_complete);
+    int get_outstanding() const;
+
+    // Submit a batch and wait until nothing is outstanding; false if any request failed.
+    // Nothing is left in flight on return, even when waiting on the ring fails.
+    bool run(const std::vector<IoRequest> &requests);
+};
+
+#endif // ASYNC_IO_H
@@ -0,0 +1,27 @@
+#ifndef BLOCK_BACKUP_H
+#define BLOCK_BACKUP_H
+
+#include "filesystem.h"
+#include <string>
+
+// Incremental image backups driven by the filesystem's changed-block tracking. A backup
+// file holds the blocks written since the last checkpoint, each with its byte offset in the
+// image; merging the files in order onto a copy of the image reproduces it.
+class BlockBackup {
+  private:
+    FileSystem *fs;
+
+  public:
+    explicit BlockBackup(FileSystem *fs);
+
+    // Sync the image, write every changed block to path and start a new checkpoint called
+    // next_checkpoint, so the following backup holds only what changes after this one.
+    // Returns the number of blocks written, or -1 on failure.
+    int export_changes(const std::string &path, const std::string &next_checkpoint);
+
+    // Apply a backup file to an image file that is not mounted. A missing image is created,
+    // which is how the first, full backup is restored.
+    static bool merge(const std::string &backup_path, const std::string &image_path);
+};
+
+#endif // BLOCK_BACKUP_H
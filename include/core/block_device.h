@@ -0,0 +1,68 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+class AsyncIo;
+
+// Fixed-size block access to an image file through a raw descriptor. Every transfer names
+// its own offset (pread/pwrite), so threads share a device without a cursor or a lock, and
+// a run of consecutive blocks moves in one preadv/pwritev. Short transfers are continued
+// until done. A transfer that fails or reaches the end of the file is reported and returns
+// false; a failed read leaves zeros where the data would have been.
+//
+// A list that spans several runs is handed to an AsyncIo engine so that all of its runs are
+// in flight together. Engines are kept in a pool and reused, one per concurrent caller.
+class BlockDevice {
+  private:
+    int fd;
+    int block_size;
+    std::mutex engine_mutex;
+    std::vector<AsyncIo *> idle_engines;
+
+    AsyncIo *acquire_engine();
+    void release_engine(AsyncIo *engine);
+
+    // One run of consecutive blocks starting at first_block, each with its own buffer
+    bool transfer_run(bool write, int first_block, char *const *buffers, int count);
+    // Split the list into runs of consecutive block numbers; several runs go to an engine
+    bool transfer(bool write, const std::vector<int> &block_nums,
+                  const std::vector<char *> &buffers);
+
+  public:
+    explicit BlockDevice(int block_size);
+    ~BlockDevice();
+    BlockDevice(const BlockDevice &) = delete;
+    BlockDevice &operator=(const BlockDevice &) = delete;
+
+    // Open an existing image, or create an empty one in its place when create is set
+    bool open(const std::string &path, bool create);
+    void close();
+    bool is_open() const;
+    int get_fd() const;
+    int get_block_size() const;
+
+    bool read_block(int block_num, char *data);
+    bool write_block(int block_num, const char *data);
+
+    // A run of count consecutive blocks from first_block, done synchronously
+    bool read_run(int first_block, int count, char *out);
+    bool write_run(int first_block, int count, const char *data);
+
+    // Blocks in list order, block_size bytes each, to or from one buffer. Runs of
+    // consecutive block numbers are transferred with a single call, and separate runs
+    // concurrently.
+    bool read_blocks(const std::vector<int> &block_nums, char *out);
+    bool write_blocks(const std::vector<int> &block_nums, const char *data);
+
+    // Blocks with separate buffers, e.g. journal records replayed to their home locations
+    bool write_scattered(const std::vector<int> &block_nums,
+                         const std::vector<const char *> &buffers);
+
+    // Wait until everything written has reached the disk
+    bool flush();
+};
+
+#endif // BLOCK_DEVICE_H
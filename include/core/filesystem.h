@@ -2,9 +2,15 @@
 #define FILESYSTEM_H
 
 #include "journal.h"
+#include <atomic>
 #include <ctime>
-#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 // Constants for our file system
@@ -12,6 +18,12 @@ const int BLOCK_SIZE = 512;
 const int NUM_BLOCKS = 4096;
 const int NUM_INODES = 128;
 const int MAX_FILENAME_LENGTH = 28;
+const int NUM_JOURNAL_BLOCKS = 100;
+
+// Superblock states. Images written before the summary counters existed read as 0.
+const int FS_STATE_UNKNOWN = 0;
+const int FS_STATE_CLEAN = 1;   // Unmounted cleanly, summary counters are exact
+const int FS_STATE_MOUNTED = 2; // Mounted, or the last session did not unmount
 
 // Superblock structure
 struct Superblock {
@@ -19,6 +31,16 @@ struct Superblock {
     int num_inodes;
     int inode_blocks;
     int free_block_list_head;
+    int free_blocks; // Summary counters, maintained on allocate/free
+    int free_inodes;
+    int state;
+    int name_index_stamp;  // Matches the saved name index file, 0 if there is none
+    int quota_block;       // First block of the quota file, 0 if there is none
+    int quota_usage_valid; // The quota file's usage figures match the inode table
+    int snapshot_block;    // First block of the snapshot list, 0 if there are no snapshots
+    int reclaim_block;     // First block of the reclaim bitmap, 0 if nothing is queued
+    int change_sequence;   // Last generation stamped on an inode
+    int checkpoint_block;  // First block of the changed-block bitmap, 0 if there is none
 };
 
 // Inode structure
@@ -28,6 +50,7 @@ struct Inode {
     int gid;  // Group ID
     int size;
     int link_count;
+    int generation; // change_sequence when the inode or its data last changed
     time_t creation_time;
     time_t modification_time;
     time_t access_time;
@@ -36,31 +59,191 @@ struct Inode {
     int flags; // Additional flags (e.g., for symbolic links)
 };
 
+// A snapshot is a saved copy of the inode table, kept in its own block chain
+struct SnapshotRecord {
+    char name[MAX_FILENAME_LENGTH];
+    time_t creation_time;
+    int table_block;      // First block of the saved inode table
+    int blocks_used;      // Blocks the saved table references, fixed at creation
+    int exclusive_blocks; // Of those, the ones no other snapshot or the live tree uses
+};
+
+class BlockDevice;
+class NameIndex;
+class InodeIndex;
+class QuotaManager;
+
+// What read views see of one generation: the inode table, parent directories and index
+// copies. Views opened while the generation is unchanged share one, so it is never changed
+// once built.
+struct ViewState {
+    unsigned long long generation;
+    std::vector<Inode> inodes;
+    std::vector<int> parent_dirs;
+    NameIndex *names;       // nullptr when the filesystem has no name index
+    InodeIndex *attributes; // nullptr when nothing was mounted
+
+    ViewState();
+    ~ViewState();
+    ViewState(const ViewState &) = delete;
+    ViewState &operator=(const ViewState &) = delete;
+};
+
 // Directory entry structure
 struct DirEntry {
     char name[MAX_FILENAME_LENGTH];
     int inode_num;
 };
 
+// Where relative paths start for one caller. Threads sharing a FileSystem each keep their
+// own; the overloads without a context use the filesystem's default one.
+struct FsContext {
+    int current_dir_inode;
+
+    FsContext() : current_dir_inode(0) {
+    }
+};
+
+// Concurrency: calls that change directories, snapshots, quotas or the image as a whole hold
+// the namespace lock exclusively. write, read, ls and cd hold it shared and so run alongside
+// each other; write and read also lock the inode's stripe (the inodes sharing its table
+// block), exclusively to write. Allocation, the superblock and quota charges go through
+// alloc_mutex, and write holds journal_mutex only while its transaction commits. Lookups
+// such as get_dir_entries and get_inode take no lock; callers running beside writers should
+// read through a ReadView.
 class FileSystem {
   private:
-    std::fstream disk;
+    BlockDevice *device; // Positional I/O on the image, safe to share between threads
+    mutable std::mutex changed_mutex; // changed_blocks is a packed bitmap, one writer at a time
     std::string disk_name;
     Superblock sb;
     std::vector<Inode> inodes;
-    int current_dir_inode;
+    FsContext default_context;
     Journal *journal;
+    bool mounted_clean; // Superblock state was FS_STATE_CLEAN when mounted
+    NameIndex *name_index; // Optional trigram index over entry names
+    InodeIndex *inode_index; // Size and mtime indexes, rebuilt from the inode table at mount
+    QuotaManager *quota_manager; // Told about every block and inode changing owner
+    std::vector<int> parent_dirs; // Directory holding each inode's first link, -1 if none
+    std::vector<SnapshotRecord> snapshots;
+    std::vector<int> delete_queue; // Tables of deleted snapshots whose blocks aren't released
+    std::vector<std::vector<bool>> snapshot_blocks; // Per snapshot, the blocks it references
+    bool snapshot_counts_dirty; // exclusive_blocks changed since the list was last written
+    std::vector<unsigned short> snapshot_refs; // Per block, the snapshots that reference it
+    std::vector<bool> reclaim_pending; // Blocks a restore dropped, not yet on the free list
+    int reclaim_count;
+    std::atomic<unsigned long long> generation; // Bumped whenever metadata changes
+
+    // See the concurrency notes above. exclusive_owner lets a thread that holds the namespace
+    // lock call other public methods, as QuotaManager does, without locking again.
+    std::shared_mutex namespace_mutex;
+    std::atomic<std::thread::id> exclusive_owner;
+    std::vector<std::shared_mutex> inode_locks; // One per inode-table block
+    std::recursive_mutex alloc_mutex; // Free list, superblock, quota charges, inode stamps
+    std::mutex journal_mutex;         // One transaction at a time among concurrent writers
+    class ExclusiveLock;
+    class SharedLock;
+    std::shared_mutex &inode_lock(int inode_num);
+
+    // Read views pin the blocks their inode table references. Every allocation stamps the
+    // block with next_view_id, so a live block is pinned when a view opened since: the view
+    // ids are handed out in order and a block can't be freed and reused while one is open.
+    // A block the live tree frees while it is pinned waits in pinned_frees until the views
+    // opened before it was freed have closed; a crash forgets the list and leaves those
+    // blocks for fsck.
+    mutable std::mutex view_mutex;
+    std::set<int> read_views; // Ids of the open views
+    int next_view_id;
+    std::vector<int> block_stamps;
+    std::vector<std::pair<int, int>> pinned_frees; // Block, and next_view_id when freed
+    std::shared_ptr<const ViewState> view_state; // Handed to views opened at its generation
+
+    // Blocks written since the checkpoint, set by write_block. The journal area is left out:
+    // every commit clears it back to zeros.
+    std::vector<bool> changed_blocks;
+    std::string checkpoint_name;
+    time_t checkpoint_time;
 
-    void write_block(int block_num, const char *data);
+    // Inode-table blocks modified since the last flush, and whether a repair batch is open
+    std::vector<bool> dirty_inode_blocks;
+    bool inode_batch_active;
+
+    // Block writes report failures and record the blocks in changed_blocks. write_blocks
+    // takes one buffer and write_scattered one per block; both move each run of consecutive
+    // blocks in a single call.
+    bool write_block(int block_num, const char *data);
+    bool write_blocks(const std::vector<int> &block_nums, const char *data);
+    bool write_scattered(const std::vector<int> &block_nums,
+                         const std::vector<const char *> &buffers);
+    void mark_changed(const int *block_nums, size_t count);
     void write_superblock();
-    void read_superblock();
+    bool read_superblock();
     void write_inodes();
     void read_inodes();
-    int allocate_block();
-    void free_block(int block_num);
+    // The owner inode's uid/gid are charged for the block; -1 leaves it unaccounted
+    int allocate_block(int owner_inode = -1);
+    void free_block(int block_num, int owner_inode = -1);
+    void charge_usage(int inode_num, int blocks, int inode_count);
+    int count_inode_blocks(int inode_num);
+
+    // Block chains for quota and snapshot metadata. stage_chain sizes a chain for new
+    // contents, log_chain logs it into the open transaction, and the caller frees the
+    // surplus blocks after committing.
+    std::vector<int> chain_blocks(int head);
+    int chain_length(size_t size) const;
+    bool read_chain(int head, std::string &data);
+    bool stage_chain(int head, size_t size, std::vector<int> &chain, std::vector<int> &surplus);
+    void log_chain(const std::vector<int> &chain, const std::string &data);
+    void log_superblock();
+
+    // Every block an inode table references, indirect blocks included
+    void collect_blocks(const std::vector<Inode> &table, std::vector<int> &blocks);
+    bool read_snapshot_table(int table_block, std::vector<Inode> &table);
+    // The list and delete queue share one chain, written with the reclaim bitmap
+    bool write_snapshot_list(const std::vector<SnapshotRecord> &list,
+                             const std::vector<int> &queue, const std::vector<int> &table_chain,
+                             const std::string &table, std::vector<int> &surplus);
+    // Drop the references of the oldest deleted snapshot, queueing what they kept alive
+    bool release_deleted_snapshot();
+    std::vector<bool> live_block_map();
+    bool save_changed_blocks();
+    void load_changed_blocks();
+    // Recount exclusive_blocks for every snapshot from the in-memory block maps
+    void count_exclusive_blocks();
+    // A block losing its second-to-last reference becomes exclusive to the remaining holder
+    void credit_exclusive_block(int block_num);
+    void load_snapshots();
+    bool is_snapshot_block(int block_num) const;
+    bool is_view_pinned(int block_num) const;
+    // Close every view without freeing anything, for format, mount and unmount
+    void drop_read_views();
+    // Free the blocks in pinned_frees that no view pins any more; returns how many
+    int release_unpinned_blocks();
+    // Blocks a snapshot or read view shares are never written in place: this frees the live
+    // reference and returns a fresh block for the caller to write instead
+    int relocate_shared_block(int owner_inode, int block_num);
+    std::string reclaim_bitmap() const;
+    // Keeps stamps unique after a crash left the superblock behind the inode tables
+    void raise_change_sequence(const std::vector<Inode> &table);
+    void load_reclaim_list();
+    // Checked before anything is allocated. The new inode and its blocks belong to uid/gid;
+    // a block the parent directory needs for the new entry is charged to the parent's owner.
+    // Project quotas are checked from project_start up the parent chain.
+    bool quota_allows(int uid, int gid, int blocks, int inode_count, int parent_dir,
+                      int project_start);
+    int dir_blocks_needed(int dir_inode_num);
     int find_free_inode();
     void add_dir_entry(int dir_inode_num, const std::string &name, int new_inode_num);
+    void remove_dir_entry(int dir_inode_num, const std::string &name);
+    void build_name_index();
+    void build_inode_index();
+    void build_parent_dirs();
+    void reindex_inode(int inode_num);
+    std::string name_index_file() const;
     void update_inode_times(int inode_num, bool access, bool modify, bool create);
+    void mark_inode_dirty(int inode_num);
+    void flush_dirty_inodes();
+    void bump_generation();
 
   public:
     FileSystem(const std::string &name);
@@ -69,13 +252,16 @@ class FileSystem {
     void format();
     bool mount();
     void unmount();
-    void mkdir(const std::string &dirname);
     std::vector<DirEntry> get_dir_entries(int inode_num);
+
+    // Path operations, relative to the default context
+    void mkdir(const std::string &dirname);
     std::vector<DirEntry> ls();
     void cd(const std::string &path);
     int find_inode_by_path(const std::string &path);
     void create(const std::string &filename);
-    void write(const std::string &filename, const std::string &data);
+    // False when the file is missing, over quota, out of space or a block couldn't be written
+    bool write(const std::string &filename, const std::string &data);
     std::string read(const std::string &filename);
     void chmod(const std::string &path, int mode);
     void chown(const std::string &path, int uid, int gid);
@@ -83,6 +269,22 @@ class FileSystem {
     void symlink(const std::string &target, const std::string &linkpath);
     void unlink(const std::string &path);
 
+    // The same, relative to a caller's own context. Writes to files in different stripes
+    // only meet on the allocator and the journal commit.
+    void mkdir(const FsContext &context, const std::string &dirname);
+    std::vector<DirEntry> ls(const FsContext &context);
+    void cd(FsContext &context, const std::string &path);
+    int find_inode_by_path(const FsContext &context, const std::string &path);
+    void create(const FsContext &context, const std::string &filename);
+    bool write(const FsContext &context, const std::string &filename, const std::string &data);
+    std::string read(const FsContext &context, const std::string &filename);
+    void chmod(const FsContext &context, const std::string &path, int mode);
+    void chown(const FsContext &context, const std::string &path, int uid, int gid);
+    void link(const FsContext &context, const std::string &oldpath, const std::string &newpath);
+    void symlink(const FsContext &context, const std::string &target,
+                 const std::string &linkpath);
+    void unlink(const FsContext &context, const std::string &path);
+
     Inode get_inode(int inode_num) const;
 
     /**
@@ -92,10 +294,21 @@ class FileSystem {
      */
     bool is_valid_inode(int inode_num) const;
 
-    // Allow DiskUsageWidget to read blocks
-    void read_block(int block_num, char *data);
+    // Allow DiskUsageWidget to read blocks. On failure the error is reported and the
+    // buffer holds zeros.
+    bool read_block(int block_num, char *data);
+
+    // Read blocks into out, BLOCK_SIZE bytes each in list order. Runs of consecutive block
+    // numbers are transferred with a single preadv.
+    bool read_blocks(const std::vector<int> &block_nums, char *out);
 
-    // Methods for filesystem maintenance
+    // A file's data, gathered with read_blocks. Unlike read() this leaves access_time alone.
+    bool read_inode_data(int inode_num, std::string &content);
+
+    // Methods for filesystem maintenance. Inside a batch these only mark the inode-table
+    // block dirty; otherwise the block is journaled immediately.
+    void begin_inode_batch();
+    void commit_inode_batch();
     void fix_invalid_block_pointer(int inode_num, int block_index);
     void fix_orphaned_inode(int inode_num, int lost_found_inode);
     void fix_inode_link_count(int inode_num, int correct_count);
@@ -103,6 +316,107 @@ class FileSystem {
     // Create lost+found directory if it doesn't exist
     int create_lost_found();
 
+    // Optional name index kept up to date by add_dir_entry and unlink. Enabling it loads
+    // the saved index when it matches the image and rebuilds it otherwise.
+    bool enable_name_index();
+    NameIndex *get_name_index() const;
+
+    // Sorted size and modification-time indexes, or nullptr when nothing is mounted
+    InodeIndex *get_inode_index() const;
+
+    // Metadata generation: changes after every committed transaction (and format, mount or
+    // create), so callers can cache anything derived from the tree until it moves
+    unsigned long long get_generation() const;
+
+    // Copy-on-write snapshots. Creating one saves the inode table and adds a reference to
+    // every block it uses; the live tree then never overwrites or frees such a block.
+    // Deleting one only queues it, and reclaim_blocks releases its blocks later.
+    bool create_snapshot(const std::string &name);
+    bool delete_snapshot(const std::string &name);
+    std::vector<SnapshotRecord> get_snapshots() const;
+    bool read_snapshot_inodes(const std::string &name, std::vector<Inode> &table);
+    int get_snapshot_refs(int block_num) const;
+
+    // Make a snapshot's inode table the live one. Only the inode table and superblock are
+    // rewritten, in one transaction, so the cost doesn't depend on how much data there is.
+    // Blocks that only the old tree used are queued for reclaim_blocks instead of freed.
+    bool restore_snapshot(const std::string &name);
+
+    // One step of background reclamation: release at most one deleted snapshot, free the
+    // blocks closed read views no longer pin, then up to max_blocks queued blocks. Returns
+    // how many blocks were freed.
+    int reclaim_blocks(int max_blocks);
+    int get_pending_reclaim() const;
+    int get_pending_deletes() const;
+
+    // Read views (see ReadView). Opening hands back the state of the current generation,
+    // copied from memory by the first view to ask for it, and pins every block its table
+    // references so writers move to fresh blocks instead. Nothing is read from disk. Returns
+    // -1 when nothing is mounted. Opening waits for operations in progress to finish;
+    // unmount and format close every view.
+    int open_read_view(std::shared_ptr<const ViewState> &state);
+    void close_read_view(int view_id);
+    bool is_read_view_open(int view_id) const;
+
+    // Data block numbers of an inode from any inode table, in file order
+    void get_file_blocks(const Inode &inode, std::vector<int> &blocks);
+
+    // Replication. receive_inode gives inode_num the source's metadata; for files and
+    // symlinks the blocks at the given file indexes are replaced with data, one block each,
+    // and the others are kept. A directory keeps its blocks and changes through
+    // receive_dir_entry, where adding a name replaces any entry already using it.
+    bool receive_inode(int inode_num, const Inode &source, const std::vector<int> &indexes,
+                       const std::string &data);
+    bool receive_dir_entry(int dir_inode_num, const DirEntry &entry, bool add);
+    // Rebuild the caches and quota usage once a stream has been applied
+    void finish_receive();
+
+    // Changed-block tracking for incremental backups. set_checkpoint clears the bitmap and
+    // names the new baseline; without a checkpoint, or after an unclean shutdown, every
+    // block counts as changed.
+    bool set_checkpoint(const std::string &name);
+    std::string get_checkpoint() const;
+    time_t get_checkpoint_time() const;
+    std::vector<int> get_changed_blocks() const;
+
+    // An export runs alongside writers. take_changed_blocks returns the changed blocks and
+    // clears them in one step, so anything written afterwards is marked again for the next
+    // export. advance_checkpoint then names the new baseline without clearing; a failed
+    // export hands its blocks back with restore_changed_blocks.
+    std::vector<int> take_changed_blocks();
+    void restore_changed_blocks(const std::vector<int> &blocks);
+    bool advance_checkpoint(const std::string &name);
+
+    // Write the inode table and superblock so the image file matches memory, e.g. before it
+    // is copied. Inode-table blocks that already match are left alone.
+    void sync();
+
+    // The directory holding an inode's first link; -1 for the root and unlinked inodes
+    int get_parent_dir(int inode_num) const;
+
+    // Quota usage is kept current by FileSystem calling QuotaManager::charge; nullptr detaches.
+    // format() detaches the manager, since its figures belong to the old contents.
+    void set_quota_manager(QuotaManager *manager);
+    QuotaManager *get_quota_manager() const;
+
+    // The quota file is a chain of blocks named by the superblock. Writing replaces it in a
+    // single journal transaction and marks the saved usage as exact.
+    bool read_quota_file(std::string &data);
+    bool write_quota_file(const std::string &data);
+
+    // The saved quota usage can be used instead of a scan: the image was unmounted cleanly
+    // and nothing has been charged while no QuotaManager was attached
+    bool quota_usage_saved() const;
+
+    // Superblock summary information for quick checks
+    Superblock get_superblock() const;
+    bool was_cleanly_unmounted() const;
+    bool journal_is_empty();
+
+    // Count free blocks (by walking the free list) and free inodes from scratch
+    void count_free_resources(int &free_blocks, int &free_inodes);
+    void recalculate_summary_counters();
+
     friend class Journal;
 };
 
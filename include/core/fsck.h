@@ -13,7 +13,8 @@ enum class FsckIssueType {
     UNREFERENCED_BLOCK,
     DIRECTORY_LOOP,
     INCORRECT_LINK_COUNT,
-    INVALID_BLOCK_POINTER
+    INVALID_BLOCK_POINTER,
+    INCORRECT_SUMMARY_COUNTER
 };
 
 // Structure to store details about filesystem issues
@@ -21,10 +22,25 @@ struct FsckIssue {
     FsckIssueType type;
     int inode_num;
     int block_num;
+    int block_index; // Pointer slot for INVALID_BLOCK_POINTER (0-9 direct, 10 indirect)
     std::string description;
     bool can_fix;
 };
 
+// Kinds of inode repair that can be collected into a plan and applied in one batch
+enum class FsckRepairType {
+    CLEAR_BLOCK_POINTER,
+    ATTACH_TO_LOST_FOUND,
+    SET_LINK_COUNT
+};
+
+// A single pending inode repair
+struct FsckRepair {
+    FsckRepairType type;
+    int inode_num;
+    int value; // Block index or link count, depending on type
+};
+
 class FileSystemCheck {
   private:
     FileSystem *fs;
@@ -35,15 +51,35 @@ class FileSystemCheck {
     bool *inode_used;
     int *inode_link_counts;
 
+    // Flat per-inode arrays for the directory pass: cached modes, the parent named by a
+    // directory entry, and a union-find forest of directory connectivity
+    int *inode_modes;
+    int *dir_parent;
+    int *dir_set;
+
+    // Quick check state: where the next inode sample starts, and whether the last quick
+    // check had to fall back to the full check
+    int quick_sample_cursor;
+    bool quick_check_escalated;
+
     // Check for various issues
     void check_inodes();
     void check_directory_structure();
+    void scan_dir_entry(int dir_inode_num, const DirEntry &entry);
+    int find_dir_set(int inode_num);
     void check_blocks();
     void check_superblock();
+    bool quick_check_summary();
+    bool quick_check_inodes(double sample_fraction);
+
+    // Collect the repairs for a set of issues and apply them in a single inode batch
+    std::vector<FsckRepair> plan_repairs(const std::vector<int> &issue_indices);
+    void apply_repairs(const std::vector<FsckRepair> &plan);
+    void fix_issues(const std::vector<int> &issue_indices);
 
     // Fix issues
     void fix_invalid_inode(int inode_num);
-    void fix_orphaned_inode(int inode_num);
+    void fix_orphaned_inode(int inode_num, int lost_found_inode);
     void fix_duplicate_block(int block_num);
     void fix_unreferenced_block(int block_num);
     void fix_directory_loop(int inode_num);
@@ -57,6 +93,11 @@ class FileSystemCheck {
     // Run fsck and return list of issues
     std::vector<FsckIssue> check();
 
+    // Validate the superblock summary counters, clean-unmount flag, journal and a sample of
+    // inodes. Runs the full check only when something doesn't add up.
+    std::vector<FsckIssue> quick_check(double sample_fraction = 0.05);
+    bool last_quick_check_escalated() const;
+
     // Fix all fixable issues
     void fix_all_issues();
 
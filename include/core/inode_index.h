@@ -0,0 +1,47 @@
+#ifndef INODE_INDEX_H
+#define INODE_INDEX_H
+
+#include "filesystem.h"
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Sorted (key, inode) pairs over one inode attribute, for range lookups by binary search
+class AttributeIndex {
+  private:
+    std::vector<std::pair<long long, int>> sorted;
+
+  public:
+    void clear();
+    void insert(long long key, int inode_num);
+    void erase(long long key, int inode_num);
+    size_t size() const;
+
+    // Inodes whose key lies strictly between lower and upper
+    size_t count_range(long long lower, long long upper) const;
+    void scan_range(long long lower, long long upper, std::vector<int> &out) const;
+};
+
+// Secondary indexes over inode size and modification time. The key each inode was indexed
+// under is remembered so an update can find and move its old entry.
+class InodeIndex {
+  private:
+    AttributeIndex size_index;
+    AttributeIndex mtime_index;
+    std::vector<long long> size_keys;
+    std::vector<long long> mtime_keys;
+    std::vector<bool> indexed;
+
+  public:
+    InodeIndex();
+
+    void clear();
+
+    // Re-index one inode; free inodes (mode 0) are dropped
+    void update(int inode_num, const Inode &inode);
+
+    const AttributeIndex &by_size() const;
+    const AttributeIndex &by_mtime() const;
+};
+
+#endif // INODE_INDEX_H
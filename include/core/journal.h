@@ -34,6 +34,11 @@ class Journal {
     int current_block;
     int next_transaction_id;
     bool active_transaction;
+    // The open transaction's records, one block each in journal order. Nothing reaches the
+    // disk until commit, which writes the records and then every home block at once.
+    std::vector<char> log;
+    std::vector<int> home_blocks;
+    std::vector<size_t> home_offsets; // Where each home block's data sits in log
 
     void write_journal_block(int block_offset, const char *data, int size);
     void read_journal_block(int block_offset, char *data, int size);
@@ -45,7 +50,9 @@ class Journal {
     void log_metadata_block(int block_num, const char *data);
     void log_data_block(int block_num, const char *data);
     void commit_transaction();
+    int max_blocks_per_transaction() const;
     void recover();
+    bool is_empty();
 };
 
 #endif // JOURNAL_H
@@ -0,0 +1,57 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include "filesystem.h"
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One directory entry as seen by the index. Free slots have inode_num == -1.
+struct NameIndexEntry {
+    int dir_inode;
+    int inode_num;
+    int is_dir;
+    char name[MAX_FILENAME_LENGTH];
+};
+
+// Trigram index over directory entry names. Each entry is a slot in a flat table, and every
+// lower-cased trigram of its name maps to a sorted posting list of slot ids, so a substring
+// lookup is an intersection of a few short lists followed by verification of the survivors.
+class NameIndex {
+  private:
+    std::vector<NameIndexEntry> entries;
+    std::vector<int> free_slots;
+    std::unordered_map<uint32_t, std::vector<int>> postings;
+    std::vector<int> dir_entry; // Slot naming each directory inode, or -1
+    std::unordered_map<std::string, int> slot_by_key; // entry_key of each live slot
+
+    // "dir_inode/name", unique per live entry since a directory holds each name once
+    static std::string entry_key(int dir_inode, const char *name);
+    static void name_trigrams(const char *name, std::vector<uint32_t> &out);
+    void add_postings(int slot);
+    void remove_postings(int slot);
+
+  public:
+    NameIndex();
+
+    void clear();
+    void add(int dir_inode, const char *name, int inode_num, bool is_dir);
+    void remove(int dir_inode, const char *name);
+
+    // Slots whose names contain every trigram of literal (case-insensitive). Returns false
+    // when the literal is too short for the index to narrow anything down.
+    bool candidates(const std::string &literal, std::vector<int> &out) const;
+
+    const NameIndexEntry &get_entry(int slot) const;
+    int slot_count() const; // Including free slots, which have inode_num == -1
+
+    // Path of a slot relative to the root ("dir/name"), or "" if it is not reachable
+    std::string path_of(int slot) const;
+
+    // The index file is tied to the image by a stamp stored in the superblock
+    bool save(const std::string &file_name, int stamp) const;
+    bool load(const std::string &file_name, int stamp);
+};
+
+#endif // NAME_INDEX_H
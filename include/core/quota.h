@@ -2,7 +2,12 @@
 #define QUOTA_H
 
 #include "filesystem.h"
+#include "usage_scanner.h"
+#include <atomic>
+#include <mutex>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 struct QuotaEntry {
     int blocks_used;
@@ -14,22 +19,76 @@ struct QuotaEntry {
     time_t grace_period_start;
 };
 
+// Usage and limits of one entry that has a limit, as the allocation checks read them
+struct QuotaCounter {
+    int blocks_soft_limit;
+    int blocks_hard_limit;
+    int inodes_soft_limit;
+    int inodes_hard_limit;
+    std::atomic<int> blocks_used;
+    std::atomic<int> inodes_used;
+    std::atomic<time_t> grace_period_start;
+};
+
+// The entries with a limit, published for the checks. Only the counters change once a table
+// is published; anything else makes a new table.
+struct QuotaTable {
+    std::unordered_map<int, QuotaCounter> users;
+    std::unordered_map<int, QuotaCounter> groups;
+    std::unordered_map<int, QuotaCounter> projects;
+    time_t grace_period;
+};
+
+// Every public method but the would_exceed checks takes quota_mutex, so writers charging
+// usage under the shared namespace lock, quota setters and readers can run at once. The
+// checks run before every allocation and take no lock: they read the published table, whose
+// counters charge keeps in step with the maps. The mutex is never held across a call that
+// takes a FileSystem lock: the filesystem charges usage with alloc_mutex held, so that lock
+// always comes first.
 class QuotaManager {
   private:
     FileSystem *fs;
+    mutable std::recursive_mutex quota_mutex;
     std::unordered_map<int, QuotaEntry> user_quotas;  // UID to quota
     std::unordered_map<int, QuotaEntry> group_quotas; // GID to quota
+    std::unordered_map<int, QuotaEntry> project_quotas; // Directory inode to quota
+    std::vector<bool> project_roots; // Per inode, for the walk up the parent chain
     time_t grace_period;                              // Default grace period in seconds (7 days)
+    // nullptr while no entry has a limit, so every check passes at once. A check may still
+    // be reading a replaced table, so those are kept until the manager goes away.
+    std::atomic<QuotaTable *> limits;
+    std::vector<QuotaTable *> retired_tables;
+
+    // Replace usage with the totals from a scan
+    void apply_usage(std::unordered_map<int, QuotaEntry> &quotas,
+                     const std::unordered_map<int, UsageTotals> &usage);
+
+    // Check if specific user/group would go over quota. The counter is looked up in place,
+    // and the clock is only read once usage has reached a soft limit.
+    static bool is_over_quota(const std::unordered_map<int, QuotaCounter> &counters, int id,
+                              int blocks_needed, int inodes_needed, time_t grace_period);
+    // Build and publish the table from the maps; called whenever limits or usage are replaced
+    void publish_limits();
+    // Copy an entry's usage into the published table after a charge
+    static void update_counter(std::unordered_map<int, QuotaCounter> &counters, int id,
+                               const QuotaEntry &quota);
 
-    // Calculate current usage
-    void calculate_user_usage();
-    void calculate_group_usage();
+    // The entry for id, added with zero usage and no limits the first time it is charged
+    static QuotaEntry &entry_for(std::unordered_map<int, QuotaEntry> &quotas, int id);
 
-    // Check if specific user/group is over quota
-    bool is_over_quota(const QuotaEntry &quota, bool check_blocks, bool check_inodes);
+    // Start the grace period when usage first crosses a soft limit
+    void start_grace_if_over(QuotaEntry &quota, time_t now);
+
+    // Read limits, grace periods and usage from the quota file. Returns true only when the
+    // saved usage could be used as well, so no scan is needed.
+    bool load();
+
+    // Apply a scan's totals to every entry
+    void apply_report(const UsageReport &report);
 
   public:
     QuotaManager(FileSystem *fs);
+    ~QuotaManager();
 
     // Set quotas
     void set_user_quota(int uid, int blocks_soft, int blocks_hard, int inodes_soft,
@@ -37,18 +96,54 @@ class QuotaManager {
     void set_group_quota(int gid, int blocks_soft, int blocks_hard, int inodes_soft,
                          int inodes_hard);
 
+    // Project quotas cover a directory and everything below it. Setting every limit to 0
+    // removes the project; the directory must exist.
+    bool set_project_quota(int dir_inode, int blocks_soft, int blocks_hard, int inodes_soft,
+                           int inodes_hard);
+
+    // Also called by FileSystem when the directory is freed, inside its transaction, so the
+    // quota file is not rewritten here
+    void remove_project_quota(int dir_inode);
+
     // Get quota information
     QuotaEntry get_user_quota(int uid);
     QuotaEntry get_group_quota(int gid);
+    QuotaEntry get_project_quota(int dir_inode);
+
+    // Every project with its usage, ordered by directory inode. Usage is kept current, so
+    // this only copies the entries.
+    std::vector<std::pair<int, QuotaEntry>> get_project_report() const;
 
-    // Check if operation would exceed quota
-    bool would_exceed_quota(int uid, int gid, int blocks_needed, int inodes_needed);
+    // Check if operation would exceed quota. FileSystem asks before every allocation, so
+    // these copy nothing and take no lock.
+    bool would_exceed_quota(int uid, int gid, int blocks_needed, int inodes_needed) const;
+    bool user_would_exceed(int uid, int blocks_needed, int inodes_needed) const;
+    bool group_would_exceed(int gid, int blocks_needed, int inodes_needed) const;
+    // Checks every project from inode_num up to the root
+    bool project_would_exceed(int inode_num, int blocks_needed, int inodes_needed) const;
 
-    // Update quota usage after file system operation
+    // Apply a usage delta. FileSystem calls this on every allocation, free, inode creation
+    // and removal, so usage stays exact without rescanning.
+    void charge(int uid, int gid, int blocks, int inodes);
+
+    // Apply a usage delta to every project enclosing inode_num, walking the filesystem's
+    // cached parent chain. Inodes not yet linked into a directory reach no project.
+    void charge_projects(int inode_num, int blocks, int inodes);
+
+    // Recompute usage from scratch with one UsageScanner pass. Only needed when the quota
+    // file's usage can't be trusted, and for verification.
     void update_usage();
 
+    // Rescan and report whether the incrementally maintained usage was exact
+    bool verify_usage();
+
     // Set grace period
     void set_grace_period(time_t seconds);
+
+    // Write every entry to the quota file as sorted fixed-size records. Limit changes are
+    // saved immediately; usage is saved here and when the filesystem unmounts. Does nothing
+    // once the manager has been detached.
+    bool save();
 };
 
 #endif // QUOTA_H
@@ -0,0 +1,45 @@
+#ifndef READ_VIEW_H
+#define READ_VIEW_H
+
+#include "filesystem.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// A read-only picture of the tree as of one committed generation. Opening a view takes the
+// generation's inode table and pins every block it references; writers then put new
+// contents in fresh blocks and hold back freeing pinned ones, so a long scan sees one
+// consistent state while changes carry on and neither side waits for the other.
+//
+// The view carries copies of the name and attribute indexes, taken with the table, so
+// index lookups match what the view shows and never touch the live ones. Views of the same
+// generation share the table and the copies.
+//
+// The const accessors can be called from several threads at once. A view stops showing
+// anything once the filesystem is unmounted or formatted.
+class ReadView {
+  private:
+    FileSystem *fs;
+    int view_id; // -1 if nothing was mounted
+    std::shared_ptr<const ViewState> state;
+
+  public:
+    explicit ReadView(FileSystem *fs);
+    ~ReadView();
+    ReadView(const ReadView &) = delete;
+    ReadView &operator=(const ReadView &) = delete;
+
+    bool is_open() const;
+    unsigned long long get_generation() const;
+    const std::vector<Inode> &get_inodes() const;
+    const NameIndex *get_name_index() const;
+    const InodeIndex *get_inode_index() const;
+
+    // An inode with mode 0 when inode_num is out of range
+    Inode get_inode(int inode_num) const;
+    int get_parent_dir(int inode_num) const;
+    std::vector<DirEntry> get_dir_entries(int inode_num) const;
+    bool read_inode_data(int inode_num, std::string &content) const;
+};
+
+#endif // READ_VIEW_H
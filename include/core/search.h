@@ -2,43 +2,84 @@
 #define SEARCH_H
 
 #include "filesystem.h"
+#include "search_expression.h"
+#include "search_query.h"
+#include <atomic>
 #include <functional>
 #include <string>
+#include <utility>
 #include <vector>
 
-enum class SearchCriteriaType {
-    NAME,
-    SIZE_GREATER_THAN,
-    SIZE_LESS_THAN,
-    MODIFIED_AFTER,
-    MODIFIED_BEFORE,
-    FILE_TYPE,
-    PERMISSION
-};
-
-struct SearchCriteria {
-    SearchCriteriaType type;
-    std::string stringValue;
-    int intValue;
-    time_t timeValue;
-};
-
 struct SearchResult {
     std::string path;
     int inode_num;
     bool is_dir;
     int size;
     time_t modification_time;
+    std::vector<ContentHit> content_hits; // Where CONTENT patterns occur, in file order
 };
 
+// Access paths the planner chooses between for a query
+enum class SearchPlan {
+    TREE_WALK,   // Visit every directory from the root
+    NAME_INDEX,  // Verify the entries the trigram name index returns
+    SIZE_INDEX,  // Verify the inodes in a size range
+    MTIME_INDEX  // Verify the inodes in a modification-time range
+};
+
+// Receives each result as soon as it is found; return false to stop the search
+using SearchCallback = std::function<bool(const SearchResult &)>;
+
 class FileSystemSearch {
   private:
     FileSystem *fs;
     std::vector<SearchCriteria> criteria;
+    unsigned thread_count; // Worker threads for walks and content scans, 0 = one per core
+    QueryExpression parsed_query; // Used instead of criteria when has_parsed_query is set
+    bool has_parsed_query;
+
+    // Complete result sets of recent queries, valid while the filesystem generation matches
+    struct CachedSearch {
+        std::string key;
+        unsigned long long generation;
+        std::vector<SearchResult> results;
+        unsigned long long last_used;
+    };
+    std::vector<CachedSearch> cache;
+    size_t cache_capacity;
+    unsigned long long cache_clock;
+
+    const CachedSearch *find_cached(const std::string &key, unsigned long long generation);
+    void store_cached(const std::string &key, unsigned long long generation,
+                      std::vector<SearchResult> &results);
 
-    bool match_criteria(const Inode &inode, const std::string &name, const std::string &path);
-    void search_directory(int dir_inode, const std::string &current_path,
-                          std::vector<SearchResult> &results);
+    unsigned worker_count() const;
+
+    // The expression to run, unplanned and planned against the view's attribute index
+    QueryExpression current_query() const;
+    QueryExpression build_query(const ReadView &view);
+
+    // Match the entries of one directory, collecting hits and the subdirectories to visit.
+    // Only inodes set in candidates (when given) are matched.
+    void scan_directory(const ReadView &view, int dir_inode, const std::string &current_path,
+                        const QueryExpression &query, const std::vector<bool> *candidates,
+                        std::vector<SearchResult> &results,
+                        std::vector<std::pair<int, std::string>> &subdirs);
+
+    // Estimate how many entries each usable index would hand back and pick the smallest.
+    // candidates receives name index slots or inode numbers depending on the plan.
+    SearchPlan plan_search(const ReadView &view, const CompiledQuery &query,
+                           std::vector<int> &candidates);
+
+    // Index plans collect unverified results, then check them all against the expression,
+    // spreading the files over worker threads when content has to be read. The indexes are
+    // the view's copies, taken together with its inode table.
+    void search_name_index(const ReadView &view, const std::vector<int> &slots,
+                           std::vector<SearchResult> &results);
+    void search_attribute_index(const ReadView &view, const std::vector<bool> &candidates,
+                                std::vector<SearchResult> &results);
+    void verify_results(const ReadView &view, const QueryExpression &query,
+                        std::vector<SearchResult> &results);
 
   public:
     FileSystemSearch(FileSystem *fs);
@@ -51,10 +92,32 @@ class FileSystemSearch {
     void add_modified_before(time_t time);
     void add_file_type(const std::string &type); // "file", "dir", "symlink"
     void add_permission(int perm);
+    void add_content_criteria(const std::string &text); // Byte-exact, matched in file data
+
+    // Use a query such as name~"log" AND (size>1M OR type=symlink) AND NOT path:/tmp
+    // instead of the criteria above. Returns false with a message for malformed text.
+    bool set_query(const std::string &text, std::string &error);
 
     // Execute search
     std::vector<SearchResult> search();
 
+    // Fan subtrees out to worker threads and stream results to on_result on the calling
+    // thread. Stops after limit results (0 = no limit), when on_result returns false or when
+    // cancel becomes true. Returns the number of results delivered.
+    size_t search(const SearchCallback &on_result, size_t limit = 0,
+                  const std::atomic<bool> *cancel = nullptr);
+
+    void set_thread_count(unsigned count);
+
+    // Finished searches are cached per query until the filesystem changes; 0 disables it
+    void set_cache_capacity(size_t entries);
+    void clear_cache();
+
+    // Access path the next search would take with the current criteria, and the planned
+    // evaluation order
+    SearchPlan explain();
+    std::string describe_query();
+
     // Clear all criteria
     void clear_criteria();
 };
@@ -0,0 +1,119 @@
+#ifndef SEARCH_EXPRESSION_H
+#define SEARCH_EXPRESSION_H
+
+#include "filesystem.h"
+#include "search_query.h"
+#include <string>
+#include <vector>
+
+class InodeIndex;
+class ReadView;
+
+enum class QueryNodeType {
+    AND,
+    OR,
+    NOT,
+    PREDICATE
+};
+
+// A boolean search expression such as
+//   name~"log" AND (size>1M OR type=symlink) AND NOT path:/tmp
+// Fields are name (~ pattern, = exact), size (> < = with K/M/G), mtime (> < epoch seconds),
+// type (= file/dir/symlink), perm (= octal), content (~ or :) and path (: prefix). A bare
+// word is a name pattern, and adjacent terms are ANDed.
+//
+// The tree is stored as flat node and predicate tables. plan() orders the children of every
+// AND and OR so the cheapest, most decisive branches are evaluated first.
+class QueryExpression {
+  private:
+    struct Node {
+        QueryNodeType type;
+        std::vector<int> children;
+        int predicate; // Index into predicates for PREDICATE nodes
+        double cost;   // Estimated work per entry
+        double selectivity;
+    };
+
+    struct Predicate {
+        std::vector<SearchCriteria> criteria; // ANDed, e.g. size= becomes > and <
+        CompiledQuery compiled;
+        bool is_path;
+        std::string path_prefix; // Relative to the root, without surrounding slashes
+        std::string text;        // As written, for describe()
+    };
+
+    // Outcome of a predicate when only some facts about an entry are known
+    enum class Tristate {
+        NEVER,
+        ALWAYS,
+        MAYBE
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Predicate> predicates;
+    int root; // -1 matches everything
+    CompiledQuery required_query;
+    bool has_path;
+    bool has_content;
+
+    // Recursive-descent parser state
+    std::vector<std::string> tokens;
+    size_t position;
+    std::string parse_error;
+
+    bool tokenize(const std::string &text);
+    int parse_or();
+    int parse_and();
+    int parse_not();
+    int parse_predicate(const std::string &token);
+    int add_node(QueryNodeType type, int predicate);
+    int add_predicate(const std::vector<SearchCriteria> &criteria, const std::string &text);
+    int add_path_predicate(const std::string &prefix, const std::string &text);
+    void finish();
+
+    bool evaluate(int node, const ReadView &view, int inode_num, const Inode &inode,
+                  const char *name, const std::string &path, std::string &data,
+                  bool &data_loaded, std::vector<ContentHit> *hits) const;
+    Tristate evaluate_below(int node, const std::string &dir_path) const;
+    void plan_node(int node, const InodeIndex *attributes);
+    std::string describe_node(int node) const;
+    std::string canonical_node(int node) const;
+
+  public:
+    QueryExpression();
+
+    // The implicit AND of a criteria list, as built by the add_* methods of FileSystemSearch
+    explicit QueryExpression(const std::vector<SearchCriteria> &criteria);
+
+    // Replace the expression with the parsed text. On failure error describes the problem
+    // and the expression is left empty.
+    bool parse(const std::string &text, std::string &error);
+
+    // Estimate cost and selectivity bottom-up, using the attribute index for size and mtime
+    // ranges when there is one, and reorder AND/OR children accordingly
+    void plan(const InodeIndex *attributes);
+
+    bool empty() const;
+    bool uses_path() const;
+    bool uses_content() const;
+
+    // Predicates every match must satisfy (top-level AND), for choosing an index
+    const CompiledQuery &required() const;
+
+    // Full evaluation of one entry. File data is read at most once, from the view, and only
+    // if a content predicate is reached; hits receives the content matches that were found.
+    bool matches(const ReadView &view, int inode_num, const Inode &inode, const char *name,
+                 const std::string &path, std::vector<ContentHit> *hits) const;
+
+    // False when path predicates rule out every entry below dir_path ("" for the root)
+    bool may_match_below(const std::string &dir_path) const;
+
+    // The planned tree, for explaining a search
+    std::string describe() const;
+
+    // The same text for equivalent queries however they were written: predicates are
+    // spelled from their criteria and AND/OR operands are sorted
+    std::string canonical() const;
+};
+
+#endif // SEARCH_EXPRESSION_H
@@ -0,0 +1,130 @@
+#ifndef SEARCH_QUERY_H
+#define SEARCH_QUERY_H
+
+#include "filesystem.h"
+#include <ctime>
+#include <regex>
+#include <string>
+#include <vector>
+
+enum class SearchCriteriaType {
+    NAME,
+    SIZE_GREATER_THAN,
+    SIZE_LESS_THAN,
+    MODIFIED_AFTER,
+    MODIFIED_BEFORE,
+    FILE_TYPE,
+    PERMISSION,
+    CONTENT
+};
+
+struct SearchCriteria {
+    SearchCriteriaType type;
+    std::string stringValue;
+    int intValue;
+    time_t timeValue;
+};
+
+// How a NAME pattern is matched once it has been classified
+enum class NameMatchKind {
+    SUBSTRING,
+    PREFIX,
+    SUFFIX,
+    EXACT,
+    GLOB,
+    REGEX
+};
+
+// Case-insensitive name matcher. Patterns are regexes as far as the user is concerned, but
+// plain literals, ^prefix, suffix$ and shell globs get a fast non-regex path and a real
+// regex is only compiled (once) when the pattern needs it.
+class NameMatcher {
+  private:
+    NameMatchKind kind;
+    std::string literal; // Lower-cased literal or glob
+    std::regex pattern;
+
+    static bool glob_match(const char *glob, const char *name);
+
+  public:
+    explicit NameMatcher(const std::string &pattern_text);
+
+    NameMatchKind get_kind() const;
+    const std::string &get_literal() const;
+    bool matches(const char *name) const;
+};
+
+// One occurrence of a content pattern in a file
+struct ContentHit {
+    int offset;  // Byte offset into the file data
+    int pattern; // Index of the pattern within its matcher, in the order they were added
+};
+
+// Finds every occurrence of a set of byte patterns in a single pass (multi-pattern Horspool).
+// The window is as long as the shortest pattern and moves by the smallest skip any pattern
+// allows for the byte under its last position; only patterns whose window ends in that byte
+// are compared in full.
+class ContentMatcher {
+  private:
+    std::vector<std::string> patterns;
+    size_t window;
+    size_t shift[256];
+    std::vector<int> ending_with[256];
+
+  public:
+    ContentMatcher();
+
+    void add_pattern(const std::string &pattern);
+    bool empty() const;
+    size_t pattern_count() const;
+
+    // Record up to max_hits hits in file order. Returns a bit per pattern that occurred at
+    // least once, whether or not its hits fit.
+    unsigned long long scan(const char *data, size_t length, std::vector<ContentHit> &hits,
+                            size_t max_hits) const;
+
+    // Bits for every pattern, to compare against the result of scan
+    unsigned long long all_patterns() const;
+};
+
+// A criteria vector compiled into a reusable predicate. Cheap inode attribute checks run
+// first, then name matchers ordered from cheapest to most expensive.
+class CompiledQuery {
+  private:
+    struct AttributePredicate {
+        SearchCriteriaType type;
+        long long value;
+    };
+
+    std::vector<AttributePredicate> attribute_predicates;
+    std::vector<NameMatcher> name_matchers;
+    ContentMatcher content_matcher;
+
+    bool attribute_range(SearchCriteriaType above, SearchCriteriaType below, long long &lower,
+                         long long &upper) const;
+
+  public:
+    CompiledQuery();
+    explicit CompiledQuery(const std::vector<SearchCriteria> &criteria);
+
+    bool empty() const;
+
+    // Everything except CONTENT; a query with content patterns only matches regular files
+    bool matches(const Inode &inode, const char *name) const;
+
+    // Patterns every matching file must contain, checked after matches() passes
+    const ContentMatcher &content() const;
+
+    // Rough relative work of one evaluation, for ordering predicates
+    double estimated_cost() const;
+
+    // Longest literal every match must contain, for narrowing candidates with the name index
+    bool index_literal(std::string &literal) const;
+
+    // Exclusive bounds implied by the size or modification-time criteria. Returns false when
+    // the query does not constrain that attribute.
+    bool size_range(long long &lower, long long &upper) const;
+    bool mtime_range(long long &lower, long long &upper) const;
+};
+
+#endif // SEARCH_QUERY_H
@@ -3,6 +3,7 @@
 
 #include "filesystem.h"
 #include <ctime>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -10,28 +11,24 @@ struct SnapshotInfo {
     std::string name;
     time_t creation_time;
     int blocks_used;
+    int exclusive_blocks; // Freed if this snapshot alone were deleted
 };
 
+// Named copy-on-write snapshots. The filesystem keeps each one as a saved inode table whose
+// blocks are shared with the live tree until either side changes them.
 class SnapshotManager {
   private:
     FileSystem *fs;
-    std::string snapshot_dir;
-
-    // Copy data blocks for snapshot
-    void copy_blocks(const Inode &src_inode, int dest_inode_num);
-
-    // Copy a directory recursively
-    void copy_directory(int src_dir_inode, int dest_dir_inode);
-
-    // Create a snapshot directory if it doesn't exist
-    int ensure_snapshot_directory();
-
-    // Calculate blocks used by a directory tree
-    int calculate_blocks_used(int dir_inode);
 
     // Get snapshot info
     std::vector<SnapshotInfo> get_snapshots_info();
 
+    // Saved inode table of a snapshot; an empty name gives a table with every inode free
+    bool load_table(const std::string &name, std::vector<Inode> &table);
+
+    // Live entries of a directory from any inode table, by name
+    void read_entries(const Inode &dir, std::map<std::string, int> &entries);
+
   public:
     SnapshotManager(FileSystem *fs);
 
@@ -49,6 +46,16 @@ class SnapshotManager {
 
     // Get a specific snapshot's info
     SnapshotInfo get_snapshot_info(const std::string &name);
+
+    // Write the changes from snapshot base to snapshot name into a stream file, or the
+    // whole of name when base is empty. Inodes whose generation is unchanged are skipped
+    // without being read, so the stream grows with the churn rather than the image.
+    bool send(const std::string &base, const std::string &name, const std::string &path);
+
+    // Apply a stream to this image and snapshot the result under the stream's name, ready
+    // to be the base of the next one. The live tree must still match the stream's base;
+    // a full stream needs an image holding nothing but the root.
+    bool receive(const std::string &path);
 };
 
 #endif // SNAPSHOT_H
@@ -0,0 +1,50 @@
+#ifndef USAGE_SCANNER_H
+#define USAGE_SCANNER_H
+
+#include "filesystem.h"
+#include <unordered_map>
+#include <vector>
+
+class ReadView;
+
+// Blocks and inodes charged to one owner or held by one subtree
+struct UsageTotals {
+    int blocks;
+    int inodes;
+};
+
+// Everything a single scan produces. Subtree totals follow each inode's first link, the
+// parent chain project quotas use, so a hard-linked file is counted once.
+struct UsageReport {
+    std::unordered_map<int, UsageTotals> by_uid;
+    std::unordered_map<int, UsageTotals> by_gid;
+    std::vector<int> inode_blocks;    // Blocks held by each inode itself
+    std::vector<UsageTotals> subtree; // Each inode plus everything below it (du)
+    UsageTotals total;
+};
+
+// Shared usage scan for quota verification, du and snapshot sizing. The inode table is
+// walked once and every indirect block is read once, split over worker threads.
+class UsageScanner {
+  private:
+    FileSystem *fs;
+    unsigned thread_count; // 0 picks from the hardware
+
+    unsigned worker_count() const;
+    // Subtree totals are rolled up only when a view supplies the parent chain
+    UsageReport scan_inodes(const std::vector<Inode> &inodes, const ReadView *view);
+
+  public:
+    explicit UsageScanner(FileSystem *fs);
+
+    void set_thread_count(unsigned count);
+
+    // The live tree, read through a ReadView so changes made during the scan don't show
+    UsageReport scan();
+
+    // A saved inode table such as a snapshot's. Its parent chain isn't cached, so subtree
+    // totals are left at zero; total and the per-owner figures are filled in.
+    UsageReport scan(const std::vector<Inode> &table);
+};
+
+#endif // USAGE_SCANNER_H
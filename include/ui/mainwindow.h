@@ -90,10 +90,12 @@ class MainWindow : public QMainWindow {
     void on_actionDetectFilesystems_triggered();
     void on_searchButton_clicked();
     void checkAvailableFilesystems();
+    void reclaimBlocks();
     void updateAvailableFilesystemsList();
     void onDirectorySelected(const std::string &path);
     void refreshTreeView();
     void on_actionFsCheckAndFix_triggered();
+    void on_actionFsQuickCheck_triggered();
     void on_actionCreateLostFound_triggered();
 
     // Override for drag and drop support
@@ -116,6 +118,7 @@ class MainWindow : public QMainWindow {
     std::unique_ptr<TreeViewManager> treeViewManager;
 
     QTimer *fsDetectionTimer;
+    QTimer *reclaimTimer; // Frees blocks dropped by snapshot restores and deletes
     QStringList availableFilesystems;
 
     std::string current_open_file;
@@ -0,0 +1,388 @@
+#include "core/async_io.h"
+#include "core/block_device.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// Threads serving requests when there is no ring
+const int POOL_THREADS = 4;
+
+// When waiting on the ring fails, its completions are collected by polling for up to
+// DRAIN_ATTEMPTS * DRAIN_WAIT_US (10 s) before the ring is given up
+const int DRAIN_ATTEMPTS = 1000;
+const useconds_t DRAIN_WAIT_US = 10000;
+
+// The ring is driven with raw system calls so the build needs nothing beyond kernel headers
+int io_uring_setup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(
+        syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+} // namespace
+
+// The kernel and this process share the rings. Only the kernel moves sq_head and cq_tail,
+// only we move sq_tail and cq_head; each side publishes with a release store.
+struct AsyncIo::Ring {
+    int fd;
+    unsigned entries;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map; // Same as sq_map when the kernel maps both rings together
+    size_t cq_map_size;
+    io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+};
+
+AsyncIo::Ring *AsyncIo::open_ring(unsigned entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = io_uring_setup(entries, &params);
+    if (fd < 0) {
+        // No io_uring in this kernel, or it has been switched off; the pool takes over
+        return nullptr;
+    }
+
+    Ring *ring = new Ring();
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map) {
+        ring->sq_map_size = ring->cq_map_size = std::max(ring->sq_map_size, ring->cq_map_size);
+    }
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+    ring->sq_map = mmap(nullptr, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_map = ring->sq_map;
+    if (!single_map && ring->sq_map != MAP_FAILED) {
+        ring->cq_map = mmap(nullptr, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (ring->cq_map != MAP_FAILED) {
+        sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd, IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+        std::cerr << "Warning: Could not map the I/O ring: " << strerror(errno) << std::endl;
+        if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map) {
+            munmap(ring->cq_map, ring->cq_map_size);
+        }
+        if (ring->sq_map != MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_size);
+        }
+        ::close(fd);
+        delete ring;
+        return nullptr;
+    }
+    ring->sqes = static_cast<io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(ring->sq_map);
+    ring->sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring->sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    char *cq = static_cast<char *>(ring->cq_map);
+    ring->cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return ring;
+}
+
+void AsyncIo::close_ring(Ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    ::close(ring->fd);
+    delete ring;
+}
+
+AsyncIo::AsyncIo(BlockDevice *device, int depth)
+    : device(device), depth(std::max(depth, 1)), outstanding(0), ring(nullptr),
+      stopping(false), retired(false) {
+    ring = open_ring(static_cast<unsigned>(this->depth));
+    if (ring) {
+        // In-flight requests are capped at the submission ring's size, and the completion
+        // ring is at least that big, so completions never overflow
+        slots.resize(ring->entries);
+        for (int i = static_cast<int>(ring->entries) - 1; i >= 0; --i) {
+            free_slots.push_back(i);
+        }
+        return;
+    }
+    int threads = std::min(this->depth, POOL_THREADS);
+    for (int i = 0; i < threads; ++i) {
+        workers.emplace_back(&AsyncIo::worker_loop, this);
+    }
+}
+
+AsyncIo::~AsyncIo() {
+    if (ring) {
+        // The kernel may still be filling our buffers; let it finish before unmapping
+        std::vector<IoCompletion> discarded;
+        while (outstanding > 0 && reap(discarded, outstanding) > 0) {
+            discarded.clear();
+        }
+        close_ring(ring);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+bool AsyncIo::uses_io_uring() const {
+    return ring != nullptr;
+}
+
+bool AsyncIo::is_usable() const {
+    return !retired;
+}
+
+int AsyncIo::get_outstanding() const {
+    return outstanding;
+}
+
+bool AsyncIo::run_sync(const IoRequest &request) {
+    if (request.write) {
+        return device->write_run(request.first_block, request.count, request.buffer);
+    }
+    return device->read_run(request.first_block, request.count, request.buffer);
+}
+
+void AsyncIo::submit(const std::vector<IoRequest> &requests) {
+    if (requests.empty()) {
+        return;
+    }
+    outstanding += static_cast<int>(requests.size());
+    if (retired) {
+        // No ring and no pool any more; the requests are done here and reaped as usual
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        for (const auto &request : requests) {
+            finished.push_back({request.tag, run_sync(request)});
+        }
+        return;
+    }
+    if (ring) {
+        backlog.insert(backlog.end(), requests.begin(), requests.end());
+        // Anything the ring refuses outright is done synchronously and reaped as usual
+        std::vector<IoCompletion> refused;
+        fill_ring(refused);
+        if (!refused.empty()) {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            finished.insert(finished.end(), refused.begin(), refused.end());
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        backlog.insert(backlog.end(), requests.begin(), requests.end());
+    }
+    work_ready.notify_all();
+}
+
+void AsyncIo::fill_ring(std::vector<IoCompletion> &completions) {
+    unsigned tail = *ring->sq_tail;
+    unsigned added = 0;
+    int block_size = device->get_block_size();
+    while (!backlog.empty() && !free_slots.empty()) {
+        IoRequest request = backlog.front();
+        backlog.pop_front();
+        int slot = free_slots.back();
+        free_slots.pop_back();
+        slots[slot] = request;
+
+        unsigned index = tail & *ring->sq_mask;
+        io_uring_sqe *sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = device->get_fd();
+        sqe->addr = reinterpret_cast<uintptr_t>(request.buffer);
+        sqe->len = static_cast<unsigned>(request.count) * block_size;
+        sqe->off = static_cast<unsigned long long>(request.first_block) * block_size;
+        sqe->user_data = static_cast<unsigned long long>(slot);
+        ring->sq_array[index] = index;
+        tail++;
+        added++;
+    }
+    if (added == 0) {
+        return;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (added > 0) {
+        int submitted = io_uring_enter(ring->fd, added, 0, 0);
+        if (submitted < 0 && errno == EINTR) {
+            continue;
+        }
+        if (submitted <= 0) {
+            break;
+        }
+        added -= static_cast<unsigned>(submitted);
+    }
+    if (added == 0) {
+        return;
+    }
+
+    // The kernel wouldn't take the rest. It only looks at the tail inside io_uring_enter, so
+    // the entries can be withdrawn and done here instead.
+    std::cerr << "Warning: I/O ring refused " << added << " request(s): " << strerror(errno)
+              << std::endl;
+    for (unsigned position = tail - added; position != tail; ++position) {
+        int slot = static_cast<int>(ring->sqes[position & *ring->sq_mask].user_data);
+        completions.push_back({slots[slot].tag, run_sync(slots[slot])});
+        free_slots.push_back(slot);
+    }
+    __atomic_store_n(ring->sq_tail, tail - added, __ATOMIC_RELEASE);
+}
+
+void AsyncIo::reap_ring(std::vector<IoCompletion> &completions, int min_complete) {
+    size_t start = completions.size();
+    while (true) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        int block_size = device->get_block_size();
+        for (; head != tail; ++head) {
+            const io_uring_cqe &cqe = ring->cqes[head & *ring->cq_mask];
+            int slot = static_cast<int>(cqe.user_data);
+            const IoRequest &request = slots[slot];
+            // A short or failed transfer is redone synchronously, which continues short
+            // transfers and reports real errors
+            bool ok = cqe.res == request.count * block_size || run_sync(request);
+            completions.push_back({request.tag, ok});
+            free_slots.push_back(slot);
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        // Freed slots let the backlog move on
+        fill_ring(completions);
+
+        int in_flight = static_cast<int>(slots.size() - free_slots.size());
+        if (static_cast<int>(completions.size() - start) >= min_complete || in_flight == 0) {
+            return;
+        }
+        if (io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            std::cerr << "Error: Could not wait on the I/O ring: " << strerror(errno)
+                      << std::endl;
+            return;
+        }
+    }
+}
+
+void AsyncIo::worker_loop() {
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    while (true) {
+        work_ready.wait(lock, [this] { return stopping || !backlog.empty(); });
+        if (backlog.empty()) {
+            return; // Stopping, and everything queued has been done
+        }
+        IoRequest request = backlog.front();
+        backlog.pop_front();
+        lock.unlock();
+        bool ok = run_sync(request);
+        lock.lock();
+        finished.push_back({request.tag, ok});
+        work_done.notify_all();
+    }
+}
+
+int AsyncIo::reap(std::vector<IoCompletion> &completions, int min_complete) {
+    size_t start = completions.size();
+    min_complete = std::min(min_complete, outstanding);
+    {
+        // Requests done synchronously at submit time wait here in both modes
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        if (!ring) {
+            work_done.wait(lock, [&] { return static_cast<int>(finished.size()) >= min_complete; });
+        }
+        completions.insert(completions.end(), finished.begin(), finished.end());
+        finished.clear();
+    }
+    if (ring) {
+        int still_needed = min_complete - static_cast<int>(completions.size() - start);
+        reap_ring(completions, std::max(still_needed, 0));
+    }
+    int reaped = static_cast<int>(completions.size() - start);
+    outstanding -= reaped;
+    return reaped;
+}
+
+bool AsyncIo::drain() {
+    std::vector<IoCompletion> discarded;
+    for (int attempt = 0; outstanding > 0 && attempt < DRAIN_ATTEMPTS; ++attempt) {
+        // Collecting without waiting needs no io_uring_enter. The sleep is a system call
+        // too, which gives the kernel a chance to post completions it is holding.
+        if (reap(discarded, 0) == 0) {
+            usleep(DRAIN_WAIT_US);
+        }
+        discarded.clear();
+    }
+    return outstanding == 0;
+}
+
+void AsyncIo::retire() {
+    // Closing the ring makes the kernel cancel whatever it still holds. The engine is left
+    // doing everything synchronously and is never pooled again.
+    std::cerr << "Error: Giving up on an I/O ring with " << outstanding
+              << " request(s) still outstanding." << std::endl;
+    close_ring(ring);
+    ring = nullptr;
+    retired = true;
+    backlog.clear();
+    slots.clear();
+    free_slots.clear();
+    outstanding = 0;
+}
+
+bool AsyncIo::run(const std::vector<IoRequest> &requests) {
+    submit(requests);
+    bool ok = true;
+    std::vector<IoCompletion> completions;
+    while (outstanding > 0) {
+        completions.clear();
+        if (reap(completions, outstanding) == 0) {
+            // The ring stopped answering. The buffers belong to the caller, so nothing may
+            // still be in flight when this returns. The backlog never reached the kernel.
+            outstanding -= static_cast<int>(backlog.size());
+            backlog.clear();
+            if (!drain()) {
+                retire();
+            }
+            return false;
+        }
+        for (const auto &completion : completions) {
+            ok = ok && completion.ok;
+        }
+    }
+    return ok;
+}
@@ -0,0 +1,130 @@
+#include "core/block_backup.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+const int BACKUP_MAGIC = 0x43424B50; // "CBKP"
+const int BACKUP_VERSION = 1;
+
+struct BackupHeader {
+    int magic;
+    int version;
+    int block_size;
+    int num_blocks;
+    int block_count;
+    char checkpoint[MAX_FILENAME_LENGTH];      // The blocks changed since this checkpoint
+    char next_checkpoint[MAX_FILENAME_LENGTH]; // Started once they were written
+};
+
+} // namespace
+
+BlockBackup::BlockBackup(FileSystem *fs) : fs(fs) {
+}
+
+int BlockBackup::export_changes(const std::string &path, const std::string &next_checkpoint) {
+    if (next_checkpoint.empty() || next_checkpoint.size() >= MAX_FILENAME_LENGTH) {
+        std::cerr << "Error: Invalid checkpoint name." << std::endl;
+        return -1;
+    }
+    // The blocks are taken and cleared in one step; whatever is written from here on is
+    // marked again and goes into the next export, so nothing falls between the two
+    fs->sync();
+    std::string checkpoint = fs->get_checkpoint();
+    std::vector<int> blocks = fs->take_changed_blocks();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Error: Could not create backup file." << std::endl;
+        fs->restore_changed_blocks(blocks);
+        return -1;
+    }
+    BackupHeader header;
+    memset(&header, 0, sizeof(BackupHeader));
+    header.magic = BACKUP_MAGIC;
+    header.version = BACKUP_VERSION;
+    header.block_size = BLOCK_SIZE;
+    header.num_blocks = fs->get_superblock().num_blocks;
+    header.block_count = static_cast<int>(blocks.size());
+    strncpy(header.checkpoint, checkpoint.c_str(), MAX_FILENAME_LENGTH - 1);
+    strncpy(header.next_checkpoint, next_checkpoint.c_str(), MAX_FILENAME_LENGTH - 1);
+    out.write((const char *)&header, sizeof(header));
+
+    // Each record is the byte offset in the image followed by the block
+    char buffer[BLOCK_SIZE];
+    for (int block : blocks) {
+        long long offset = static_cast<long long>(block) * BLOCK_SIZE;
+        fs->read_block(block, buffer);
+        out.write((const char *)&offset, sizeof(offset));
+        out.write(buffer, BLOCK_SIZE);
+    }
+    out.close();
+    if (!out) {
+        std::cerr << "Error: Could not write backup file." << std::endl;
+        fs->restore_changed_blocks(blocks);
+        return -1;
+    }
+
+    // Only a complete backup moves the checkpoint on
+    if (!fs->advance_checkpoint(next_checkpoint)) {
+        fs->restore_changed_blocks(blocks);
+        return -1;
+    }
+    return header.block_count;
+}
+
+bool BlockBackup::merge(const std::string &backup_path, const std::string &image_path) {
+    std::ifstream in(backup_path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Error: Could not open backup file." << std::endl;
+        return false;
+    }
+    BackupHeader header;
+    if (!in.read((char *)&header, sizeof(header)) || header.magic != BACKUP_MAGIC ||
+        header.version != BACKUP_VERSION || header.block_size != BLOCK_SIZE ||
+        header.num_blocks <= 0 || header.block_count < 0) {
+        std::cerr << "Error: Not a block backup file." << std::endl;
+        return false;
+    }
+    long long image_size = static_cast<long long>(header.num_blocks) * BLOCK_SIZE;
+
+    std::fstream image(image_path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!image) {
+        std::ofstream create(image_path, std::ios::binary);
+        create.close();
+        image.open(image_path, std::ios::in | std::ios::out | std::ios::binary);
+    }
+    if (!image) {
+        std::cerr << "Error: Could not open image file." << std::endl;
+        return false;
+    }
+
+    long long offset;
+    char buffer[BLOCK_SIZE];
+    for (int i = 0; i < header.block_count; ++i) {
+        if (!in.read((char *)&offset, sizeof(offset)) || !in.read(buffer, BLOCK_SIZE) ||
+            offset < 0 || offset % BLOCK_SIZE != 0 || offset >= image_size) {
+            std::cerr << "Error: Backup file is truncated or damaged after " << i << " blocks."
+                      << std::endl;
+            return false;
+        }
+        image.seekp(offset, std::ios::beg);
+        image.write(buffer, BLOCK_SIZE);
+    }
+
+    // A full backup restored into a new file leaves any unwritten tail as a hole; make sure
+    // the image has its full length
+    image.seekg(0, std::ios::end);
+    if (static_cast<long long>(image.tellg()) < image_size) {
+        char zero[BLOCK_SIZE] = {0};
+        image.seekp(image_size - BLOCK_SIZE, std::ios::beg);
+        image.write(zero, BLOCK_SIZE);
+    }
+    image.flush();
+    if (!image) {
+        std::cerr << "Error: Could not write image file." << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,282 @@
+#include "core/block_device.h"
+#include "core/async_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+
+// Buffers handed to one preadv/pwritev call; longer runs take several calls
+const int MAX_IOVECS = 64;
+
+// Requests each engine keeps in flight
+const int ENGINE_DEPTH = 64;
+
+} // namespace
+
+BlockDevice::BlockDevice(int block_size) : fd(-1), block_size(block_size) {
+}
+
+BlockDevice::~BlockDevice() {
+    close();
+}
+
+bool BlockDevice::open(const std::string &path, bool create) {
+    close();
+    int flags = O_RDWR | O_CLOEXEC;
+    if (create) {
+        flags |= O_CREAT | O_TRUNC;
+    }
+    fd = ::open(path.c_str(), flags, 0644);
+    if (fd == -1) {
+        std::cerr << "Error: Could not open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void BlockDevice::close() {
+    {
+        // Engines only sit here between transfers, so none of them has anything in flight
+        std::lock_guard<std::mutex> lock(engine_mutex);
+        for (AsyncIo *engine : idle_engines) {
+            delete engine;
+        }
+        idle_engines.clear();
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool BlockDevice::is_open() const {
+    return fd != -1;
+}
+
+int BlockDevice::get_fd() const {
+    return fd;
+}
+
+int BlockDevice::get_block_size() const {
+    return block_size;
+}
+
+AsyncIo *BlockDevice::acquire_engine() {
+    {
+        std::lock_guard<std::mutex> lock(engine_mutex);
+        if (!idle_engines.empty()) {
+            AsyncIo *engine = idle_engines.back();
+            idle_engines.pop_back();
+            return engine;
+        }
+    }
+    return new AsyncIo(this, ENGINE_DEPTH);
+}
+
+void BlockDevice::release_engine(AsyncIo *engine) {
+    // A failed engine, or one with anything still outstanding, would hand its trouble to
+    // the next caller
+    if (!engine->is_usable() || engine->get_outstanding() > 0) {
+        delete engine;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(engine_mutex);
+    idle_engines.push_back(engine);
+}
+
+bool BlockDevice::transfer_run(bool write, int first_block, char *const *buffers, int count) {
+    off_t offset = static_cast<off_t>(first_block) * block_size;
+    int done = 0;       // Buffers completely transferred
+    size_t partial = 0; // Bytes already transferred of buffers[done]
+    while (done < count) {
+        int batch = std::min(count - done, MAX_IOVECS);
+        struct iovec iov[MAX_IOVECS];
+        for (int i = 0; i < batch; ++i) {
+            iov[i].iov_base = buffers[done + i];
+            iov[i].iov_len = block_size;
+        }
+        iov[0].iov_base = buffers[done] + partial;
+        iov[0].iov_len = block_size - partial;
+
+        ssize_t moved = write ? pwritev(fd, iov, batch, offset) : preadv(fd, iov, batch, offset);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            int block = first_block + done;
+            if (moved < 0) {
+                std::cerr << "Error: Could not " << (write ? "write" : "read") << " block "
+                          << block << ": " << strerror(errno) << std::endl;
+            } else {
+                std::cerr << "Error: Block " << block << " is past the end of the image."
+                          << std::endl;
+            }
+            if (!write) {
+                memset(buffers[done] + partial, 0, block_size - partial);
+                for (int i = done + 1; i < count; ++i) {
+                    memset(buffers[i], 0, block_size);
+                }
+            }
+            return false;
+        }
+
+        offset += moved;
+        size_t left = moved;
+        while (left > 0) {
+            size_t room = block_size - partial;
+            if (left < room) {
+                partial += left;
+                break;
+            }
+            left -= room;
+            partial = 0;
+            done++;
+        }
+    }
+    return true;
+}
+
+bool BlockDevice::transfer(bool write, const std::vector<int> &block_nums,
+                           const std::vector<char *> &buffers) {
+    if (fd == -1) {
+        return false;
+    }
+    std::vector<size_t> run_starts;
+    for (size_t i = 0; i < block_nums.size(); ++i) {
+        if (i == 0 || block_nums[i] != block_nums[i - 1] + 1) {
+            run_starts.push_back(i);
+        }
+    }
+    run_starts.push_back(block_nums.size());
+    if (run_starts.size() <= 2) {
+        return block_nums.empty() ||
+               transfer_run(write, block_nums[0], buffers.data(), (int)block_nums.size());
+    }
+
+    // Concurrent writes to one block could land in either order, so a list naming a block
+    // twice is written run by run to keep the last copy last
+    std::vector<int> sorted;
+    if (write) {
+        sorted = block_nums;
+        std::sort(sorted.begin(), sorted.end());
+    }
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+        bool ok = true;
+        for (size_t r = 0; r + 1 < run_starts.size(); ++r) {
+            size_t first = run_starts[r];
+            int count = static_cast<int>(run_starts[r + 1] - first);
+            // A failed run doesn't stop the others
+            if (!transfer_run(true, block_nums[first], buffers.data() + first, count)) {
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    // Every run goes in flight at once. The engine wants one buffer per run, so a run whose
+    // blocks sit apart in memory is staged through a contiguous copy.
+    size_t runs = run_starts.size() - 1;
+    std::vector<IoRequest> requests(runs);
+    std::vector<std::vector<char>> staging(runs);
+    for (size_t r = 0; r < runs; ++r) {
+        size_t first = run_starts[r];
+        int count = static_cast<int>(run_starts[r + 1] - first);
+        char *buffer = buffers[first];
+        for (int k = 1; k < count; ++k) {
+            if (buffers[first + k] != buffer + static_cast<size_t>(k) * block_size) {
+                staging[r].resize(static_cast<size_t>(count) * block_size);
+                break;
+            }
+        }
+        if (!staging[r].empty()) {
+            buffer = staging[r].data();
+            for (int k = 0; write && k < count; ++k) {
+                memcpy(buffer + static_cast<size_t>(k) * block_size, buffers[first + k],
+                       block_size);
+            }
+        }
+        requests[r] = {write, block_nums[first], count, buffer, r};
+    }
+
+    AsyncIo *engine = acquire_engine();
+    bool ok = engine->run(requests);
+    release_engine(engine);
+
+    for (size_t r = 0; !write && r < runs; ++r) {
+        size_t first = run_starts[r];
+        for (size_t k = 0; k < staging[r].size() / block_size; ++k) {
+            memcpy(buffers[first + k], staging[r].data() + k * block_size, block_size);
+        }
+    }
+    return ok;
+}
+
+bool BlockDevice::read_block(int block_num, char *data) {
+    return transfer(false, std::vector<int>(1, block_num), std::vector<char *>(1, data));
+}
+
+bool BlockDevice::write_block(int block_num, const char *data) {
+    return transfer(true, std::vector<int>(1, block_num),
+                    std::vector<char *>(1, const_cast<char *>(data)));
+}
+
+bool BlockDevice::read_run(int first_block, int count, char *out) {
+    std::vector<char *> buffers(count);
+    for (int i = 0; i < count; ++i) {
+        buffers[i] = out + static_cast<size_t>(i) * block_size;
+    }
+    return fd != -1 && transfer_run(false, first_block, buffers.data(), count);
+}
+
+bool BlockDevice::write_run(int first_block, int count, const char *data) {
+    std::vector<char *> buffers(count);
+    for (int i = 0; i < count; ++i) {
+        buffers[i] = const_cast<char *>(data) + static_cast<size_t>(i) * block_size;
+    }
+    return fd != -1 && transfer_run(true, first_block, buffers.data(), count);
+}
+
+bool BlockDevice::read_blocks(const std::vector<int> &block_nums, char *out) {
+    std::vector<char *> buffers(block_nums.size());
+    for (size_t i = 0; i < block_nums.size(); ++i) {
+        buffers[i] = out + i * block_size;
+    }
+    return transfer(false, block_nums, buffers);
+}
+
+bool BlockDevice::write_blocks(const std::vector<int> &block_nums, const char *data) {
+    // pwritev only reads from the buffers; iovec just isn't const-qualified
+    std::vector<char *> buffers(block_nums.size());
+    for (size_t i = 0; i < block_nums.size(); ++i) {
+        buffers[i] = const_cast<char *>(data) + i * block_size;
+    }
+    return transfer(true, block_nums, buffers);
+}
+
+bool BlockDevice::write_scattered(const std::vector<int> &block_nums,
+                                  const std::vector<const char *> &buffers) {
+    if (buffers.size() != block_nums.size()) {
+        return false;
+    }
+    std::vector<char *> writable(buffers.size());
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        writable[i] = const_cast<char *>(buffers[i]);
+    }
+    return transfer(true, block_nums, writable);
+}
+
+bool BlockDevice::flush() {
+    if (fd == -1) {
+        return false;
+    }
+    if (fsync(fd) != 0) {
+        std::cerr << "Error: Could not flush the image: " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -1,51 +1,163 @@
 #include "core/filesystem.h"
+#include "core/block_device.h"
+#include "core/inode_index.h"
+#include "core/name_index.h"
+#include "core/quota.h"
 #include <QDebug> // For debug messages
 #include <algorithm>
 #include <cstring>
 #include <dirent.h> // For directory operations
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <sys/stat.h> // For file stats
+
+namespace {
+
+// Bytes of content per chain block, after the next pointer and the length
+const int CHAIN_PAYLOAD = BLOCK_SIZE - 2 * sizeof(int);
+
+const int SNAPSHOT_LIST_MAGIC = 0x534E4150; // "SNAP"
+
+const int CHECKPOINT_MAGIC = 0x43425431; // "CBT1"
+
+// Leads the changed-block bitmap chain
+struct CheckpointHeader {
+    int magic;
+    char name[MAX_FILENAME_LENGTH];
+    long long created;
+};
+
+} // namespace
+
+// Holds the namespace lock exclusively, unless this thread already does
+class FileSystem::ExclusiveLock {
+  private:
+    FileSystem *fs;
+    bool owns;
+
+  public:
+    explicit ExclusiveLock(FileSystem *fs)
+        : fs(fs), owns(fs->exclusive_owner.load() != std::this_thread::get_id()) {
+        if (owns) {
+            fs->namespace_mutex.lock();
+            fs->exclusive_owner = std::this_thread::get_id();
+        }
+    }
+    ~ExclusiveLock() {
+        if (owns) {
+            fs->exclusive_owner = std::thread::id();
+            fs->namespace_mutex.unlock();
+        }
+    }
+};
+
+// Holds the namespace lock shared, unless this thread holds it exclusively
+class FileSystem::SharedLock {
+  private:
+    FileSystem *fs;
+    bool owns;
+
+  public:
+    explicit SharedLock(FileSystem *fs)
+        : fs(fs), owns(fs->exclusive_owner.load() != std::this_thread::get_id()) {
+        if (owns) {
+            fs->namespace_mutex.lock_shared();
+        }
+    }
+    ~SharedLock() {
+        if (owns) {
+            fs->namespace_mutex.unlock_shared();
+        }
+    }
+};
+
 FileSystem::FileSystem(const std::string &name)
-    : disk_name(name), current_dir_inode(0), journal(nullptr) {
+    : device(new BlockDevice(BLOCK_SIZE)), disk_name(name), journal(nullptr),
+      mounted_clean(false), name_index(nullptr),
+      inode_index(nullptr), quota_manager(nullptr), snapshot_counts_dirty(false),
+      reclaim_count(0), generation(0), exclusive_owner(std::thread::id()),
+      inode_locks(NUM_INODES / (BLOCK_SIZE / sizeof(Inode)) + 1), next_view_id(0),
+      checkpoint_time(0), inode_batch_active(false) {
+}
+
+std::shared_mutex &FileSystem::inode_lock(int inode_num) {
+    return inode_locks[inode_num / (BLOCK_SIZE / sizeof(Inode))];
 }
 
 FileSystem::~FileSystem() {
-    if (disk.is_open()) {
+    if (device->is_open()) {
         unmount();
     }
+    delete device;
     delete journal;
+    delete name_index;
+    delete inode_index;
+}
+
+void FileSystem::mark_changed(const int *block_nums, size_t count) {
+    std::lock_guard<std::mutex> lock(changed_mutex);
+    int journal_start = 1 + sb.inode_blocks;
+    for (size_t i = 0; i < count; ++i) {
+        int block_num = block_nums[i];
+        if (block_num >= 0 && block_num < static_cast<int>(changed_blocks.size()) &&
+            (block_num < journal_start || block_num >= journal_start + NUM_JOURNAL_BLOCKS)) {
+            changed_blocks[block_num] = true;
+        }
+    }
+}
+
+bool FileSystem::write_block(int block_num, const char *data) {
+    // A failed write may still have reached part of the block, so it counts as changed
+    mark_changed(&block_num, 1);
+    return device->write_block(block_num, data);
+}
+
+bool FileSystem::write_blocks(const std::vector<int> &block_nums, const char *data) {
+    mark_changed(block_nums.data(), block_nums.size());
+    return device->write_blocks(block_nums, data);
+}
+
+bool FileSystem::write_scattered(const std::vector<int> &block_nums,
+                                 const std::vector<const char *> &buffers) {
+    mark_changed(block_nums.data(), block_nums.size());
+    return device->write_scattered(block_nums, buffers);
 }
 
-void FileSystem::write_block(int block_num, const char *data) {
-    disk.seekp(block_num * BLOCK_SIZE, std::ios::beg);
-    disk.write(data, BLOCK_SIZE);
+bool FileSystem::read_block(int block_num, char *data) {
+    return device->read_block(block_num, data);
 }
 
-void FileSystem::read_block(int block_num, char *data) {
-    disk.seekg(block_num * BLOCK_SIZE, std::ios::beg);
-    disk.read(data, BLOCK_SIZE);
+bool FileSystem::read_blocks(const std::vector<int> &block_nums, char *out) {
+    return device->read_blocks(block_nums, out);
 }
 
 void FileSystem::write_superblock() {
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
     char buffer[BLOCK_SIZE] = {0};
     memcpy(buffer, &sb, sizeof(Superblock));
     write_block(0, buffer);
 }
 
-void FileSystem::read_superblock() {
+bool FileSystem::read_superblock() {
     char buffer[BLOCK_SIZE];
-    read_block(0, buffer);
+    bool ok = read_block(0, buffer);
     memcpy(&sb, buffer, sizeof(Superblock));
+    return ok;
 }
 
 void FileSystem::write_inodes() {
     char buffer[BLOCK_SIZE];
+    char on_disk[BLOCK_SIZE];
     int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
     for (int i = 0; i < sb.inode_blocks; ++i) {
         memset(buffer, 0, BLOCK_SIZE);
         memcpy(buffer, &inodes[i * inodes_per_block], inodes_per_block * sizeof(Inode));
-        write_block(1 + i, buffer);
+        // Unchanged blocks are skipped so they don't show up as changed for backups
+        read_block(1 + i, on_disk);
+        if (memcmp(buffer, on_disk, BLOCK_SIZE) != 0) {
+            write_block(1 + i, buffer);
+        }
     }
 }
 
@@ -59,23 +171,206 @@ void FileSystem::read_inodes() {
     }
 }
 
-int FileSystem::allocate_block() {
+void FileSystem::mark_inode_dirty(int inode_num) {
+    int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
+    int block_index = inode_num / inodes_per_block;
+    if (block_index < 0 || block_index >= sb.inode_blocks)
+        return;
+    if (dirty_inode_blocks.size() != static_cast<size_t>(sb.inode_blocks)) {
+        dirty_inode_blocks.assign(sb.inode_blocks, false);
+    }
+    dirty_inode_blocks[block_index] = true;
+}
+
+void FileSystem::flush_dirty_inodes() {
+    if (!journal) {
+        // External filesystems have no journal; fall back to a full table write
+        write_inodes();
+        dirty_inode_blocks.assign(dirty_inode_blocks.size(), false);
+        return;
+    }
+
+    char inode_buffer[BLOCK_SIZE];
+    int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
+    int max_blocks = journal->max_blocks_per_transaction();
+    int logged = 0;
+
+    for (size_t i = 0; i < dirty_inode_blocks.size(); ++i) {
+        if (!dirty_inode_blocks[i])
+            continue;
+
+        // Split very large repairs so each transaction still fits in the journal
+        if (logged == max_blocks) {
+            journal->commit_transaction();
+            logged = 0;
+        }
+        if (logged == 0) {
+            journal->begin_transaction();
+        }
+
+        int first_inode = i * inodes_per_block;
+        int count = std::min(inodes_per_block, static_cast<int>(inodes.size()) - first_inode);
+        memset(inode_buffer, 0, BLOCK_SIZE);
+        memcpy(inode_buffer, &inodes[first_inode], count * sizeof(Inode));
+        journal->log_metadata_block(1 + i, inode_buffer);
+        dirty_inode_blocks[i] = false;
+        logged++;
+    }
+
+    if (logged > 0) {
+        journal->commit_transaction();
+    }
+}
+
+void FileSystem::begin_inode_batch() {
+    ExclusiveLock lock(this);
+    inode_batch_active = true;
+}
+
+void FileSystem::commit_inode_batch() {
+    ExclusiveLock lock(this);
+    inode_batch_active = false;
+    flush_dirty_inodes();
+}
+
+int FileSystem::allocate_block(int owner_inode) {
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
     if (sb.free_block_list_head == -1)
         return -1;
     int free_block = sb.free_block_list_head;
     char buffer[BLOCK_SIZE];
-    read_block(free_block, buffer);
+    // Without the link to the next free block the list can't move on, so nothing is handed out
+    if (!read_block(free_block, buffer)) {
+        return -1;
+    }
     memcpy(&sb.free_block_list_head, buffer, sizeof(int));
+    sb.free_blocks--;
     write_superblock();
+    charge_usage(owner_inode, 1, 0);
+    {
+        // Views already open can't reference a block handed out now
+        std::lock_guard<std::mutex> view_lock(view_mutex);
+        if (free_block < static_cast<int>(block_stamps.size())) {
+            block_stamps[free_block] = next_view_id;
+        }
+    }
     return free_block;
 }
 
-void FileSystem::free_block(int block_num) {
+void FileSystem::free_block(int block_num, int owner_inode) {
+    std::lock_guard<std::recursive_mutex> alloc_lock(alloc_mutex);
+    if (is_snapshot_block(block_num)) {
+        // Only the live reference goes away; the block keeps its contents for the snapshot
+        credit_exclusive_block(block_num);
+        charge_usage(owner_inode, -1, 0);
+        return;
+    }
+    {
+        // An open read view still shows the old contents, so the free list has to wait
+        std::lock_guard<std::mutex> lock(view_mutex);
+        if (block_num > 0 && block_num < static_cast<int>(block_stamps.size()) &&
+            !read_views.empty() && block_stamps[block_num] <= *read_views.rbegin()) {
+            pinned_frees.push_back({block_num, next_view_id});
+            charge_usage(owner_inode, -1, 0);
+            return;
+        }
+    }
     char buffer[BLOCK_SIZE] = {0};
     memcpy(buffer, &sb.free_block_list_head, sizeof(int));
-    write_block(block_num, buffer);
-    sb.free_block_list_head = block_num;
-    write_superblock();
+    // A block that can't hold the link would cut the list short. It stays off the list, so
+    // the image loses one free block instead of the rest of the list.
+    if (write_block(block_num, buffer)) {
+        sb.free_block_list_head = block_num;
+        sb.free_blocks++;
+        write_superblock();
+    }
+    charge_usage(owner_inode, -1, 0);
+}
+
+int FileSystem::count_inode_blocks(int inode_num) {
+    const Inode &inode = inodes[inode_num];
+    int blocks = 0;
+    for (int i = 0; i < 10; ++i) {
+        if (inode.direct_blocks[i] != 0)
+            blocks++;
+    }
+    if (inode.indirect_block != 0) {
+        blocks++;
+        char buffer[BLOCK_SIZE];
+        read_block(inode.indirect_block, buffer);
+        int *block_pointers = (int *)buffer;
+        int pointers_per_block = BLOCK_SIZE / sizeof(int);
+        for (int i = 0; i < pointers_per_block; ++i) {
+            if (block_pointers[i] != 0)
+                blocks++;
+        }
+    }
+    return blocks;
+}
+
+void FileSystem::charge_usage(int inode_num, int blocks, int inode_count) {
+    if (!is_valid_inode(inode_num)) {
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (quota_manager) {
+        quota_manager->charge(inodes[inode_num].uid, inodes[inode_num].gid, blocks,
+                              inode_count);
+        quota_manager->charge_projects(inode_num, blocks, inode_count);
+    } else {
+        // Nobody is counting, so the usage in the quota file no longer matches
+        sb.quota_usage_valid = 0;
+    }
+}
+
+int FileSystem::dir_blocks_needed(int dir_inode_num) {
+    // Removed entries leave holes, so a new block is only needed once every slot is live
+    const Inode &dir_inode = inodes[dir_inode_num];
+    int slots = 0;
+    for (int i = 0; i < 10; ++i) {
+        if (dir_inode.direct_blocks[i] != 0)
+            slots += BLOCK_SIZE / sizeof(DirEntry);
+    }
+    return dir_inode.size / static_cast<int>(sizeof(DirEntry)) >= slots ? 1 : 0;
+}
+
+bool FileSystem::quota_allows(int uid, int gid, int blocks, int inode_count, int parent_dir,
+                              int project_start) {
+    if (!quota_manager) {
+        return true;
+    }
+    // No lock is needed: callers passing a parent directory hold the namespace lock
+    // exclusively, and the quota checks read QuotaManager's published table
+
+    int parent_blocks = 0;
+    if (parent_dir >= 0 && is_valid_inode(parent_dir)) {
+        parent_blocks = dir_blocks_needed(parent_dir);
+    }
+    int parent_uid = parent_blocks > 0 ? inodes[parent_dir].uid : uid;
+    int parent_gid = parent_blocks > 0 ? inodes[parent_dir].gid : gid;
+
+    bool exceeded;
+    if (parent_uid == uid) {
+        exceeded = quota_manager->user_would_exceed(uid, blocks + parent_blocks, inode_count);
+    } else {
+        exceeded = quota_manager->user_would_exceed(uid, blocks, inode_count) ||
+                   quota_manager->user_would_exceed(parent_uid, parent_blocks, 0);
+    }
+    if (!exceeded && parent_gid == gid) {
+        exceeded = quota_manager->group_would_exceed(gid, blocks + parent_blocks, inode_count);
+    } else if (!exceeded) {
+        exceeded = quota_manager->group_would_exceed(gid, blocks, inode_count) ||
+                   quota_manager->group_would_exceed(parent_gid, parent_blocks, 0);
+    }
+    if (!exceeded && project_start >= 0) {
+        exceeded = quota_manager->project_would_exceed(project_start, blocks + parent_blocks,
+                                                       inode_count);
+    }
+
+    if (exceeded) {
+        std::cerr << "Error: Disk quota exceeded." << std::endl;
+    }
+    return !exceeded;
 }
 
 int FileSystem::find_free_inode() {
@@ -109,12 +404,13 @@ std::vector<DirEntry> FileSystem::get_dir_entries(int inode_num) {
         // Add . and .. entries
         DirEntry dot_entry;
         strncpy(dot_entry.name, ".", MAX_FILENAME_LENGTH);
-        dot_entry.inode_num = current_dir_inode;
+        dot_entry.inode_num = default_context.current_dir_inode;
         entries.push_back(dot_entry);
 
         DirEntry dotdot_entry;
         strncpy(dotdot_entry.name, "..", MAX_FILENAME_LENGTH);
-        dotdot_entry.inode_num = (current_dir_inode == 0) ? 0 : 1; // Root's parent is itself
+        // Root's parent is itself
+        dotdot_entry.inode_num = (default_context.current_dir_inode == 0) ? 0 : 1;
         entries.push_back(dotdot_entry);
 
         // Get the current path in the external filesystem
@@ -188,7 +484,7 @@ void FileSystem::add_dir_entry(int dir_inode_num, const std::string &name, int n
     char buffer[BLOCK_SIZE];
     for (int i = 0; i < 10; ++i) {
         if (dir_inode.direct_blocks[i] == 0) {
-            dir_inode.direct_blocks[i] = allocate_block();
+            dir_inode.direct_blocks[i] = allocate_block(dir_inode_num);
             if (dir_inode.direct_blocks[i] == -1)
                 return;
             memset(buffer, 0, BLOCK_SIZE);
@@ -202,74 +498,159 @@ void FileSystem::add_dir_entry(int dir_inode_num, const std::string &name, int n
         for (int j = 0; j < BLOCK_SIZE / sizeof(DirEntry); ++j) {
             DirEntry *entry = (DirEntry *)(buffer + j * sizeof(DirEntry));
             if (entry->inode_num == -1) {
+                int block_num = relocate_shared_block(dir_inode_num, dir_inode.direct_blocks[i]);
+                if (block_num == -1)
+                    return;
+                dir_inode.direct_blocks[i] = block_num;
                 memcpy(entry, &new_entry, sizeof(DirEntry));
-                write_block(dir_inode.direct_blocks[i], buffer);
+                write_block(block_num, buffer);
                 dir_inode.size += sizeof(DirEntry);
+                update_inode_times(dir_inode_num, false, true, false);
+                if (name_index && is_valid_inode(new_inode_num)) {
+                    name_index->add(dir_inode_num, new_entry.name, new_inode_num,
+                                    inodes[new_inode_num].mode == 2);
+                }
+                if (name != "." && name != ".." && new_inode_num > 0 &&
+                    new_inode_num < static_cast<int>(parent_dirs.size()) &&
+                    parent_dirs[new_inode_num] == -1) {
+                    // From here on the inode's usage counts towards the projects above it
+                    parent_dirs[new_inode_num] = dir_inode_num;
+                    if (quota_manager) {
+                        quota_manager->charge_projects(new_inode_num,
+                                                       count_inode_blocks(new_inode_num), 1);
+                    }
+                }
                 return;
             }
         }
     }
 }
 
-void FileSystem::format() {
-    disk.open(disk_name, std::ios::out | std::ios::binary | std::ios::trunc);
-    if (!disk.is_open()) {
-        std::cerr << "Error: Could not create disk file." << std::endl;
+void FileSystem::remove_dir_entry(int dir_inode_num, const std::string &name) {
+    if (!is_valid_inode(dir_inode_num) || inodes[dir_inode_num].mode != 2) {
         return;
     }
 
-    char empty_block[BLOCK_SIZE] = {0};
-    for (int i = 0; i < NUM_BLOCKS; ++i) {
-        write_block(i, empty_block);
+    Inode &dir_inode = inodes[dir_inode_num];
+    char buffer[BLOCK_SIZE];
+    for (int i = 0; i < 10 && dir_inode.direct_blocks[i] != 0; ++i) {
+        read_block(dir_inode.direct_blocks[i], buffer);
+        for (size_t j = 0; j < BLOCK_SIZE / sizeof(DirEntry); ++j) {
+            DirEntry *entry = (DirEntry *)(buffer + j * sizeof(DirEntry));
+            if (entry->inode_num != -1 &&
+                strncmp(entry->name, name.c_str(), MAX_FILENAME_LENGTH) == 0) {
+                int block_num = relocate_shared_block(dir_inode_num, dir_inode.direct_blocks[i]);
+                if (block_num == -1)
+                    return;
+                dir_inode.direct_blocks[i] = block_num;
+                entry->inode_num = -1;
+                write_block(block_num, buffer);
+                dir_inode.size -= sizeof(DirEntry);
+                update_inode_times(dir_inode_num, false, true, false);
+                if (name_index) {
+                    name_index->remove(dir_inode_num, name.c_str());
+                }
+                return;
+            }
+        }
+    }
+}
+
+void FileSystem::format() {
+    ExclusiveLock lock(this);
+    if (!device->open(disk_name, true)) {
+        std::cerr << "Error: Could not create disk file." << std::endl;
+        return;
     }
 
     sb.num_blocks = NUM_BLOCKS;
     sb.num_inodes = NUM_INODES;
     sb.inode_blocks = (NUM_INODES * sizeof(Inode) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int journal_blocks = 100; // Reserve 100 blocks for the journal
-    sb.free_block_list_head = 1 + sb.inode_blocks + journal_blocks;
-    write_superblock();
+    int journal_blocks = NUM_JOURNAL_BLOCKS;
 
-    for (int i = 1 + sb.inode_blocks + journal_blocks; i < NUM_BLOCKS - 1; ++i) {
-        int next_block = i + 1;
-        char buffer[BLOCK_SIZE] = {0};
-        memcpy(buffer, &next_block, sizeof(int));
-        write_block(i, buffer);
+    // The whole image goes out in one pass: zeros, except that every data block holds the
+    // number of the next one on the free list
+    int data_start = 1 + sb.inode_blocks + journal_blocks;
+    std::vector<char> image(static_cast<size_t>(NUM_BLOCKS) * BLOCK_SIZE, 0);
+    std::vector<int> all_blocks(NUM_BLOCKS);
+    for (int i = 0; i < NUM_BLOCKS; ++i) {
+        all_blocks[i] = i;
+        if (i >= data_start) {
+            int next_block = i < NUM_BLOCKS - 1 ? i + 1 : -1;
+            memcpy(&image[static_cast<size_t>(i) * BLOCK_SIZE], &next_block, sizeof(int));
+        }
     }
-    int last_block_next = -1;
-    char buffer[BLOCK_SIZE] = {0};
-    memcpy(buffer, &last_block_next, sizeof(int));
-    write_block(NUM_BLOCKS - 1, buffer);
+    if (!write_blocks(all_blocks, image.data())) {
+        device->close();
+        return;
+    }
+    sb.free_block_list_head = 1 + sb.inode_blocks + journal_blocks;
+    sb.free_blocks = NUM_BLOCKS - sb.free_block_list_head;
+    sb.free_inodes = NUM_INODES;
+    sb.state = FS_STATE_CLEAN;
+    sb.name_index_stamp = 0;
+    sb.quota_block = 0;
+    sb.quota_usage_valid = 0;
+    sb.snapshot_block = 0;
+    sb.reclaim_block = 0;
+    sb.change_sequence = 0;
+    sb.checkpoint_block = 0;
+    changed_blocks.clear();
+    checkpoint_name.clear();
+    checkpoint_time = 0;
+    write_superblock();
+    snapshots.clear();
+    delete_queue.clear();
+    snapshot_blocks.clear();
+    snapshot_counts_dirty = false;
+    snapshot_refs.assign(NUM_BLOCKS, 0);
+    reclaim_pending.assign(NUM_BLOCKS, false);
+    reclaim_count = 0;
+    drop_read_views();
+    pinned_frees.clear();
+
+    // Any index and quota manager belonged to the previous contents. The manager is only
+    // detached; it no longer saves into this image.
+    quota_manager = nullptr;
+    delete name_index;
+    name_index = nullptr;
+    delete inode_index;
+    inode_index = nullptr;
 
     inodes.assign(NUM_INODES, Inode());
     for (auto &inode : inodes) {
         inode.mode = 0;
     }
+    parent_dirs.assign(NUM_INODES, -1);
 
     int root_inode_num = find_free_inode();
     inodes[root_inode_num].mode = 2; // Directory
+    sb.free_inodes--;
     inodes[root_inode_num].size = 0;
     inodes[root_inode_num].uid = 0;        // root user
     inodes[root_inode_num].gid = 0;        // root group
     inodes[root_inode_num].link_count = 2; // . and ..
     update_inode_times(root_inode_num, true, true, true);
-    current_dir_inode = root_inode_num;
+    default_context.current_dir_inode = root_inode_num;
 
     add_dir_entry(root_inode_num, ".", root_inode_num);
     add_dir_entry(root_inode_num, "..", root_inode_num);
 
     write_inodes();
-    disk.close();
+    write_superblock();
+    device->close();
+    bump_generation();
 }
 
 bool FileSystem::mount() {
+    ExclusiveLock lock(this);
     // Check if this is an external filesystem (mounted path, not .fs file)
     bool is_external = (disk_name.find(".fs") == std::string::npos && disk_name.find("/") == 0);
 
     if (is_external) {
         // For external filesystems, we don't actually open the disk image
         // Instead, we'll use system operations to interact with the real filesystem
-        disk.close(); // Just in case it was open before
+        device->close(); // Just in case it was open before
 
         // Check if the path exists
         std::ifstream test_path(disk_name);
@@ -298,37 +679,151 @@ bool FileSystem::mount() {
 
         // No need for journal on external filesystem
         journal = nullptr;
-        current_dir_inode = 0; // Root directory
+        default_context.current_dir_inode = 0; // Root directory
 
         std::cout << "Mounted external filesystem at: " << disk_name << std::endl;
         return true;
     } else {
         // Regular .fs file handling
-        disk.open(disk_name, std::ios::in | std::ios::out | std::ios::binary);
-        if (!disk.is_open()) {
+        if (!device->open(disk_name, false)) {
             return false;
         }
-        read_superblock();
-        read_inodes();
+        if (!read_superblock()) {
+            device->close();
+            return false;
+        }
+        changed_blocks.assign(NUM_BLOCKS, false);
         int journal_start_block = 1 + sb.inode_blocks;
-        int journal_num_blocks = 100;
+        int journal_num_blocks = NUM_JOURNAL_BLOCKS;
+        delete journal;
         journal = new Journal(this, journal_start_block, journal_num_blocks);
+        mounted_clean = (sb.state == FS_STATE_CLEAN) && journal->is_empty();
         journal->recover();
-        current_dir_inode = 0; // Root directory
+
+        // Replay may have rewritten the superblock and inode table
+        read_superblock();
+        read_inodes();
+        raise_change_sequence(inodes);
+
+        // Counters from an unclean session or an older image can't be trusted
+        if (!mounted_clean) {
+            recalculate_summary_counters();
+        }
+        sb.state = FS_STATE_MOUNTED;
+        write_superblock();
+        build_inode_index();
+        build_parent_dirs();
+        load_snapshots();
+        load_reclaim_list();
+        drop_read_views();
+        load_changed_blocks();
+        bump_generation();
+
+        default_context.current_dir_inode = 0; // Root directory
         return true;
     }
 }
 
 void FileSystem::unmount() {
-    if (disk.is_open()) {
-        write_superblock();
+    ExclusiveLock lock(this);
+    if (device->is_open()) {
+        drop_read_views();
+        release_unpinned_blocks();
+        if (quota_manager) {
+            quota_manager->save();
+        }
+        if (snapshot_counts_dirty && journal) {
+            std::vector<int> surplus;
+            if (write_snapshot_list(snapshots, delete_queue, std::vector<int>(), std::string(),
+                                    surplus)) {
+                snapshot_counts_dirty = false;
+            }
+            for (int block : surplus) {
+                free_block(block);
+            }
+        }
         write_inodes();
-        disk.close();
+
+        // Save the name index and tie it to this image; without a saved index the stamp is
+        // cleared so a stale file is never trusted
+        sb.name_index_stamp = 0;
+        if (name_index) {
+            int stamp = static_cast<int>(time(nullptr) & 0x7FFFFFFF) | 1;
+            if (name_index->save(name_index_file(), stamp)) {
+                sb.name_index_stamp = stamp;
+            }
+        }
+
+        sb.state = FS_STATE_CLEAN;
+        if (sb.checkpoint_block != 0) {
+            save_changed_blocks();
+        }
+        write_superblock();
+        device->close();
+        changed_blocks.clear();
+
+        delete inode_index;
+        inode_index = nullptr;
     }
 }
 
 void FileSystem::mkdir(const std::string &dirname) {
+    mkdir(default_context, dirname);
+}
+
+std::vector<DirEntry> FileSystem::ls() {
+    return ls(default_context);
+}
+
+void FileSystem::cd(const std::string &path) {
+    cd(default_context, path);
+}
+
+int FileSystem::find_inode_by_path(const std::string &path) {
+    return find_inode_by_path(default_context, path);
+}
+
+void FileSystem::create(const std::string &filename) {
+    create(default_context, filename);
+}
+
+bool FileSystem::write(const std::string &filename, const std::string &data) {
+    return write(default_context, filename, data);
+}
+
+std::string FileSystem::read(const std::string &filename) {
+    return read(default_context, filename);
+}
+
+void FileSystem::chmod(const std::string &path, int mode) {
+    chmod(default_context, path, mode);
+}
+
+void FileSystem::chown(const std::string &path, int uid, int gid) {
+    chown(default_context, path, uid, gid);
+}
+
+void FileSystem::link(const std::string &oldpath, const std::string &newpath) {
+    link(default_context, oldpath, newpath);
+}
+
+void FileSystem::symlink(const std::string &target, const std::string &linkpath) {
+    symlink(default_context, target, linkpath);
+}
+
+void FileSystem::unlink(const std::string &path) {
+    unlink(default_context, path);
+}
+
+void FileSystem::mkdir(const FsContext &context, const std::string &dirname) {
+    ExclusiveLock lock(this);
+    int parent_dir = context.current_dir_inode;
     journal->begin_transaction();
+    // New directories belong to root and take one block for "." and ".."
+    if (!quota_allows(0, 0, 1, 1, parent_dir, parent_dir)) {
+        journal->commit_transaction();
+        return;
+    }
     int new_inode_num = find_free_inode();
     if (new_inode_num == -1) {
         std::cerr << "Error: No free inodes." << std::endl;
@@ -337,15 +832,18 @@ void FileSystem::mkdir(const std::string &dirname) {
     }
 
     inodes[new_inode_num].mode = 2; // Directory
+    sb.free_inodes--;
     inodes[new_inode_num].size = 0;
     inodes[new_inode_num].uid = 0; // Default to root user/group
     inodes[new_inode_num].gid = 0;
     inodes[new_inode_num].link_count = 2; // For . and ..
     update_inode_times(new_inode_num, true, true, true);
+    charge_usage(new_inode_num, 0, 1);
 
-    add_dir_entry(current_dir_inode, dirname, new_inode_num);
+    add_dir_entry(parent_dir, dirname, new_inode_num);
     add_dir_entry(new_inode_num, ".", new_inode_num);
-    add_dir_entry(new_inode_num, "..", current_dir_inode);
+    add_dir_entry(new_inode_num, "..", parent_dir);
+    inodes[parent_dir].link_count++; // The new directory's ".." entry
 
     char inode_buffer[BLOCK_SIZE];
     int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
@@ -354,14 +852,23 @@ void FileSystem::mkdir(const std::string &dirname) {
            inodes_per_block * sizeof(Inode));
     journal->log_metadata_block(block_to_update, inode_buffer);
 
+    int parent_block = 1 + (parent_dir / inodes_per_block);
+    if (parent_block != block_to_update) {
+        memcpy(inode_buffer, &inodes[(parent_dir / inodes_per_block) * inodes_per_block],
+               inodes_per_block * sizeof(Inode));
+        journal->log_metadata_block(parent_block, inode_buffer);
+    }
+
     journal->commit_transaction();
 }
 
-std::vector<DirEntry> FileSystem::ls() {
-    return get_dir_entries(current_dir_inode);
+std::vector<DirEntry> FileSystem::ls(const FsContext &context) {
+    SharedLock lock(this);
+    return get_dir_entries(context.current_dir_inode);
 }
 
-void FileSystem::cd(const std::string &path) {
+void FileSystem::cd(FsContext &context, const std::string &path) {
+    SharedLock lock(this);
     // Check if this is an external filesystem
     bool is_external = (disk_name.find(".fs") == std::string::npos && disk_name.find("/") == 0);
 
@@ -400,15 +907,15 @@ void FileSystem::cd(const std::string &path) {
     }
 
     // Original implementation for virtual filesystem
-    int inode_num = find_inode_by_path(path);
+    int inode_num = find_inode_by_path(context, path);
     if (inode_num != -1 && inodes[inode_num].mode == 2) {
-        current_dir_inode = inode_num;
+        context.current_dir_inode = inode_num;
     } else {
         std::cerr << "Error: Directory not found." << std::endl;
     }
 }
 
-int FileSystem::find_inode_by_path(const std::string &path) {
+int FileSystem::find_inode_by_path(const FsContext &context, const std::string &path) {
     // Check if this is an external filesystem
     bool is_external = (disk_name.find(".fs") == std::string::npos && disk_name.find("/") == 0);
 
@@ -442,7 +949,7 @@ int FileSystem::find_inode_by_path(const std::string &path) {
 
     std::stringstream ss(path);
     std::string segment;
-    int start_inode = (path[0] == '/') ? 0 : current_dir_inode;
+    int start_inode = (path[0] == '/') ? 0 : context.current_dir_inode;
 
     if (path == "/")
         return 0;
@@ -466,7 +973,11 @@ int FileSystem::find_inode_by_path(const std::string &path) {
     return start_inode;
 }
 
-void FileSystem::create(const std::string &filename) {
+void FileSystem::create(const FsContext &context, const std::string &filename) {
+    ExclusiveLock lock(this);
+    if (!quota_allows(0, 0, 0, 1, context.current_dir_inode, context.current_dir_inode)) {
+        return;
+    }
     int new_inode_num = find_free_inode();
     if (new_inode_num == -1) {
         std::cerr << "Error: No free inodes." << std::endl;
@@ -479,25 +990,46 @@ void FileSystem::create(const std::string &filename) {
     }
 
     inodes[new_inode_num].mode = 1; // File
+    sb.free_inodes--;
     inodes[new_inode_num].size = 0;
     inodes[new_inode_num].uid = 0; // Default to root user/group
     inodes[new_inode_num].gid = 0;
     inodes[new_inode_num].link_count = 1;
     update_inode_times(new_inode_num, true, true, true);
+    charge_usage(new_inode_num, 0, 1);
     for (int i = 0; i < 10; ++i)
         inodes[new_inode_num].direct_blocks[i] = 0;
     inodes[new_inode_num].indirect_block = 0;
 
-    add_dir_entry(current_dir_inode, filename, new_inode_num);
+    add_dir_entry(context.current_dir_inode, filename, new_inode_num);
+
+    // Not journaled, so nothing else marks the change
+    bump_generation();
 }
 
-void FileSystem::write(const std::string &filename, const std::string &data) {
-    journal->begin_transaction();
-    int inode_num = find_inode_by_path(filename);
+bool FileSystem::write(const FsContext &context, const std::string &filename,
+                       const std::string &data) {
+    SharedLock lock(this);
+    int inode_num = find_inode_by_path(context, filename);
     if (inode_num == -1 || inodes[inode_num].mode != 1) {
         std::cerr << "Error: File not found." << std::endl;
-        journal->commit_transaction();
-        return;
+        return false;
+    }
+    // Data blocks are written directly; only the inode block and the indirect block go
+    // through the journal, so the transaction is opened at the end
+    std::unique_lock<std::shared_mutex> inode_guard(inode_lock(inode_num));
+
+    // Only growth is checked; the old blocks are freed before the new ones are allocated
+    int pointers_per_block = BLOCK_SIZE / sizeof(int);
+    int data_blocks = (static_cast<int>(data.length()) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int needed = std::min(data_blocks, 10 + pointers_per_block);
+    if (data_blocks > 10) {
+        needed++; // Indirect block
+    }
+    int growth = needed - count_inode_blocks(inode_num);
+    if (growth > 0 &&
+        !quota_allows(inodes[inode_num].uid, inodes[inode_num].gid, growth, 0, -1, inode_num)) {
+        return false;
     }
     update_inode_times(inode_num, false, true, false);
 
@@ -506,7 +1038,7 @@ void FileSystem::write(const std::string &filename, const std::string &data) {
     // First, free existing blocks
     for (int i = 0; i < 10; ++i) {
         if (inode.direct_blocks[i] != 0) {
-            free_block(inode.direct_blocks[i]);
+            free_block(inode.direct_blocks[i], inode_num);
             inode.direct_blocks[i] = 0;
         }
     }
@@ -517,10 +1049,10 @@ void FileSystem::write(const std::string &filename, const std::string &data) {
         int pointers_per_block = BLOCK_SIZE / sizeof(int);
         for (int i = 0; i < pointers_per_block; ++i) {
             if (block_pointers[i] != 0) {
-                free_block(block_pointers[i]);
+                free_block(block_pointers[i], inode_num);
             }
         }
-        free_block(inode.indirect_block);
+        free_block(inode.indirect_block, inode_num);
         inode.indirect_block = 0;
     }
     inode.size = 0;
@@ -529,19 +1061,68 @@ void FileSystem::write(const std::string &filename, const std::string &data) {
     const char *p_data = data.c_str();
     int data_left = data.length();
     int offset = 0;
+    char indirect_buffer[BLOCK_SIZE] = {0};
+
+    // The inode is committed through the journal once its blocks are on disk
+    auto commit_inode = [&]() {
+        char inode_buffer[BLOCK_SIZE];
+        int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
+        int block_to_update = 1 + (inode_num / inodes_per_block);
+        // The stripe lock keeps the other inodes in this table block still while it is copied
+        memcpy(inode_buffer, &inodes[(inode_num / inodes_per_block) * inodes_per_block],
+               inodes_per_block * sizeof(Inode));
+
+        std::lock_guard<std::mutex> journal_lock(journal_mutex);
+        journal->begin_transaction();
+        if (inode.indirect_block != 0) {
+            journal->log_data_block(inode.indirect_block, indirect_buffer);
+        }
+        journal->log_metadata_block(block_to_update, inode_buffer);
+        journal->commit_transaction();
+    };
+
+    // A block that didn't reach the disk must never be named by a committed inode. The new
+    // blocks go back and the emptied file is committed instead; the old contents were
+    // already released.
+    auto abandon = [&]() {
+        std::cerr << "Error: Could not write the data of " << filename << "." << std::endl;
+        for (int i = 0; i < 10; ++i) {
+            if (inode.direct_blocks[i] != 0) {
+                free_block(inode.direct_blocks[i], inode_num);
+                inode.direct_blocks[i] = 0;
+            }
+        }
+        if (inode.indirect_block != 0) {
+            int *block_pointers = (int *)indirect_buffer;
+            for (int i = 0; i < pointers_per_block; ++i) {
+                if (block_pointers[i] != 0) {
+                    free_block(block_pointers[i], inode_num);
+                }
+            }
+            free_block(inode.indirect_block, inode_num);
+            inode.indirect_block = 0;
+        }
+        inode.size = 0;
+        reindex_inode(inode_num);
+        commit_inode();
+        return false;
+    };
 
     // Direct blocks
     for (int i = 0; i < 10 && data_left > 0; ++i) {
-        int block_num = allocate_block();
+        int block_num = allocate_block(inode_num);
         if (block_num == -1) {
             std::cerr << "Error: Out of space." << std::endl;
-            return;
+            reindex_inode(inode_num);
+            return false;
         }
         inode.direct_blocks[i] = block_num;
         int to_write = std::min(data_left, BLOCK_SIZE);
         char buffer[BLOCK_SIZE] = {0};
         memcpy(buffer, p_data + offset, to_write);
-        write_block(block_num, buffer);
+        if (!write_block(block_num, buffer)) {
+            return abandon();
+        }
         data_left -= to_write;
         offset += to_write;
         inode.size += to_write;
@@ -549,92 +1130,94 @@ void FileSystem::write(const std::string &filename, const std::string &data) {
 
     // Indirect blocks
     if (data_left > 0) {
-        int indirect_block_num = allocate_block();
+        int indirect_block_num = allocate_block(inode_num);
         if (indirect_block_num == -1) {
             std::cerr << "Error: Out of space." << std::endl;
-            return;
+            reindex_inode(inode_num);
+            return false;
         }
         inode.indirect_block = indirect_block_num;
-        char indirect_buffer[BLOCK_SIZE] = {0};
         int *block_pointers = (int *)indirect_buffer;
-        int pointers_per_block = BLOCK_SIZE / sizeof(int);
 
         for (int i = 0; i < pointers_per_block && data_left > 0; ++i) {
-            int block_num = allocate_block();
+            int block_num = allocate_block(inode_num);
             if (block_num == -1) {
                 std::cerr << "Error: Out of space." << std::endl;
-                write_block(indirect_block_num, indirect_buffer); // write partial indirect block
-                return;
+                if (!write_block(indirect_block_num, indirect_buffer)) { // partial block
+                    return abandon();
+                }
+                reindex_inode(inode_num);
+                return false;
             }
             block_pointers[i] = block_num;
             int to_write = std::min(data_left, BLOCK_SIZE);
             char buffer[BLOCK_SIZE] = {0};
             memcpy(buffer, p_data + offset, to_write);
-            write_block(block_num, buffer);
+            if (!write_block(block_num, buffer)) {
+                return abandon();
+            }
             data_left -= to_write;
             offset += to_write;
             inode.size += to_write;
         }
-        write_block(indirect_block_num, indirect_buffer);
-        journal->log_data_block(indirect_block_num, indirect_buffer);
+        if (!write_block(indirect_block_num, indirect_buffer)) {
+            return abandon();
+        }
     }
-
-    char inode_buffer[BLOCK_SIZE];
-    int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
-    int block_to_update = 1 + (inode_num / inodes_per_block);
-    memcpy(inode_buffer, &inodes[(inode_num / inodes_per_block) * inodes_per_block],
-           inodes_per_block * sizeof(Inode));
-    journal->log_metadata_block(block_to_update, inode_buffer);
-
-    journal->commit_transaction();
+    reindex_inode(inode_num);
+    commit_inode();
+    return true;
 }
 
-std::string FileSystem::read(const std::string &filename) {
-    int inode_num = find_inode_by_path(filename);
+std::string FileSystem::read(const FsContext &context, const std::string &filename) {
+    SharedLock lock(this);
+    int inode_num = find_inode_by_path(context, filename);
     if (inode_num == -1 || inodes[inode_num].mode != 1) {
         return "Error: File not found.";
     }
-    update_inode_times(inode_num, true, false, false);
+    std::shared_lock<std::shared_mutex> inode_guard(inode_lock(inode_num));
 
-    Inode &inode = inodes[inode_num];
-    std::string content;
-    content.reserve(inode.size);
-    char buffer[BLOCK_SIZE];
-    int bytes_left = inode.size;
-
-    // Direct blocks
-    for (int i = 0; i < 10 && bytes_left > 0; ++i) {
+    // Gather the block list first so every data block is in flight at once
+    const Inode &inode = inodes[inode_num];
+    std::vector<int> block_nums;
+    int blocks_needed = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int i = 0; i < 10 && static_cast<int>(block_nums.size()) < blocks_needed; ++i) {
         if (inode.direct_blocks[i] != 0) {
-            read_block(inode.direct_blocks[i], buffer);
-            int to_read = std::min(bytes_left, BLOCK_SIZE);
-            content.append(buffer, to_read);
-            bytes_left -= to_read;
+            block_nums.push_back(inode.direct_blocks[i]);
         }
     }
-
-    // Indirect blocks
-    if (bytes_left > 0 && inode.indirect_block != 0) {
+    if (static_cast<int>(block_nums.size()) < blocks_needed && inode.indirect_block != 0) {
         char indirect_buffer[BLOCK_SIZE];
         read_block(inode.indirect_block, indirect_buffer);
         int *block_pointers = (int *)indirect_buffer;
         int pointers_per_block = BLOCK_SIZE / sizeof(int);
 
-        for (int i = 0; i < pointers_per_block && bytes_left > 0; ++i) {
+        for (int i = 0; i < pointers_per_block &&
+                        static_cast<int>(block_nums.size()) < blocks_needed;
+             ++i) {
             if (block_pointers[i] != 0) {
-                read_block(block_pointers[i], buffer);
-                int to_read = std::min(bytes_left, BLOCK_SIZE);
-                content.append(buffer, to_read);
-                bytes_left -= to_read;
+                block_nums.push_back(block_pointers[i]);
             }
         }
     }
 
+    std::string content(block_nums.size() * BLOCK_SIZE, '\0');
+    if (!block_nums.empty()) {
+        read_blocks(block_nums, &content[0]);
+    }
+    content.resize(std::min<size_t>(content.size(), inode.size));
+
+    // Readers share the stripe; the access time is the one thing they change
+    inode_guard.unlock();
+    std::lock_guard<std::shared_mutex> update_guard(inode_lock(inode_num));
+    update_inode_times(inode_num, true, false, false);
     return content;
 }
 
-void FileSystem::chmod(const std::string &path, int mode) {
+void FileSystem::chmod(const FsContext &context, const std::string &path, int mode) {
+    ExclusiveLock lock(this);
     journal->begin_transaction();
-    int inode_num = find_inode_by_path(path);
+    int inode_num = find_inode_by_path(context, path);
     if (inode_num != -1) {
         inodes[inode_num].mode = (inodes[inode_num].mode & ~0777) | mode;
         update_inode_times(inode_num, false, true, false);
@@ -652,12 +1235,17 @@ void FileSystem::chmod(const std::string &path, int mode) {
     journal->commit_transaction();
 }
 
-void FileSystem::chown(const std::string &path, int uid, int gid) {
+void FileSystem::chown(const FsContext &context, const std::string &path, int uid, int gid) {
+    ExclusiveLock lock(this);
     journal->begin_transaction();
-    int inode_num = find_inode_by_path(path);
+    int inode_num = find_inode_by_path(context, path);
     if (inode_num != -1) {
+        // Move the inode's usage over to its new owner
+        int blocks = count_inode_blocks(inode_num);
+        charge_usage(inode_num, -blocks, -1);
         inodes[inode_num].uid = uid;
         inodes[inode_num].gid = gid;
+        charge_usage(inode_num, blocks, 1);
         update_inode_times(inode_num, false, true, false);
 
         char inode_buffer[BLOCK_SIZE];
@@ -673,9 +1261,11 @@ void FileSystem::chown(const std::string &path, int uid, int gid) {
     journal->commit_transaction();
 }
 
-void FileSystem::link(const std::string &oldpath, const std::string &newpath) {
+void FileSystem::link(const FsContext &context, const std::string &oldpath,
+                      const std::string &newpath) {
+    ExclusiveLock lock(this);
     journal->begin_transaction();
-    int inode_num = find_inode_by_path(oldpath);
+    int inode_num = find_inode_by_path(context, oldpath);
     if (inode_num == -1) {
         std::cerr << "Error: Source file not found." << std::endl;
         journal->commit_transaction();
@@ -688,7 +1278,7 @@ void FileSystem::link(const std::string &oldpath, const std::string &newpath) {
     }
 
     // For simplicity, assuming newpath is in the current directory
-    add_dir_entry(current_dir_inode, newpath, inode_num);
+    add_dir_entry(context.current_dir_inode, newpath, inode_num);
     inodes[inode_num].link_count++;
     update_inode_times(inode_num, false, true, false);
 
@@ -702,8 +1292,16 @@ void FileSystem::link(const std::string &oldpath, const std::string &newpath) {
     journal->commit_transaction();
 }
 
-void FileSystem::symlink(const std::string &target, const std::string &linkpath) {
+void FileSystem::symlink(const FsContext &context, const std::string &target,
+                         const std::string &linkpath) {
+    ExclusiveLock lock(this);
+    int parent_dir = context.current_dir_inode;
     journal->begin_transaction();
+    int target_blocks = target.empty() ? 0 : 1;
+    if (!quota_allows(0, 0, target_blocks, 1, parent_dir, parent_dir)) {
+        journal->commit_transaction();
+        return;
+    }
     int new_inode_num = find_free_inode();
     if (new_inode_num == -1) {
         std::cerr << "Error: No free inodes." << std::endl;
@@ -712,15 +1310,17 @@ void FileSystem::symlink(const std::string &target, const std::string &linkpath)
     }
 
     inodes[new_inode_num].mode = 3; // Symbolic link type
+    sb.free_inodes--;
     inodes[new_inode_num].size = target.length();
     inodes[new_inode_num].uid = 0;
     inodes[new_inode_num].gid = 0;
     inodes[new_inode_num].link_count = 1;
     update_inode_times(new_inode_num, true, true, true);
+    charge_usage(new_inode_num, 0, 1);
 
     // Store target path in a data block
     if (!target.empty()) {
-        int block_num = allocate_block();
+        int block_num = allocate_block(new_inode_num);
         if (block_num != -1) {
             inodes[new_inode_num].direct_blocks[0] = block_num;
             char buffer[BLOCK_SIZE] = {0};
@@ -730,7 +1330,7 @@ void FileSystem::symlink(const std::string &target, const std::string &linkpath)
         }
     }
 
-    add_dir_entry(current_dir_inode, linkpath, new_inode_num);
+    add_dir_entry(parent_dir, linkpath, new_inode_num);
 
     char inode_buffer[BLOCK_SIZE];
     int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
@@ -742,28 +1342,64 @@ void FileSystem::symlink(const std::string &target, const std::string &linkpath)
     journal->commit_transaction();
 }
 
-void FileSystem::unlink(const std::string &path) {
+void FileSystem::unlink(const FsContext &context, const std::string &path) {
+    ExclusiveLock lock(this);
     journal->begin_transaction();
-    // This is a simplified unlink. It doesn't handle removing directory entries yet.
-    int inode_num = find_inode_by_path(path);
+    int inode_num = find_inode_by_path(context, path);
     if (inode_num == -1) {
         std::cerr << "Error: File not found." << std::endl;
         journal->commit_transaction();
         return;
     }
 
+    // Remove the name from its parent directory
+    std::string name = path;
+    int parent_inode = context.current_dir_inode;
+    size_t last_slash = path.find_last_of('/');
+    if (last_slash != std::string::npos) {
+        name = path.substr(last_slash + 1);
+        parent_inode =
+            last_slash == 0 ? 0 : find_inode_by_path(context, path.substr(0, last_slash));
+    }
+    remove_dir_entry(parent_inode, name);
+
     inodes[inode_num].link_count--;
     if (inodes[inode_num].link_count == 0) {
         // Free data blocks
         for (int i = 0; i < 10; ++i) {
             if (inodes[inode_num].direct_blocks[i] != 0) {
-                free_block(inodes[inode_num].direct_blocks[i]);
+                free_block(inodes[inode_num].direct_blocks[i], inode_num);
+                inodes[inode_num].direct_blocks[i] = 0;
+            }
+        }
+        if (inodes[inode_num].indirect_block != 0) {
+            char buffer[BLOCK_SIZE];
+            read_block(inodes[inode_num].indirect_block, buffer);
+            int *block_pointers = (int *)buffer;
+            int pointers_per_block = BLOCK_SIZE / sizeof(int);
+            for (int i = 0; i < pointers_per_block; ++i) {
+                if (block_pointers[i] != 0) {
+                    free_block(block_pointers[i], inode_num);
+                }
             }
+            free_block(inodes[inode_num].indirect_block, inode_num);
+            inodes[inode_num].indirect_block = 0;
         }
-        // Free indirect blocks... (omitted for brevity)
 
         // Free inode
+        charge_usage(inode_num, 0, -1);
+        if (quota_manager) {
+            quota_manager->remove_project_quota(inode_num);
+        }
+        parent_dirs[inode_num] = -1;
+        if (inodes[inode_num].mode == 2) {
+            for (int &parent : parent_dirs) {
+                if (parent == inode_num)
+                    parent = -1;
+            }
+        }
         inodes[inode_num].mode = 0; // Mark as free
+        sb.free_inodes++;
     }
     update_inode_times(inode_num, false, true, false);
 
@@ -819,7 +1455,7 @@ Inode FileSystem::get_inode(int inode_num) const {
     }
 
     // Check if filesystem is mounted
-    if (!disk.is_open()) {
+    if (!device->is_open()) {
         if (inode_num != 0) { // Don't log for root inode
             qDebug() << "Warning: Attempting to get inode" << inode_num
                      << "from unmounted filesystem";
@@ -854,6 +1490,8 @@ void FileSystem::update_inode_times(int inode_num, bool access, bool modify, boo
         return;
     }
 
+    // The stamp comes from the superblock and the index is shared with other writers
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
     time_t now = time(nullptr);
     if (create)
         inodes[inode_num].creation_time = now;
@@ -861,6 +1499,9 @@ void FileSystem::update_inode_times(int inode_num, bool access, bool modify, boo
         inodes[inode_num].access_time = now;
     if (modify)
         inodes[inode_num].modification_time = now;
+    if (modify || create)
+        inodes[inode_num].generation = ++sb.change_sequence;
+    reindex_inode(inode_num);
 }
 
 bool FileSystem::is_valid_inode(int inode_num) const {
@@ -876,7 +1517,7 @@ bool FileSystem::is_valid_inode(int inode_num) const {
     }
 
     // Check if filesystem is mounted
-    if (!disk.is_open()) {
+    if (!device->is_open()) {
         return false; // Filesystem not mounted
     }
 
@@ -895,6 +1536,7 @@ bool FileSystem::is_valid_inode(int inode_num) const {
 
 // Fix an invalid block pointer in an inode
 void FileSystem::fix_invalid_block_pointer(int inode_num, int block_index) {
+    ExclusiveLock lock(this);
     if (!is_valid_inode(inode_num)) {
         std::cerr << "Error: Cannot fix invalid block pointer for invalid inode " << inode_num
                   << std::endl;
@@ -918,12 +1560,16 @@ void FileSystem::fix_invalid_block_pointer(int inode_num, int block_index) {
     // Update inode times
     update_inode_times(inode_num, false, true, false);
 
-    // Write inodes back to disk
-    write_inodes();
+    // Write the inode's table block back to disk, or defer it to the open batch
+    mark_inode_dirty(inode_num);
+    if (!inode_batch_active) {
+        flush_dirty_inodes();
+    }
 }
 
 // Fix an orphaned inode by adding it to lost+found
 void FileSystem::fix_orphaned_inode(int inode_num, int lost_found_inode) {
+    ExclusiveLock lock(this);
     if (!is_valid_inode(inode_num) || !is_valid_inode(lost_found_inode)) {
         std::cerr << "Error: Invalid inode numbers for fix_orphaned_inode" << std::endl;
         return;
@@ -942,12 +1588,17 @@ void FileSystem::fix_orphaned_inode(int inode_num, int lost_found_inode) {
     update_inode_times(inode_num, false, true, false);
     update_inode_times(lost_found_inode, false, true, false);
 
-    // Write inodes back to disk
-    write_inodes();
+    // lost+found may have grown a new directory block, so both inodes are dirty
+    mark_inode_dirty(inode_num);
+    mark_inode_dirty(lost_found_inode);
+    if (!inode_batch_active) {
+        flush_dirty_inodes();
+    }
 }
 
 // Fix incorrect link count for an inode
 void FileSystem::fix_inode_link_count(int inode_num, int correct_count) {
+    ExclusiveLock lock(this);
     if (!is_valid_inode(inode_num)) {
         std::cerr << "Error: Cannot fix link count for invalid inode " << inode_num << std::endl;
         return;
@@ -958,32 +1609,1309 @@ void FileSystem::fix_inode_link_count(int inode_num, int correct_count) {
     // Update inode times
     update_inode_times(inode_num, false, true, false);
 
-    // Write inodes back to disk
-    write_inodes();
+    // Write the inode's table block back to disk, or defer it to the open batch
+    mark_inode_dirty(inode_num);
+    if (!inode_batch_active) {
+        flush_dirty_inodes();
+    }
 }
 
 // Create lost+found directory if it doesn't exist
 int FileSystem::create_lost_found() {
+    ExclusiveLock lock(this);
     // Check if lost+found already exists
     int lost_found_inode = find_inode_by_path("/lost+found");
     if (lost_found_inode != -1) {
         return lost_found_inode;
     }
 
-    // Save current directory
-    int saved_dir = current_dir_inode;
-
-    // Go to root directory
-    current_dir_inode = 0;
-
-    // Create lost+found directory
-    mkdir("lost+found");
+    // Create lost+found directory from the root, leaving the caller's directory alone
+    FsContext root;
+    mkdir(root, "lost+found");
 
     // Find the inode for the new lost+found directory
     lost_found_inode = find_inode_by_path("/lost+found");
 
-    // Restore current directory
-    current_dir_inode = saved_dir;
-
     return lost_found_inode;
 }
+
+void FileSystem::bump_generation() {
+    generation++;
+}
+
+unsigned long long FileSystem::get_generation() const {
+    return generation;
+}
+
+void FileSystem::set_quota_manager(QuotaManager *manager) {
+    quota_manager = manager;
+}
+
+QuotaManager *FileSystem::get_quota_manager() const {
+    return quota_manager;
+}
+
+std::vector<int> FileSystem::chain_blocks(int head) {
+    std::vector<int> chain;
+    int data_start = 1 + sb.inode_blocks + NUM_JOURNAL_BLOCKS;
+    int block = head;
+    char buffer[BLOCK_SIZE];
+    // Stop at anything out of range, and at a cycle, which would outgrow the disk
+    while (block >= data_start && block < sb.num_blocks &&
+           static_cast<int>(chain.size()) < sb.num_blocks) {
+        chain.push_back(block);
+        read_block(block, buffer);
+        memcpy(&block, buffer, sizeof(int));
+    }
+    return chain;
+}
+
+int FileSystem::chain_length(size_t size) const {
+    return (static_cast<int>(size) + CHAIN_PAYLOAD - 1) / CHAIN_PAYLOAD;
+}
+
+bool FileSystem::read_chain(int head, std::string &data) {
+    data.clear();
+    if (!device->is_open() || head == 0) {
+        return false;
+    }
+
+    // Each block holds the next block number, the bytes used, then the bytes themselves
+    char buffer[BLOCK_SIZE];
+    for (int block : chain_blocks(head)) {
+        read_block(block, buffer);
+        int length;
+        memcpy(&length, buffer + sizeof(int), sizeof(int));
+        if (length < 0 || length > CHAIN_PAYLOAD) {
+            data.clear();
+            return false;
+        }
+        data.append(buffer + 2 * sizeof(int), length);
+    }
+    return true;
+}
+
+bool FileSystem::stage_chain(int head, size_t size, std::vector<int> &chain,
+                             std::vector<int> &surplus) {
+    // Reuse the current chain and allocate only what is missing. Surplus blocks are freed
+    // by the caller after the commit, so the old contents stay intact until then.
+    int needed = chain_length(size);
+    chain = chain_blocks(head);
+    while (static_cast<int>(chain.size()) > needed) {
+        surplus.push_back(chain.back());
+        chain.pop_back();
+    }
+    size_t reused = chain.size();
+    while (static_cast<int>(chain.size()) < needed) {
+        int block = allocate_block();
+        if (block == -1) {
+            std::cerr << "Error: Out of space." << std::endl;
+            for (size_t i = reused; i < chain.size(); ++i) {
+                free_block(chain[i]);
+            }
+            chain.resize(reused);
+            return false;
+        }
+        chain.push_back(block);
+    }
+    return true;
+}
+
+void FileSystem::log_chain(const std::vector<int> &chain, const std::string &data) {
+    char buffer[BLOCK_SIZE];
+    int needed = static_cast<int>(chain.size());
+    for (int i = 0; i < needed; ++i) {
+        int next = i + 1 < needed ? chain[i + 1] : 0;
+        int offset = i * CHAIN_PAYLOAD;
+        int length = std::min(CHAIN_PAYLOAD, static_cast<int>(data.size()) - offset);
+        memset(buffer, 0, BLOCK_SIZE);
+        memcpy(buffer, &next, sizeof(int));
+        memcpy(buffer + sizeof(int), &length, sizeof(int));
+        memcpy(buffer + 2 * sizeof(int), data.data() + offset, length);
+        journal->log_metadata_block(chain[i], buffer);
+    }
+}
+
+void FileSystem::log_superblock() {
+    char buffer[BLOCK_SIZE] = {0};
+    memcpy(buffer, &sb, sizeof(Superblock));
+    journal->log_metadata_block(0, buffer);
+}
+
+bool FileSystem::read_quota_file(std::string &data) {
+    SharedLock lock(this);
+    return read_chain(sb.quota_block, data);
+}
+
+bool FileSystem::write_quota_file(const std::string &data) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal) {
+        return false;
+    }
+    if (chain_length(data.size()) + 1 > journal->max_blocks_per_transaction()) {
+        std::cerr << "Error: Quota file does not fit in one journal transaction." << std::endl;
+        return false;
+    }
+
+    std::vector<int> chain;
+    std::vector<int> surplus;
+    if (!stage_chain(sb.quota_block, data.size(), chain, surplus)) {
+        return false;
+    }
+
+    journal->begin_transaction();
+    log_chain(chain, data);
+    sb.quota_block = chain.empty() ? 0 : chain[0];
+    sb.quota_usage_valid = 1;
+    log_superblock();
+    journal->commit_transaction();
+
+    for (int block : surplus) {
+        free_block(block);
+    }
+    return true;
+}
+
+void FileSystem::collect_blocks(const std::vector<Inode> &table, std::vector<int> &blocks) {
+    int data_start = 1 + sb.inode_blocks + NUM_JOURNAL_BLOCKS;
+    auto valid = [&](int block) { return block >= data_start && block < sb.num_blocks; };
+    char buffer[BLOCK_SIZE];
+    for (const auto &inode : table) {
+        if (inode.mode == 0)
+            continue;
+        for (int i = 0; i < 10; ++i) {
+            if (valid(inode.direct_blocks[i]))
+                blocks.push_back(inode.direct_blocks[i]);
+        }
+        if (valid(inode.indirect_block)) {
+            blocks.push_back(inode.indirect_block);
+            read_block(inode.indirect_block, buffer);
+            int *block_pointers = (int *)buffer;
+            int pointers_per_block = BLOCK_SIZE / sizeof(int);
+            for (int i = 0; i < pointers_per_block; ++i) {
+                if (valid(block_pointers[i]))
+                    blocks.push_back(block_pointers[i]);
+            }
+        }
+    }
+}
+
+bool FileSystem::read_snapshot_table(int table_block, std::vector<Inode> &table) {
+    std::string data;
+    if (!read_chain(table_block, data) || data.size() != NUM_INODES * sizeof(Inode)) {
+        return false;
+    }
+    table.resize(NUM_INODES);
+    memcpy(table.data(), data.data(), data.size());
+    return true;
+}
+
+bool FileSystem::write_snapshot_list(const std::vector<SnapshotRecord> &list,
+                                     const std::vector<int> &queue,
+                                     const std::vector<int> &table_chain,
+                                     const std::string &table, std::vector<int> &surplus) {
+    int header[3] = {SNAPSHOT_LIST_MAGIC, static_cast<int>(list.size()),
+                     static_cast<int>(queue.size())};
+    std::string data((const char *)header, sizeof(header));
+    data.append((const char *)list.data(), list.size() * sizeof(SnapshotRecord));
+    data.append((const char *)queue.data(), queue.size() * sizeof(int));
+    if (list.empty() && queue.empty()) {
+        data.clear();
+    }
+    std::string bits = reclaim_bitmap();
+
+    int blocks = chain_length(data.size()) + chain_length(bits.size()) +
+                 static_cast<int>(table_chain.size()) + 1;
+    if (blocks > journal->max_blocks_per_transaction()) {
+        std::cerr << "Error: Snapshot list does not fit in one journal transaction." << std::endl;
+        return false;
+    }
+    std::vector<int> chain;
+    std::vector<int> reclaim_chain;
+    size_t first_surplus = surplus.size();
+    if (!stage_chain(sb.snapshot_block, data.size(), chain, surplus)) {
+        return false;
+    }
+    if (!stage_chain(sb.reclaim_block, bits.size(), reclaim_chain, surplus)) {
+        // Blocks just added to the list chain go back; its old blocks are still in use
+        std::vector<int> old_chain = chain_blocks(sb.snapshot_block);
+        for (int block : chain) {
+            if (std::find(old_chain.begin(), old_chain.end(), block) == old_chain.end())
+                free_block(block);
+        }
+        surplus.resize(first_surplus);
+        return false;
+    }
+
+    // The saved table, the list naming it, the blocks waiting to be freed and the
+    // superblock land together
+    journal->begin_transaction();
+    if (!table_chain.empty()) {
+        log_chain(table_chain, table);
+    }
+    log_chain(chain, data);
+    log_chain(reclaim_chain, bits);
+    sb.snapshot_block = chain.empty() ? 0 : chain[0];
+    sb.reclaim_block = reclaim_chain.empty() ? 0 : reclaim_chain[0];
+    log_superblock();
+    journal->commit_transaction();
+    return true;
+}
+
+void FileSystem::load_snapshots() {
+    snapshots.clear();
+    delete_queue.clear();
+    snapshot_blocks.clear();
+    snapshot_counts_dirty = false;
+    snapshot_refs.assign(NUM_BLOCKS, 0);
+
+    std::string data;
+    int header[3];
+    if (!read_chain(sb.snapshot_block, data) || data.size() < sizeof(header)) {
+        return;
+    }
+    memcpy(header, data.data(), sizeof(header));
+    if (header[0] != SNAPSHOT_LIST_MAGIC || header[1] < 0 || header[2] < 0 ||
+        data.size() != sizeof(header) + header[1] * sizeof(SnapshotRecord) +
+                           header[2] * sizeof(int)) {
+        std::cerr << "Warning: Ignoring a damaged snapshot list." << std::endl;
+        return;
+    }
+    const char *records = data.data() + sizeof(header);
+    snapshots.resize(header[1]);
+    memcpy(snapshots.data(), records, header[1] * sizeof(SnapshotRecord));
+    delete_queue.resize(header[2]);
+    memcpy(delete_queue.data(), records + header[1] * sizeof(SnapshotRecord),
+           header[2] * sizeof(int));
+
+    // The reference counts are not stored; every saved table is walked once instead.
+    // Deleted snapshots still waiting in the queue hold their blocks until processed.
+    std::vector<int> tables;
+    for (const auto &snapshot : snapshots) {
+        tables.push_back(snapshot.table_block);
+    }
+    tables.insert(tables.end(), delete_queue.begin(), delete_queue.end());
+    std::vector<Inode> table;
+    std::vector<int> blocks;
+    snapshot_blocks.assign(snapshots.size(), std::vector<bool>(NUM_BLOCKS, false));
+    for (size_t i = 0; i < tables.size(); ++i) {
+        blocks.clear();
+        if (read_snapshot_table(tables[i], table)) {
+            collect_blocks(table, blocks);
+            raise_change_sequence(table);
+        }
+        for (int block : blocks) {
+            snapshot_refs[block]++;
+            if (i < snapshots.size())
+                snapshot_blocks[i][block] = true;
+        }
+    }
+
+    // The saved exclusive counts were kept up to date only if the last session ended cleanly
+    if (!mounted_clean) {
+        count_exclusive_blocks();
+        snapshot_counts_dirty = true;
+    }
+}
+
+std::vector<bool> FileSystem::live_block_map() {
+    std::vector<int> live_blocks;
+    collect_blocks(inodes, live_blocks);
+    std::vector<bool> live(NUM_BLOCKS, false);
+    for (int block : live_blocks) {
+        live[block] = true;
+    }
+    return live;
+}
+
+void FileSystem::count_exclusive_blocks() {
+    std::vector<bool> live = live_block_map();
+    for (size_t i = 0; i < snapshots.size(); ++i) {
+        int exclusive = 0;
+        for (int block = 0; block < NUM_BLOCKS; ++block) {
+            if (snapshot_blocks[i][block] && snapshot_refs[block] == 1 && !live[block])
+                exclusive++;
+        }
+        snapshots[i].exclusive_blocks = exclusive;
+    }
+}
+
+void FileSystem::credit_exclusive_block(int block_num) {
+    if (snapshot_refs[block_num] != 1) {
+        return;
+    }
+    // The holder may also be a deleted snapshot waiting in the queue, which keeps no count
+    for (size_t i = 0; i < snapshots.size(); ++i) {
+        if (snapshot_blocks[i][block_num]) {
+            snapshots[i].exclusive_blocks++;
+            snapshot_counts_dirty = true;
+            return;
+        }
+    }
+}
+
+bool FileSystem::is_snapshot_block(int block_num) const {
+    return block_num > 0 && block_num < static_cast<int>(snapshot_refs.size()) &&
+           snapshot_refs[block_num] > 0;
+}
+
+bool FileSystem::is_view_pinned(int block_num) const {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    return block_num > 0 && block_num < static_cast<int>(block_stamps.size()) &&
+           !read_views.empty() && block_stamps[block_num] <= *read_views.rbegin();
+}
+
+void FileSystem::drop_read_views() {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    read_views.clear();
+    block_stamps.assign(NUM_BLOCKS, 0);
+    view_state.reset();
+}
+
+int FileSystem::release_unpinned_blocks() {
+    std::vector<int> unpinned;
+    {
+        std::lock_guard<std::mutex> lock(view_mutex);
+        std::vector<std::pair<int, int>> still_pinned;
+        for (const auto &freed : pinned_frees) {
+            if (!read_views.empty() && *read_views.begin() < freed.second) {
+                still_pinned.push_back(freed);
+            } else {
+                unpinned.push_back(freed.first);
+            }
+        }
+        pinned_frees.swap(still_pinned);
+    }
+    // The owner was already uncharged when the live tree let go of the block
+    for (int block : unpinned) {
+        free_block(block);
+    }
+    return static_cast<int>(unpinned.size());
+}
+
+ViewState::ViewState() : generation(0), names(nullptr), attributes(nullptr) {
+}
+
+ViewState::~ViewState() {
+    delete names;
+    delete attributes;
+}
+
+int FileSystem::open_read_view(std::shared_ptr<const ViewState> &state) {
+    // The state is taken with no other operation in progress
+    ExclusiveLock exclusive(this);
+    state.reset();
+    if (!device->is_open() || !journal) {
+        return -1;
+    }
+    // Every change bumps the generation, so a state built for it is still exact. The live
+    // indexes change under writers, so readers get copies.
+    if (!view_state || view_state->generation != generation) {
+        std::shared_ptr<ViewState> fresh = std::make_shared<ViewState>();
+        fresh->generation = generation;
+        fresh->inodes = inodes;
+        fresh->parent_dirs = parent_dirs;
+        if (name_index) {
+            fresh->names = new NameIndex(*name_index);
+        }
+        if (inode_index) {
+            fresh->attributes = new InodeIndex(*inode_index);
+        }
+        view_state = fresh;
+    }
+    state = view_state;
+
+    std::lock_guard<std::mutex> lock(view_mutex);
+    int view_id = next_view_id++;
+    read_views.insert(view_id);
+    return view_id;
+}
+
+void FileSystem::close_read_view(int view_id) {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    read_views.erase(view_id);
+}
+
+bool FileSystem::is_read_view_open(int view_id) const {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    return read_views.count(view_id) != 0;
+}
+
+int FileSystem::relocate_shared_block(int owner_inode, int block_num) {
+    if (!is_snapshot_block(block_num) && !is_view_pinned(block_num)) {
+        return block_num;
+    }
+    int fresh = allocate_block(owner_inode);
+    if (fresh == -1) {
+        std::cerr << "Error: Out of space." << std::endl;
+        return -1;
+    }
+    free_block(block_num, owner_inode);
+    return fresh;
+}
+
+bool FileSystem::create_snapshot(const std::string &name) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal) {
+        return false;
+    }
+    if (name.empty() || name.size() >= MAX_FILENAME_LENGTH) {
+        std::cerr << "Error: Invalid snapshot name." << std::endl;
+        return false;
+    }
+    for (const auto &snapshot : snapshots) {
+        if (strncmp(snapshot.name, name.c_str(), MAX_FILENAME_LENGTH) == 0) {
+            std::cerr << "Error: Snapshot already exists." << std::endl;
+            return false;
+        }
+    }
+
+    // Only metadata is written: the inode table is saved and the data stays where it is
+    std::string table((const char *)inodes.data(), inodes.size() * sizeof(Inode));
+    std::vector<int> table_chain;
+    std::vector<int> surplus;
+    if (!stage_chain(0, table.size(), table_chain, surplus)) {
+        return false;
+    }
+
+    std::vector<int> blocks;
+    collect_blocks(inodes, blocks);
+
+    // Everything the new snapshot references is live, so none of it is exclusive yet
+    SnapshotRecord record;
+    memset(&record, 0, sizeof(SnapshotRecord));
+    strncpy(record.name, name.c_str(), MAX_FILENAME_LENGTH - 1);
+    record.creation_time = time(nullptr);
+    record.table_block = table_chain[0];
+    record.blocks_used = static_cast<int>(blocks.size());
+    record.exclusive_blocks = 0;
+    std::vector<SnapshotRecord> list = snapshots;
+    list.push_back(record);
+
+    if (!write_snapshot_list(list, delete_queue, table_chain, table, surplus)) {
+        for (int block : table_chain) {
+            free_block(block);
+        }
+        return false;
+    }
+    for (int block : surplus) {
+        free_block(block);
+    }
+
+    std::vector<bool> referenced(NUM_BLOCKS, false);
+    for (int block : blocks) {
+        snapshot_refs[block]++;
+        referenced[block] = true;
+    }
+    snapshots = list;
+    snapshot_blocks.push_back(referenced);
+    snapshot_counts_dirty = false;
+    return true;
+}
+
+bool FileSystem::delete_snapshot(const std::string &name) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal) {
+        return false;
+    }
+    size_t index = 0;
+    while (index < snapshots.size() &&
+           strncmp(snapshots[index].name, name.c_str(), MAX_FILENAME_LENGTH) != 0) {
+        index++;
+    }
+    if (index == snapshots.size()) {
+        std::cerr << "Error: Snapshot not found." << std::endl;
+        return false;
+    }
+
+    // The snapshot disappears from the list at once; its table moves to the delete queue and
+    // reclaim_blocks releases its blocks later
+    std::vector<SnapshotRecord> list = snapshots;
+    list.erase(list.begin() + index);
+    std::vector<int> queue = delete_queue;
+    queue.push_back(snapshots[index].table_block);
+    std::vector<int> surplus;
+    if (!write_snapshot_list(list, queue, std::vector<int>(), std::string(), surplus)) {
+        return false;
+    }
+    snapshots = list;
+    snapshot_blocks.erase(snapshot_blocks.begin() + index);
+    snapshot_counts_dirty = false;
+    delete_queue = queue;
+    for (int block : surplus) {
+        free_block(block);
+    }
+    return true;
+}
+
+bool FileSystem::release_deleted_snapshot() {
+    if (delete_queue.empty()) {
+        return false;
+    }
+    int table_block = delete_queue.front();
+    std::vector<Inode> table;
+    std::vector<int> blocks;
+    if (read_snapshot_table(table_block, table)) {
+        collect_blocks(table, blocks);
+    }
+    std::vector<bool> live = live_block_map();
+
+    // A block whose last snapshot reference goes away is queued for freeing unless the live
+    // tree uses it. The saved table itself goes the same way. A block left with one
+    // reference that the live tree doesn't use becomes exclusive to that snapshot.
+    std::vector<SnapshotRecord> list = snapshots;
+    std::vector<int> released;
+    std::vector<int> dropped;
+    for (int block : blocks) {
+        if (snapshot_refs[block] == 0)
+            continue;
+        snapshot_refs[block]--;
+        released.push_back(block);
+        if (live[block])
+            continue;
+        if (snapshot_refs[block] == 0 && !reclaim_pending[block]) {
+            dropped.push_back(block);
+        } else if (snapshot_refs[block] == 1) {
+            for (size_t i = 0; i < list.size(); ++i) {
+                if (snapshot_blocks[i][block]) {
+                    list[i].exclusive_blocks++;
+                    break;
+                }
+            }
+        }
+    }
+    for (int block : chain_blocks(table_block)) {
+        if (!reclaim_pending[block])
+            dropped.push_back(block);
+    }
+    for (int block : dropped) {
+        reclaim_pending[block] = true;
+    }
+    reclaim_count += static_cast<int>(dropped.size());
+
+    std::vector<int> queue(delete_queue.begin() + 1, delete_queue.end());
+    std::vector<int> surplus;
+    if (!write_snapshot_list(list, queue, std::vector<int>(), std::string(), surplus)) {
+        for (int block : released) {
+            snapshot_refs[block]++;
+        }
+        load_reclaim_list();
+        return false;
+    }
+    snapshots = list;
+    snapshot_counts_dirty = false;
+    delete_queue = queue;
+    for (int block : surplus) {
+        free_block(block);
+    }
+    return true;
+}
+
+std::vector<SnapshotRecord> FileSystem::get_snapshots() const {
+    return snapshots;
+}
+
+bool FileSystem::read_snapshot_inodes(const std::string &name, std::vector<Inode> &table) {
+    SharedLock lock(this);
+    for (const auto &snapshot : snapshots) {
+        if (strncmp(snapshot.name, name.c_str(), MAX_FILENAME_LENGTH) == 0) {
+            return read_snapshot_table(snapshot.table_block, table);
+        }
+    }
+    return false;
+}
+
+int FileSystem::get_snapshot_refs(int block_num) const {
+    return is_snapshot_block(block_num) ? snapshot_refs[block_num] : 0;
+}
+
+std::string FileSystem::reclaim_bitmap() const {
+    std::string bits;
+    if (reclaim_count == 0) {
+        return bits;
+    }
+    bits.assign((NUM_BLOCKS + 7) / 8, '\0');
+    for (int block = 0; block < NUM_BLOCKS; ++block) {
+        if (reclaim_pending[block]) {
+            bits[block / 8] |= static_cast<char>(1 << (block % 8));
+        }
+    }
+    return bits;
+}
+
+void FileSystem::load_reclaim_list() {
+    reclaim_pending.assign(NUM_BLOCKS, false);
+    reclaim_count = 0;
+
+    std::string bits;
+    if (!read_chain(sb.reclaim_block, bits) || bits.empty()) {
+        return;
+    }
+    if (bits.size() != (NUM_BLOCKS + 7) / 8) {
+        std::cerr << "Warning: Ignoring a damaged reclaim list." << std::endl;
+        return;
+    }
+    int data_start = 1 + sb.inode_blocks + NUM_JOURNAL_BLOCKS;
+    for (int block = data_start; block < sb.num_blocks; ++block) {
+        if (bits[block / 8] & (1 << (block % 8))) {
+            reclaim_pending[block] = true;
+            reclaim_count++;
+        }
+    }
+}
+
+bool FileSystem::restore_snapshot(const std::string &name) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal) {
+        return false;
+    }
+    std::vector<Inode> table;
+    if (!read_snapshot_inodes(name, table)) {
+        std::cerr << "Error: Snapshot not found." << std::endl;
+        return false;
+    }
+
+    // Blocks of the current tree that no snapshot holds are dropped with it. The restored
+    // table's blocks all belong to its snapshot, so none of them can be queued here.
+    std::vector<int> live_blocks;
+    collect_blocks(inodes, live_blocks);
+    for (int block : live_blocks) {
+        if (!is_snapshot_block(block) && !reclaim_pending[block]) {
+            reclaim_pending[block] = true;
+            reclaim_count++;
+        }
+    }
+
+    std::string bits = reclaim_bitmap();
+    std::vector<int> chain;
+    std::vector<int> surplus;
+    bool fits = sb.inode_blocks + chain_length(bits.size()) + 1 <=
+                journal->max_blocks_per_transaction();
+    if (!fits || !stage_chain(sb.reclaim_block, bits.size(), chain, surplus)) {
+        if (!fits) {
+            std::cerr << "Error: Restore does not fit in one journal transaction." << std::endl;
+        }
+        load_reclaim_list();
+        return false;
+    }
+
+    int free_inodes = 0;
+    for (const auto &inode : table) {
+        if (inode.mode == 0)
+            free_inodes++;
+    }
+
+    // The new inode table, the queue of dropped blocks and the superblock land together
+    char buffer[BLOCK_SIZE];
+    int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
+    journal->begin_transaction();
+    for (int i = 0; i < sb.inode_blocks; ++i) {
+        int first_inode = i * inodes_per_block;
+        int count = std::min(inodes_per_block, static_cast<int>(table.size()) - first_inode);
+        memset(buffer, 0, BLOCK_SIZE);
+        memcpy(buffer, &table[first_inode], count * sizeof(Inode));
+        journal->log_metadata_block(1 + i, buffer);
+    }
+    log_chain(chain, bits);
+    sb.reclaim_block = chain.empty() ? 0 : chain[0];
+    sb.free_inodes = free_inodes;
+    sb.quota_usage_valid = 0;
+    log_superblock();
+    journal->commit_transaction();
+
+    for (int block : surplus) {
+        free_block(block);
+    }
+
+    inodes = table;
+    dirty_inode_blocks.assign(sb.inode_blocks, false);
+    default_context.current_dir_inode = 0;
+    // Which blocks the live tree shares has changed wholesale
+    count_exclusive_blocks();
+    snapshot_counts_dirty = true;
+    build_parent_dirs();
+    build_inode_index();
+    if (name_index) {
+        build_name_index();
+    }
+    if (quota_manager) {
+        quota_manager->update_usage();
+        quota_manager->save();
+    }
+    return true;
+}
+
+int FileSystem::reclaim_blocks(int max_blocks) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal || max_blocks <= 0) {
+        return 0;
+    }
+    // At most one deleted snapshot is released per call, which bounds the work of each step
+    release_deleted_snapshot();
+    int released = release_unpinned_blocks();
+    if (reclaim_count == 0) {
+        return released;
+    }
+    std::vector<int> batch;
+    for (int block = 0; block < NUM_BLOCKS && static_cast<int>(batch.size()) < max_blocks;
+         ++block) {
+        if (reclaim_pending[block]) {
+            batch.push_back(block);
+            reclaim_pending[block] = false;
+        }
+    }
+    reclaim_count -= static_cast<int>(batch.size());
+
+    // The queue is shortened on disk before the blocks join the free list, so a crash in
+    // between can leak them but never free them twice
+    std::string bits = reclaim_bitmap();
+    std::vector<int> chain;
+    std::vector<int> surplus;
+    if (!stage_chain(sb.reclaim_block, bits.size(), chain, surplus)) {
+        load_reclaim_list();
+        return released;
+    }
+    journal->begin_transaction();
+    log_chain(chain, bits);
+    sb.reclaim_block = chain.empty() ? 0 : chain[0];
+    log_superblock();
+    journal->commit_transaction();
+
+    for (int block : batch) {
+        free_block(block);
+    }
+    for (int block : surplus) {
+        free_block(block);
+    }
+    return released + static_cast<int>(batch.size());
+}
+
+int FileSystem::get_pending_reclaim() const {
+    std::lock_guard<std::mutex> lock(view_mutex);
+    return reclaim_count + static_cast<int>(pinned_frees.size());
+}
+
+int FileSystem::get_pending_deletes() const {
+    return static_cast<int>(delete_queue.size());
+}
+
+void FileSystem::raise_change_sequence(const std::vector<Inode> &table) {
+    for (const auto &inode : table) {
+        if (inode.generation > sb.change_sequence)
+            sb.change_sequence = inode.generation;
+    }
+}
+
+void FileSystem::get_file_blocks(const Inode &inode, std::vector<int> &blocks) {
+    blocks.clear();
+    int data_start = 1 + sb.inode_blocks + NUM_JOURNAL_BLOCKS;
+    auto valid = [&](int block) { return block >= data_start && block < sb.num_blocks; };
+    for (int i = 0; i < 10; ++i) {
+        if (valid(inode.direct_blocks[i]))
+            blocks.push_back(inode.direct_blocks[i]);
+    }
+    if (valid(inode.indirect_block)) {
+        char buffer[BLOCK_SIZE];
+        read_block(inode.indirect_block, buffer);
+        int *block_pointers = (int *)buffer;
+        int pointers_per_block = BLOCK_SIZE / sizeof(int);
+        for (int i = 0; i < pointers_per_block; ++i) {
+            if (valid(block_pointers[i]))
+                blocks.push_back(block_pointers[i]);
+        }
+    }
+}
+
+bool FileSystem::receive_inode(int inode_num, const Inode &source,
+                               const std::vector<int> &indexes, const std::string &data) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal || inode_num < 0 || inode_num >= NUM_INODES ||
+        data.size() != indexes.size() * BLOCK_SIZE) {
+        return false;
+    }
+    Inode &inode = inodes[inode_num];
+    bool same_type = inode.mode != 0 && inode.mode == source.mode;
+
+    std::vector<int> old_blocks;
+    get_file_blocks(inode, old_blocks);
+    std::vector<int> blocks;
+    if (same_type) {
+        blocks = old_blocks;
+    }
+    if (inode.indirect_block != 0) {
+        old_blocks.push_back(inode.indirect_block);
+    }
+
+    Inode updated = source;
+    if (source.mode == 2) {
+        // Directory blocks are this image's own, and entries arrive separately
+        updated.size = same_type ? inode.size : 0;
+        if (!same_type) {
+            blocks.clear();
+        }
+    } else {
+        int pointers_per_block = BLOCK_SIZE / sizeof(int);
+        int count = source.mode == 0 ? 0 : (source.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        count = std::min(count, 10 + pointers_per_block);
+        blocks.resize(count, 0);
+        std::vector<bool> sent(count, false);
+        for (int index : indexes) {
+            if (index < 0 || index >= count) {
+                std::cerr << "Error: Received block is outside the file." << std::endl;
+                return false;
+            }
+            sent[index] = true;
+        }
+        for (int i = 0; i < count; ++i) {
+            if (!sent[i] && blocks[i] == 0) {
+                std::cerr << "Error: Received inode is missing data." << std::endl;
+                return false;
+            }
+        }
+    }
+
+    journal->begin_transaction();
+    // Until the inode is committed nothing references the fresh blocks, so a failure hands
+    // them back and leaves the inode as it was
+    std::vector<int> fresh;
+    auto abandon = [&](const char *message) {
+        std::cerr << "Error: " << message << std::endl;
+        for (int block : fresh) {
+            free_block(block);
+        }
+        journal->commit_transaction();
+        return false;
+    };
+    if (source.mode != 2) {
+        // New data always goes to fresh blocks, which keeps snapshot blocks intact
+        for (size_t k = 0; k < indexes.size(); ++k) {
+            int block_num = allocate_block();
+            if (block_num == -1) {
+                return abandon("Out of space.");
+            }
+            fresh.push_back(block_num);
+            if (!write_block(block_num, data.data() + k * BLOCK_SIZE)) {
+                return abandon("Could not write received data.");
+            }
+            blocks[indexes[k]] = block_num;
+        }
+    }
+
+    for (int i = 0; i < 10; ++i) {
+        updated.direct_blocks[i] = i < static_cast<int>(blocks.size()) ? blocks[i] : 0;
+    }
+    updated.indirect_block = 0;
+    if (blocks.size() > 10) {
+        int indirect_block_num = allocate_block();
+        if (indirect_block_num == -1) {
+            return abandon("Out of space.");
+        }
+        fresh.push_back(indirect_block_num);
+        char indirect_buffer[BLOCK_SIZE] = {0};
+        int *block_pointers = (int *)indirect_buffer;
+        for (size_t i = 10; i < blocks.size(); ++i) {
+            block_pointers[i - 10] = blocks[i];
+        }
+        if (!write_block(indirect_block_num, indirect_buffer)) {
+            return abandon("Could not write received data.");
+        }
+        journal->log_data_block(indirect_block_num, indirect_buffer);
+        updated.indirect_block = indirect_block_num;
+    }
+
+    // Whatever the new layout no longer uses is released
+    std::vector<int> kept = blocks;
+    std::sort(kept.begin(), kept.end());
+    for (int block : old_blocks) {
+        if (!std::binary_search(kept.begin(), kept.end(), block)) {
+            free_block(block);
+        }
+    }
+
+    if (inode.mode == 0 && source.mode != 0) {
+        sb.free_inodes--;
+    } else if (inode.mode != 0 && source.mode == 0) {
+        sb.free_inodes++;
+    }
+    inode = updated;
+    reindex_inode(inode_num);
+
+    char inode_buffer[BLOCK_SIZE];
+    int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
+    int block_to_update = 1 + (inode_num / inodes_per_block);
+    memcpy(inode_buffer, &inodes[(inode_num / inodes_per_block) * inodes_per_block],
+           inodes_per_block * sizeof(Inode));
+    journal->log_metadata_block(block_to_update, inode_buffer);
+
+    journal->commit_transaction();
+    return true;
+}
+
+bool FileSystem::receive_dir_entry(int dir_inode_num, const DirEntry &entry, bool add) {
+    ExclusiveLock lock(this);
+    if (!journal || !is_valid_inode(dir_inode_num) || inodes[dir_inode_num].mode != 2) {
+        return false;
+    }
+    std::string name(entry.name, strnlen(entry.name, MAX_FILENAME_LENGTH));
+
+    journal->begin_transaction();
+    remove_dir_entry(dir_inode_num, name);
+    if (add) {
+        add_dir_entry(dir_inode_num, name, entry.inode_num);
+    }
+
+    char inode_buffer[BLOCK_SIZE];
+    int inodes_per_block = BLOCK_SIZE / sizeof(Inode);
+    int block_to_update = 1 + (dir_inode_num / inodes_per_block);
+    memcpy(inode_buffer, &inodes[(dir_inode_num / inodes_per_block) * inodes_per_block],
+           inodes_per_block * sizeof(Inode));
+    journal->log_metadata_block(block_to_update, inode_buffer);
+
+    journal->commit_transaction();
+    return true;
+}
+
+void FileSystem::finish_receive() {
+    ExclusiveLock lock(this);
+    raise_change_sequence(inodes);
+    build_parent_dirs();
+    build_inode_index();
+    if (name_index) {
+        build_name_index();
+    }
+    if (quota_manager) {
+        quota_manager->update_usage();
+        quota_manager->save();
+    } else {
+        sb.quota_usage_valid = 0;
+    }
+    write_superblock();
+    bump_generation();
+}
+
+bool FileSystem::save_changed_blocks() {
+    if (!device->is_open() || !journal || changed_blocks.empty()) {
+        return false;
+    }
+    std::string data(sizeof(CheckpointHeader) + (NUM_BLOCKS + 7) / 8, '\0');
+    std::vector<int> chain;
+    std::vector<int> surplus;
+    if (!stage_chain(sb.checkpoint_block, data.size(), chain, surplus)) {
+        return false;
+    }
+
+    // Saving rewrites the chain and the superblock after the bitmap is encoded, so they are
+    // marked now. Otherwise a backup taken next time would miss them.
+    changed_blocks[0] = true;
+    for (int block : chain) {
+        changed_blocks[block] = true;
+    }
+    for (int block : surplus) {
+        changed_blocks[block] = true;
+    }
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(CheckpointHeader));
+    header.magic = CHECKPOINT_MAGIC;
+    strncpy(header.name, checkpoint_name.c_str(), MAX_FILENAME_LENGTH - 1);
+    header.created = static_cast<long long>(checkpoint_time);
+    memcpy(&data[0], &header, sizeof(CheckpointHeader));
+    for (int block = 0; block < NUM_BLOCKS; ++block) {
+        if (changed_blocks[block]) {
+            data[sizeof(CheckpointHeader) + block / 8] |= static_cast<char>(1 << (block % 8));
+        }
+    }
+
+    journal->begin_transaction();
+    log_chain(chain, data);
+    sb.checkpoint_block = chain[0];
+    log_superblock();
+    journal->commit_transaction();
+
+    for (int block : surplus) {
+        free_block(block);
+    }
+    return true;
+}
+
+void FileSystem::load_changed_blocks() {
+    checkpoint_name.clear();
+    checkpoint_time = 0;
+
+    std::string data;
+    CheckpointHeader header;
+    bool loaded = read_chain(sb.checkpoint_block, data) &&
+                  data.size() == sizeof(CheckpointHeader) + (NUM_BLOCKS + 7) / 8;
+    if (loaded) {
+        memcpy(&header, data.data(), sizeof(CheckpointHeader));
+        loaded = header.magic == CHECKPOINT_MAGIC;
+    }
+    if (!loaded) {
+        // Nothing to compare against, so everything has changed
+        changed_blocks.assign(NUM_BLOCKS, true);
+        return;
+    }
+    checkpoint_name.assign(header.name, strnlen(header.name, MAX_FILENAME_LENGTH));
+    checkpoint_time = static_cast<time_t>(header.created);
+
+    // Writes made during an unclean session were never recorded
+    if (!mounted_clean) {
+        changed_blocks.assign(NUM_BLOCKS, true);
+        return;
+    }
+    // Blocks this mount has already written stay marked
+    for (int block = 0; block < NUM_BLOCKS; ++block) {
+        if (data[sizeof(CheckpointHeader) + block / 8] & (1 << (block % 8)))
+            changed_blocks[block] = true;
+    }
+}
+
+bool FileSystem::set_checkpoint(const std::string &name) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal) {
+        return false;
+    }
+    if (name.empty() || name.size() >= MAX_FILENAME_LENGTH) {
+        std::cerr << "Error: Invalid checkpoint name." << std::endl;
+        return false;
+    }
+    std::vector<bool> previous = changed_blocks;
+    std::string previous_name = checkpoint_name;
+    time_t previous_time = checkpoint_time;
+
+    changed_blocks.assign(NUM_BLOCKS, false);
+    checkpoint_name = name;
+    checkpoint_time = time(nullptr);
+    if (!save_changed_blocks()) {
+        changed_blocks = previous;
+        checkpoint_name = previous_name;
+        checkpoint_time = previous_time;
+        return false;
+    }
+    return true;
+}
+
+bool FileSystem::advance_checkpoint(const std::string &name) {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal) {
+        return false;
+    }
+    if (name.empty() || name.size() >= MAX_FILENAME_LENGTH) {
+        std::cerr << "Error: Invalid checkpoint name." << std::endl;
+        return false;
+    }
+    std::string previous_name = checkpoint_name;
+    time_t previous_time = checkpoint_time;
+    checkpoint_name = name;
+    checkpoint_time = time(nullptr);
+    if (!save_changed_blocks()) {
+        checkpoint_name = previous_name;
+        checkpoint_time = previous_time;
+        return false;
+    }
+    return true;
+}
+
+std::vector<int> FileSystem::take_changed_blocks() {
+    std::lock_guard<std::mutex> lock(changed_mutex);
+    std::vector<int> blocks;
+    for (int block = 0; block < static_cast<int>(changed_blocks.size()); ++block) {
+        if (changed_blocks[block]) {
+            blocks.push_back(block);
+            changed_blocks[block] = false;
+        }
+    }
+    return blocks;
+}
+
+void FileSystem::restore_changed_blocks(const std::vector<int> &blocks) {
+    mark_changed(blocks.data(), blocks.size());
+}
+
+std::string FileSystem::get_checkpoint() const {
+    return checkpoint_name;
+}
+
+time_t FileSystem::get_checkpoint_time() const {
+    return checkpoint_time;
+}
+
+std::vector<int> FileSystem::get_changed_blocks() const {
+    std::lock_guard<std::mutex> lock(changed_mutex);
+    std::vector<int> blocks;
+    for (int block = 0; block < static_cast<int>(changed_blocks.size()); ++block) {
+        if (changed_blocks[block])
+            blocks.push_back(block);
+    }
+    return blocks;
+}
+
+void FileSystem::sync() {
+    ExclusiveLock lock(this);
+    if (!device->is_open() || !journal) {
+        return;
+    }
+    write_inodes();
+    write_superblock();
+    device->flush();
+}
+
+bool FileSystem::quota_usage_saved() const {
+    return mounted_clean && sb.quota_block != 0 && sb.quota_usage_valid != 0;
+}
+
+Superblock FileSystem::get_superblock() const {
+    return sb;
+}
+
+bool FileSystem::was_cleanly_unmounted() const {
+    return mounted_clean;
+}
+
+bool FileSystem::journal_is_empty() {
+    return journal == nullptr || journal->is_empty();
+}
+
+void FileSystem::count_free_resources(int &free_blocks, int &free_inodes) {
+    free_blocks = 0;
+    free_inodes = 0;
+
+    // Walk the free list, guarding against cycles and out-of-range links
+    char buffer[BLOCK_SIZE];
+    int block = sb.free_block_list_head;
+    while (block > 0 && block < sb.num_blocks && free_blocks < sb.num_blocks) {
+        free_blocks++;
+        read_block(block, buffer);
+        memcpy(&block, buffer, sizeof(int));
+    }
+
+    for (const auto &inode : inodes) {
+        if (inode.mode == 0)
+            free_inodes++;
+    }
+}
+
+void FileSystem::recalculate_summary_counters() {
+    ExclusiveLock lock(this);
+    count_free_resources(sb.free_blocks, sb.free_inodes);
+    write_superblock();
+}
+
+std::string FileSystem::name_index_file() const {
+    return disk_name + ".nidx";
+}
+
+bool FileSystem::enable_name_index() {
+    ExclusiveLock lock(this);
+    bool is_external = (disk_name.find(".fs") == std::string::npos && disk_name.find("/") == 0);
+    if (is_external || !device->is_open()) {
+        return false;
+    }
+    if (name_index) {
+        return true;
+    }
+
+    name_index = new NameIndex();
+    view_state.reset(); // Views opened from now on get a copy
+    bool loaded = mounted_clean && sb.name_index_stamp != 0 &&
+                  name_index->load(name_index_file(), sb.name_index_stamp);
+    if (!loaded) {
+        build_name_index();
+    }
+    return true;
+}
+
+NameIndex *FileSystem::get_name_index() const {
+    return name_index;
+}
+
+void FileSystem::build_name_index() {
+    name_index->clear();
+    for (int i = 0; i < static_cast<int>(inodes.size()); ++i) {
+        if (inodes[i].mode != 2)
+            continue;
+        for (const auto &entry : get_dir_entries(i)) {
+            if (is_valid_inode(entry.inode_num)) {
+                name_index->add(i, entry.name, entry.inode_num, inodes[entry.inode_num].mode == 2);
+            }
+        }
+    }
+}
+
+InodeIndex *FileSystem::get_inode_index() const {
+    return inode_index;
+}
+
+void FileSystem::build_inode_index() {
+    if (!inode_index) {
+        inode_index = new InodeIndex();
+    }
+    inode_index->clear();
+    for (int i = 0; i < static_cast<int>(inodes.size()); ++i) {
+        inode_index->update(i, inodes[i]);
+    }
+}
+
+void FileSystem::build_parent_dirs() {
+    parent_dirs.assign(NUM_INODES, -1);
+    for (int i = 0; i < static_cast<int>(inodes.size()); ++i) {
+        if (inodes[i].mode != 2)
+            continue;
+        for (const auto &entry : get_dir_entries(i)) {
+            if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0)
+                continue;
+            if (entry.inode_num > 0 && entry.inode_num < NUM_INODES &&
+                parent_dirs[entry.inode_num] == -1) {
+                parent_dirs[entry.inode_num] = i;
+            }
+        }
+    }
+}
+
+int FileSystem::get_parent_dir(int inode_num) const {
+    if (inode_num < 0 || inode_num >= static_cast<int>(parent_dirs.size())) {
+        return -1;
+    }
+    return parent_dirs[inode_num];
+}
+
+void FileSystem::reindex_inode(int inode_num) {
+    std::lock_guard<std::recursive_mutex> lock(alloc_mutex);
+    if (inode_index && is_valid_inode(inode_num)) {
+        inode_index->update(inode_num, inodes[inode_num]);
+    }
+}
+
+bool FileSystem::read_inode_data(int inode_num, std::string &content) {
+    content.clear();
+    if (!is_valid_inode(inode_num) || inodes[inode_num].mode != 1) {
+        return false;
+    }
+
+    const Inode &inode = inodes[inode_num];
+    int blocks_needed = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    std::vector<int> block_nums;
+    for (int i = 0; i < 10 && static_cast<int>(block_nums.size()) < blocks_needed; ++i) {
+        if (inode.direct_blocks[i] == 0)
+            break;
+        block_nums.push_back(inode.direct_blocks[i]);
+    }
+    if (static_cast<int>(block_nums.size()) < blocks_needed && inode.indirect_block != 0) {
+        char indirect_buffer[BLOCK_SIZE];
+        read_block(inode.indirect_block, indirect_buffer);
+        int *block_pointers = (int *)indirect_buffer;
+        int pointers_per_block = BLOCK_SIZE / sizeof(int);
+        for (int i = 0; i < pointers_per_block &&
+                        static_cast<int>(block_nums.size()) < blocks_needed;
+             ++i) {
+            if (block_pointers[i] == 0)
+                break;
+            block_nums.push_back(block_pointers[i]);
+        }
+    }
+
+    content.resize(block_nums.size() * BLOCK_SIZE);
+    read_blocks(block_nums, &content[0]);
+    content.resize(std::min<size_t>(content.size(), inode.size));
+    return true;
+}
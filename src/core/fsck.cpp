@@ -1,18 +1,26 @@
 #include "core/fsck.h"
+#include <algorithm>
+#include <cstring>
 #include <iostream>
-#include <queue>
-#include <unordered_set>
 
 FileSystemCheck::FileSystemCheck(FileSystem *fs) : fs(fs) {
     block_used = new bool[NUM_BLOCKS]();
     inode_used = new bool[NUM_INODES]();
     inode_link_counts = new int[NUM_INODES]();
+    inode_modes = new int[NUM_INODES]();
+    dir_parent = new int[NUM_INODES]();
+    dir_set = new int[NUM_INODES]();
+    quick_sample_cursor = 0;
+    quick_check_escalated = false;
 }
 
 FileSystemCheck::~FileSystemCheck() {
     delete[] block_used;
     delete[] inode_used;
     delete[] inode_link_counts;
+    delete[] inode_modes;
+    delete[] dir_parent;
+    delete[] dir_set;
 }
 
 std::vector<FsckIssue> FileSystemCheck::check() {
@@ -55,6 +63,7 @@ void FileSystemCheck::check_superblock() {
         issue.type = FsckIssueType::INVALID_INODE;
         issue.inode_num = -1;
         issue.block_num = 0;
+        issue.block_index = -1;
         issue.description = "Superblock indicates an unreasonable number of inodes";
         issue.can_fix = false;
         issues.push_back(issue);
@@ -66,13 +75,140 @@ void FileSystemCheck::check_superblock() {
         issue.type = FsckIssueType::INVALID_BLOCK_POINTER;
         issue.inode_num = -1;
         issue.block_num = 0;
+        issue.block_index = -1;
         issue.description = "Superblock indicates an unreasonable number of blocks";
         issue.can_fix = false;
         issues.push_back(issue);
     }
+
+    // Check the summary counters against the free list and the inode table
+    Superblock sb = fs->get_superblock();
+    int free_blocks = 0;
+    int free_inodes = 0;
+    fs->count_free_resources(free_blocks, free_inodes);
+    if (sb.free_blocks != free_blocks || sb.free_inodes != free_inodes) {
+        FsckIssue issue;
+        issue.type = FsckIssueType::INCORRECT_SUMMARY_COUNTER;
+        issue.inode_num = -1;
+        issue.block_num = 0;
+        issue.block_index = -1;
+        issue.description = "Superblock summary counters are wrong: " +
+                            std::to_string(sb.free_blocks) + " free blocks, " +
+                            std::to_string(sb.free_inodes) + " free inodes (actual: " +
+                            std::to_string(free_blocks) + ", " + std::to_string(free_inodes) +
+                            ")";
+        issue.can_fix = true;
+        issues.push_back(issue);
+    }
+}
+
+std::vector<FsckIssue> FileSystemCheck::quick_check(double sample_fraction) {
+    quick_check_escalated = false;
+    issues.clear();
+
+    if (quick_check_summary() && quick_check_inodes(sample_fraction)) {
+        return issues;
+    }
+
+    quick_check_escalated = true;
+    return check();
+}
+
+bool FileSystemCheck::last_quick_check_escalated() const {
+    return quick_check_escalated;
+}
+
+bool FileSystemCheck::quick_check_summary() {
+    Superblock sb = fs->get_superblock();
+
+    if (!fs->was_cleanly_unmounted() || !fs->journal_is_empty()) {
+        return false;
+    }
+
+    // Counters must be in range for the layout
+    int data_start = 1 + sb.inode_blocks + NUM_JOURNAL_BLOCKS;
+    if (sb.free_blocks < 0 || sb.free_blocks > sb.num_blocks - data_start) {
+        return false;
+    }
+    if (sb.free_inodes < 0 || sb.free_inodes > sb.num_inodes) {
+        return false;
+    }
+
+    // An empty free list must agree with the counter, and a non-empty one must point
+    // into the data area
+    if (sb.free_block_list_head == -1) {
+        return sb.free_blocks == 0;
+    }
+    if (sb.free_block_list_head < data_start || sb.free_block_list_head >= sb.num_blocks ||
+        sb.free_blocks == 0) {
+        return false;
+    }
+
+    // The inode table is already in memory, so the free inode count is exact and cheap
+    int free_inodes = 0;
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (fs->get_inode(i).mode == 0) {
+            free_inodes++;
+        }
+    }
+    return free_inodes == sb.free_inodes;
+}
+
+bool FileSystemCheck::quick_check_inodes(double sample_fraction) {
+    if (sample_fraction <= 0.0) {
+        return true;
+    }
+
+    // Sample every n-th inode, starting where the previous quick check stopped so repeated
+    // runs cover the whole table
+    int stride = sample_fraction >= 1.0 ? 1 : static_cast<int>(1.0 / sample_fraction + 0.5);
+    int max_size = (10 + BLOCK_SIZE / sizeof(int)) * BLOCK_SIZE;
+    int start = quick_sample_cursor % stride;
+    quick_sample_cursor++;
+
+    for (int i = start; i < NUM_INODES; i += stride) {
+        Inode inode = fs->get_inode(i);
+        if (inode.mode == 0) {
+            continue;
+        }
+
+        if (inode.mode != 1 && inode.mode != 2 && inode.mode != 3) {
+            return false;
+        }
+        if (inode.link_count <= 0 || inode.size < 0 || inode.size > max_size) {
+            return false;
+        }
+        for (int j = 0; j < 10; j++) {
+            if (inode.direct_blocks[j] < 0 || inode.direct_blocks[j] >= NUM_BLOCKS) {
+                return false;
+            }
+        }
+        if (inode.indirect_block < 0 || inode.indirect_block >= NUM_BLOCKS) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 void FileSystemCheck::check_inodes() {
+    // Every indirect block is fetched up front in one list, so the reads are all in flight
+    // together instead of one per inode as the scan reaches it
+    std::vector<int> indirect_blocks;
+    std::vector<int> indirect_index(NUM_INODES, -1);
+    for (int i = 0; i < NUM_INODES; i++) {
+        Inode inode = fs->get_inode(i);
+        if (inode.mode >= 1 && inode.mode <= 3 && inode.indirect_block > 0 &&
+            inode.indirect_block < NUM_BLOCKS) {
+            indirect_index[i] = static_cast<int>(indirect_blocks.size());
+            indirect_blocks.push_back(inode.indirect_block);
+        }
+    }
+    std::vector<char> indirect_data(indirect_blocks.size() * BLOCK_SIZE);
+    if (!indirect_blocks.empty()) {
+        fs->read_blocks(indirect_blocks, indirect_data.data());
+    }
+
     for (int i = 0; i < NUM_INODES; i++) {
         Inode inode = fs->get_inode(i);
 
@@ -86,6 +222,7 @@ void FileSystemCheck::check_inodes() {
             issue.type = FsckIssueType::INVALID_INODE;
             issue.inode_num = i;
             issue.block_num = -1;
+            issue.block_index = -1;
             issue.description = "Inode has invalid mode: " + std::to_string(inode.mode);
             issue.can_fix = true;
             issues.push_back(issue);
@@ -100,6 +237,7 @@ void FileSystemCheck::check_inodes() {
                     issue.type = FsckIssueType::INVALID_BLOCK_POINTER;
                     issue.inode_num = i;
                     issue.block_num = inode.direct_blocks[j];
+                    issue.block_index = j;
                     issue.description = "Inode " + std::to_string(i) +
                                         " has invalid direct block pointer: " +
                                         std::to_string(inode.direct_blocks[j]);
@@ -111,6 +249,7 @@ void FileSystemCheck::check_inodes() {
                         issue.type = FsckIssueType::DUPLICATE_BLOCK;
                         issue.inode_num = i;
                         issue.block_num = inode.direct_blocks[j];
+                        issue.block_index = -1;
                         issue.description = "Block " + std::to_string(inode.direct_blocks[j]) +
                                             " is referenced by multiple inodes";
                         issue.can_fix = true;
@@ -128,6 +267,7 @@ void FileSystemCheck::check_inodes() {
                 issue.type = FsckIssueType::INVALID_BLOCK_POINTER;
                 issue.inode_num = i;
                 issue.block_num = inode.indirect_block;
+                issue.block_index = 10;
                 issue.description =
                     "Inode " + std::to_string(i) +
                     " has invalid indirect block pointer: " + std::to_string(inode.indirect_block);
@@ -139,6 +279,7 @@ void FileSystemCheck::check_inodes() {
                     issue.type = FsckIssueType::DUPLICATE_BLOCK;
                     issue.inode_num = i;
                     issue.block_num = inode.indirect_block;
+                    issue.block_index = -1;
                     issue.description = "Indirect block " + std::to_string(inode.indirect_block) +
                                         " is referenced by multiple inodes";
                     issue.can_fix = true;
@@ -148,7 +289,7 @@ void FileSystemCheck::check_inodes() {
 
                 // Read indirect block to check contained block pointers
                 char buffer[BLOCK_SIZE];
-                fs->read_block(inode.indirect_block, buffer);
+                memcpy(buffer, &indirect_data[indirect_index[i] * BLOCK_SIZE], BLOCK_SIZE);
                 int *block_pointers = (int *)buffer;
                 int pointers_per_block = BLOCK_SIZE / sizeof(int);
 
@@ -159,6 +300,9 @@ void FileSystemCheck::check_inodes() {
                             issue.type = FsckIssueType::INVALID_BLOCK_POINTER;
                             issue.inode_num = i;
                             issue.block_num = block_pointers[j];
+                            // Entries inside the indirect block are repaired by dropping the
+                            // indirect mapping as a whole
+                            issue.block_index = 10;
                             issue.description = "Inode " + std::to_string(i) +
                                                 " has invalid indirect block pointer: " +
                                                 std::to_string(block_pointers[j]);
@@ -170,6 +314,7 @@ void FileSystemCheck::check_inodes() {
                                 issue.type = FsckIssueType::DUPLICATE_BLOCK;
                                 issue.inode_num = i;
                                 issue.block_num = block_pointers[j];
+                                issue.block_index = -1;
                                 issue.description = "Block " + std::to_string(block_pointers[j]) +
                                                     " is referenced by multiple inodes";
                                 issue.can_fix = true;
@@ -184,94 +329,150 @@ void FileSystemCheck::check_inodes() {
     }
 }
 
+int FileSystemCheck::find_dir_set(int inode_num) {
+    // Union-find lookup with path halving
+    while (dir_set[inode_num] != inode_num) {
+        dir_set[inode_num] = dir_set[dir_set[inode_num]];
+        inode_num = dir_set[inode_num];
+    }
+    return inode_num;
+}
+
+void FileSystemCheck::scan_dir_entry(int dir_inode_num, const DirEntry &entry) {
+    // Unused slot
+    if (entry.inode_num == -1) {
+        return;
+    }
+
+    // Check if inode number is valid
+    if (entry.inode_num < 0 || entry.inode_num >= NUM_INODES) {
+        FsckIssue issue;
+        issue.type = FsckIssueType::INVALID_INODE;
+        issue.inode_num = entry.inode_num;
+        issue.block_num = -1;
+        issue.block_index = -1;
+        issue.description = "Directory entry '" + std::string(entry.name) +
+                            "' references invalid inode " + std::to_string(entry.inode_num);
+        issue.can_fix = true;
+        issues.push_back(issue);
+        return;
+    }
+
+    // Every entry, including . and .., is a link to its target
+    inode_link_counts[entry.inode_num]++;
+    inode_used[entry.inode_num] = true;
+
+    if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+        return;
+    }
+    if (inode_modes[entry.inode_num] != 2) {
+        return;
+    }
+
+    // A directory may only be named by one parent, and never the root
+    if (entry.inode_num == 0 || dir_parent[entry.inode_num] != -1) {
+        FsckIssue issue;
+        issue.type = FsckIssueType::DIRECTORY_LOOP;
+        issue.inode_num = entry.inode_num;
+        issue.block_num = -1;
+        issue.block_index = -1;
+        issue.description =
+            "Directory loop detected involving inode " + std::to_string(entry.inode_num);
+        issue.can_fix = true;
+        issues.push_back(issue);
+        return;
+    }
+    dir_parent[entry.inode_num] = dir_inode_num;
+
+    // Each directory has at most one parent link, so joining two directories that are
+    // already connected closes a cycle
+    int child_set = find_dir_set(entry.inode_num);
+    int parent_set = find_dir_set(dir_inode_num);
+    if (child_set == parent_set) {
+        FsckIssue issue;
+        issue.type = FsckIssueType::DIRECTORY_LOOP;
+        issue.inode_num = entry.inode_num;
+        issue.block_num = -1;
+        issue.block_index = -1;
+        issue.description =
+            "Directory loop detected involving inode " + std::to_string(entry.inode_num);
+        issue.can_fix = true;
+        issues.push_back(issue);
+        return;
+    }
+    dir_set[child_set] = parent_set;
+}
+
 void FileSystemCheck::check_directory_structure() {
     // Mark the root inode as used
     inode_used[0] = true;
 
-    // Queue for BFS traversal of directory structure
-    std::queue<int> dir_queue;
-    dir_queue.push(0); // Start from root
-
-    // Set to keep track of directories we've already visited
-    std::unordered_set<int> visited_dirs;
-    visited_dirs.insert(0);
+    for (int i = 0; i < NUM_INODES; i++) {
+        inode_modes[i] = fs->get_inode(i).mode;
+        dir_parent[i] = -1;
+        dir_set[i] = i;
+    }
 
-    // BFS traversal to find all directories and files
-    while (!dir_queue.empty()) {
-        int dir_inode_num = dir_queue.front();
-        dir_queue.pop();
+    if (inode_modes[0] != 2) {
+        // The root should be a directory
+        FsckIssue issue;
+        issue.type = FsckIssueType::INVALID_INODE;
+        issue.inode_num = 0;
+        issue.block_num = -1;
+        issue.block_index = -1;
+        issue.description = "Inode 0 is not a directory but is referenced as one";
+        issue.can_fix = false;
+        issues.push_back(issue);
+    }
 
-        Inode dir_inode = fs->get_inode(dir_inode_num);
-        if (dir_inode.mode != 2) {
-            // This should be a directory
-            FsckIssue issue;
-            issue.type = FsckIssueType::INVALID_INODE;
-            issue.inode_num = dir_inode_num;
-            issue.block_num = -1;
-            issue.description = "Inode " + std::to_string(dir_inode_num) +
-                                " is not a directory but is referenced as one";
-            issue.can_fix = false;
-            issues.push_back(issue);
+    // Single streaming pass over every directory block in inode order. Parent links go into
+    // dir_parent and connectivity into the dir_set forest; nothing is allocated per directory.
+    char buffer[BLOCK_SIZE];
+    int entries_per_block = BLOCK_SIZE / sizeof(DirEntry);
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (inode_modes[i] != 2) {
             continue;
         }
 
-        // Get directory entries
-        std::vector<DirEntry> entries = fs->get_dir_entries(dir_inode_num);
-
-        for (const auto &entry : entries) {
-            // Skip . and .. entries
-            if (std::string(entry.name) == "." || std::string(entry.name) == "..") {
+        Inode dir_inode = fs->get_inode(i);
+        for (int j = 0; j < 10 && dir_inode.direct_blocks[j] != 0; j++) {
+            if (dir_inode.direct_blocks[j] < 0 || dir_inode.direct_blocks[j] >= NUM_BLOCKS) {
+                // Already reported by check_inodes
                 continue;
             }
 
-            // Check if inode number is valid
-            if (entry.inode_num < 0 || entry.inode_num >= NUM_INODES) {
-                FsckIssue issue;
-                issue.type = FsckIssueType::INVALID_INODE;
-                issue.inode_num = entry.inode_num;
-                issue.block_num = -1;
-                issue.description = "Directory entry '" + std::string(entry.name) +
-                                    "' references invalid inode " + std::to_string(entry.inode_num);
-                issue.can_fix = true;
-                issues.push_back(issue);
-                continue;
-            }
-
-            // Increment link count for this inode
-            inode_link_counts[entry.inode_num]++;
-
-            // Mark this inode as used
-            inode_used[entry.inode_num] = true;
-
-            // If this is a directory, add to queue if not already visited
-            Inode entry_inode = fs->get_inode(entry.inode_num);
-            if (entry_inode.mode == 2) {
-                if (visited_dirs.find(entry.inode_num) != visited_dirs.end()) {
-                    // We've already visited this directory - potential loop
-                    FsckIssue issue;
-                    issue.type = FsckIssueType::DIRECTORY_LOOP;
-                    issue.inode_num = entry.inode_num;
-                    issue.block_num = -1;
-                    issue.description = "Directory loop detected involving inode " +
-                                        std::to_string(entry.inode_num);
-                    issue.can_fix = true;
-                    issues.push_back(issue);
-                } else {
-                    visited_dirs.insert(entry.inode_num);
-                    dir_queue.push(entry.inode_num);
-                }
+            fs->read_block(dir_inode.direct_blocks[j], buffer);
+            for (int k = 0; k < entries_per_block; k++) {
+                DirEntry entry;
+                memcpy(&entry, buffer + k * sizeof(DirEntry), sizeof(DirEntry));
+                entry.name[MAX_FILENAME_LENGTH - 1] = '\0';
+                scan_dir_entry(i, entry);
             }
         }
     }
 
-    // Check for orphaned inodes
+    // Check for orphaned inodes. A directory that cannot reach the root either heads a
+    // detached chain (no parent link, reported here) or sits on a loop reported during the
+    // scan; the directories below it come back with it. Files are orphaned when no
+    // directory names them at all.
     for (int i = 0; i < NUM_INODES; i++) {
-        Inode inode = fs->get_inode(i);
-        if (inode.mode != 0 && !inode_used[i]) {
+        if (inode_modes[i] == 0) {
+            continue;
+        }
+
+        bool orphaned;
+        if (inode_modes[i] == 2) {
+            orphaned = i != 0 && dir_parent[i] == -1;
+        } else {
+            orphaned = !inode_used[i];
+        }
+
+        if (orphaned) {
             FsckIssue issue;
             issue.type = FsckIssueType::ORPHANED_INODE;
             issue.inode_num = i;
             issue.block_num = -1;
+            issue.block_index = -1;
             issue.description =
                 "Inode " + std::to_string(i) + " is not referenced by any directory";
             issue.can_fix = true;
@@ -281,12 +482,17 @@ void FileSystemCheck::check_directory_structure() {
 
     // Check for incorrect link counts
     for (int i = 0; i < NUM_INODES; i++) {
+        if (inode_modes[i] == 0) {
+            continue;
+        }
+
         Inode inode = fs->get_inode(i);
-        if (inode.mode != 0 && inode.link_count != inode_link_counts[i]) {
+        if (inode.link_count != inode_link_counts[i]) {
             FsckIssue issue;
             issue.type = FsckIssueType::INCORRECT_LINK_COUNT;
             issue.inode_num = i;
             issue.block_num = -1;
+            issue.block_index = -1;
             issue.description = "Inode " + std::to_string(i) +
                                 " has incorrect link count: " + std::to_string(inode.link_count) +
                                 " (actual: " + std::to_string(inode_link_counts[i]) + ")";
@@ -308,11 +514,13 @@ void FileSystemCheck::check_blocks() {
 }
 
 void FileSystemCheck::fix_all_issues() {
+    std::vector<int> fixable;
     for (size_t i = 0; i < issues.size(); i++) {
         if (issues[i].can_fix) {
-            fix_issue(i);
+            fixable.push_back(i);
         }
     }
+    fix_issues(fixable);
 }
 
 void FileSystemCheck::fix_issue(int issue_index) {
@@ -320,44 +528,136 @@ void FileSystemCheck::fix_issue(int issue_index) {
         return;
     }
 
-    FsckIssue &issue = issues[issue_index];
+    if (!issues[issue_index].can_fix) {
+        std::cerr << "Cannot fix issue: " << issues[issue_index].description << std::endl;
+        return;
+    }
+
+    fix_issues({issue_index});
+}
 
-    if (!issue.can_fix) {
-        std::cerr << "Cannot fix issue: " << issue.description << std::endl;
+void FileSystemCheck::fix_issues(const std::vector<int> &issue_indices) {
+    if (issue_indices.empty()) {
         return;
     }
 
-    switch (issue.type) {
-        case FsckIssueType::INVALID_INODE:
-            fix_invalid_inode(issue.inode_num);
-            break;
-        case FsckIssueType::ORPHANED_INODE:
-            fix_orphaned_inode(issue.inode_num);
-            break;
-        case FsckIssueType::DUPLICATE_BLOCK:
-            fix_duplicate_block(issue.block_num);
-            break;
-        case FsckIssueType::UNREFERENCED_BLOCK:
-            fix_unreferenced_block(issue.block_num);
-            break;
-        case FsckIssueType::DIRECTORY_LOOP:
-            fix_directory_loop(issue.inode_num);
-            break;
-        case FsckIssueType::INCORRECT_LINK_COUNT:
-            fix_incorrect_link_count(issue.inode_num);
-            break;
-        case FsckIssueType::INVALID_BLOCK_POINTER:
-            // Need to determine which block index is invalid
-            // For simplicity, we'll just set all blocks to 0
-            for (int i = 0; i < 10; i++) {
-                fix_invalid_block_pointer(issue.inode_num, i);
+    // Collect every inode repair first, then apply them all in memory and commit the
+    // dirty inode-table blocks in one journal transaction
+    std::vector<FsckRepair> plan = plan_repairs(issue_indices);
+    apply_repairs(plan);
+
+    // Mark issues as fixed
+    for (int index : issue_indices) {
+        issues[index].can_fix = false;
+        issues[index].description += " (FIXED)";
+    }
+}
+
+std::vector<FsckRepair> FileSystemCheck::plan_repairs(const std::vector<int> &issue_indices) {
+    std::vector<FsckRepair> plan;
+
+    // Per-inode bookkeeping so the same slot or link count is never repaired twice
+    std::vector<int> cleared_slots(NUM_INODES, 0);
+    std::vector<bool> attached(NUM_INODES, false);
+    std::vector<int> link_count_repair(NUM_INODES, -1);
+
+    for (int index : issue_indices) {
+        const FsckIssue &issue = issues[index];
+        bool valid_inode = issue.inode_num >= 0 && issue.inode_num < NUM_INODES;
+
+        switch (issue.type) {
+            case FsckIssueType::INVALID_INODE:
+                fix_invalid_inode(issue.inode_num);
+                break;
+            case FsckIssueType::ORPHANED_INODE:
+                if (valid_inode && !attached[issue.inode_num]) {
+                    attached[issue.inode_num] = true;
+                    plan.push_back({FsckRepairType::ATTACH_TO_LOST_FOUND, issue.inode_num, 0});
+                }
+                break;
+            case FsckIssueType::DUPLICATE_BLOCK:
+                fix_duplicate_block(issue.block_num);
+                break;
+            case FsckIssueType::UNREFERENCED_BLOCK:
+                fix_unreferenced_block(issue.block_num);
+                break;
+            case FsckIssueType::DIRECTORY_LOOP:
+                fix_directory_loop(issue.inode_num);
+                break;
+            case FsckIssueType::INCORRECT_SUMMARY_COUNTER:
+                fs->recalculate_summary_counters();
+                std::cout << "Recalculated superblock summary counters" << std::endl;
+                break;
+            case FsckIssueType::INCORRECT_LINK_COUNT:
+                if (valid_inode && link_count_repair[issue.inode_num] == -1) {
+                    link_count_repair[issue.inode_num] = plan.size();
+                    plan.push_back({FsckRepairType::SET_LINK_COUNT, issue.inode_num,
+                                    inode_link_counts[issue.inode_num]});
+                }
+                break;
+            case FsckIssueType::INVALID_BLOCK_POINTER:
+                if (valid_inode && issue.block_index >= 0 && issue.block_index <= 10 &&
+                    !(cleared_slots[issue.inode_num] & (1 << issue.block_index))) {
+                    cleared_slots[issue.inode_num] |= 1 << issue.block_index;
+                    plan.push_back(
+                        {FsckRepairType::CLEAR_BLOCK_POINTER, issue.inode_num, issue.block_index});
+                }
+                break;
+        }
+    }
+
+    // Attaching an orphan to lost+found adds a link, so a link count repair for the same
+    // inode must account for it instead of undoing it
+    for (int i = 0; i < NUM_INODES; i++) {
+        if (attached[i] && link_count_repair[i] != -1) {
+            plan[link_count_repair[i]].value++;
+        }
+    }
+
+    // Link counts are applied last so they see every attach
+    std::stable_partition(plan.begin(), plan.end(), [](const FsckRepair &repair) {
+        return repair.type != FsckRepairType::SET_LINK_COUNT;
+    });
+
+    return plan;
+}
+
+void FileSystemCheck::apply_repairs(const std::vector<FsckRepair> &plan) {
+    if (plan.empty()) {
+        return;
+    }
+
+    // lost+found is created up front, in its own transaction, so the batch below only
+    // has to record inode updates
+    int lost_found_inode = -1;
+    for (const auto &repair : plan) {
+        if (repair.type == FsckRepairType::ATTACH_TO_LOST_FOUND) {
+            lost_found_inode = fs->create_lost_found();
+            if (lost_found_inode == -1) {
+                std::cerr << "Failed to create lost+found directory" << std::endl;
             }
             break;
+        }
     }
 
-    // Mark issue as fixed
-    issue.can_fix = false;
-    issue.description += " (FIXED)";
+    fs->begin_inode_batch();
+    for (const auto &repair : plan) {
+        switch (repair.type) {
+            case FsckRepairType::CLEAR_BLOCK_POINTER:
+                fix_invalid_block_pointer(repair.inode_num, repair.value);
+                break;
+            case FsckRepairType::ATTACH_TO_LOST_FOUND:
+                if (lost_found_inode != -1) {
+                    fix_orphaned_inode(repair.inode_num, lost_found_inode);
+                }
+                break;
+            case FsckRepairType::SET_LINK_COUNT:
+                inode_link_counts[repair.inode_num] = repair.value;
+                fix_incorrect_link_count(repair.inode_num);
+                break;
+        }
+    }
+    fs->commit_inode_batch();
 }
 
 // Implementation of fix methods
@@ -371,19 +671,10 @@ void FileSystemCheck::fix_invalid_inode(int inode_num) {
     std::cout << "Fixed invalid inode " << inode_num << " by marking it as free" << std::endl;
 }
 
-void FileSystemCheck::fix_orphaned_inode(int inode_num) {
-    // For orphaned inodes, we'll move them to a "lost+found" directory
-
-    // Create lost+found if it doesn't exist
-    int lost_found_inode = fs->create_lost_found();
-
-    if (lost_found_inode != -1) {
-        // Move the orphaned inode to lost+found
-        fs->fix_orphaned_inode(inode_num, lost_found_inode);
-        std::cout << "Moved orphaned inode " << inode_num << " to lost+found" << std::endl;
-    } else {
-        std::cerr << "Failed to create lost+found directory" << std::endl;
-    }
+void FileSystemCheck::fix_orphaned_inode(int inode_num, int lost_found_inode) {
+    // Move the orphaned inode to lost+found
+    fs->fix_orphaned_inode(inode_num, lost_found_inode);
+    std::cout << "Moved orphaned inode " << inode_num << " to lost+found" << std::endl;
 }
 
 void FileSystemCheck::fix_duplicate_block(int block_num) {
@@ -0,0 +1,90 @@
+#include "core/inode_index.h"
+#include <algorithm>
+#include <climits>
+
+void AttributeIndex::clear() {
+    sorted.clear();
+}
+
+void AttributeIndex::insert(long long key, int inode_num) {
+    std::pair<long long, int> item(key, inode_num);
+    sorted.insert(std::lower_bound(sorted.begin(), sorted.end(), item), item);
+}
+
+void AttributeIndex::erase(long long key, int inode_num) {
+    std::pair<long long, int> item(key, inode_num);
+    auto pos = std::lower_bound(sorted.begin(), sorted.end(), item);
+    if (pos != sorted.end() && *pos == item) {
+        sorted.erase(pos);
+    }
+}
+
+size_t AttributeIndex::size() const {
+    return sorted.size();
+}
+
+size_t AttributeIndex::count_range(long long lower, long long upper) const {
+    if (lower >= upper) {
+        return 0;
+    }
+    // Pairing the bounds with the extreme inode numbers makes both ends exclusive
+    auto first = std::upper_bound(sorted.begin(), sorted.end(), std::make_pair(lower, INT_MAX));
+    auto last = std::lower_bound(first, sorted.end(), std::make_pair(upper, INT_MIN));
+    return last - first;
+}
+
+void AttributeIndex::scan_range(long long lower, long long upper, std::vector<int> &out) const {
+    out.clear();
+    if (lower >= upper) {
+        return;
+    }
+    auto first = std::upper_bound(sorted.begin(), sorted.end(), std::make_pair(lower, INT_MAX));
+    auto last = std::lower_bound(first, sorted.end(), std::make_pair(upper, INT_MIN));
+    for (auto it = first; it != last; ++it) {
+        out.push_back(it->second);
+    }
+}
+
+InodeIndex::InodeIndex()
+    : size_keys(NUM_INODES, 0), mtime_keys(NUM_INODES, 0), indexed(NUM_INODES, false) {
+}
+
+void InodeIndex::clear() {
+    size_index.clear();
+    mtime_index.clear();
+    indexed.assign(NUM_INODES, false);
+}
+
+void InodeIndex::update(int inode_num, const Inode &inode) {
+    if (inode_num < 0 || inode_num >= NUM_INODES) {
+        return;
+    }
+
+    long long size = inode.size;
+    long long mtime = static_cast<long long>(inode.modification_time);
+    if (indexed[inode_num]) {
+        if (inode.mode != 0 && size_keys[inode_num] == size && mtime_keys[inode_num] == mtime) {
+            return;
+        }
+        size_index.erase(size_keys[inode_num], inode_num);
+        mtime_index.erase(mtime_keys[inode_num], inode_num);
+        indexed[inode_num] = false;
+    }
+
+    if (inode.mode == 0) {
+        return;
+    }
+    size_index.insert(size, inode_num);
+    mtime_index.insert(mtime, inode_num);
+    size_keys[inode_num] = size;
+    mtime_keys[inode_num] = mtime;
+    indexed[inode_num] = true;
+}
+
+const AttributeIndex &InodeIndex::by_size() const {
+    return size_index;
+}
+
+const AttributeIndex &InodeIndex::by_mtime() const {
+    return mtime_index;
+}
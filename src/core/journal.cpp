@@ -1,5 +1,6 @@
 #include "core/journal.h"
 #include "core/filesystem.h"
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
@@ -9,11 +10,12 @@ Journal::Journal(FileSystem *fs, int start_block, int num_blocks)
 }
 
 void Journal::write_journal_block(int block_offset, const char *data, int size) {
-    // This is a simplified write, assuming data fits within a single block
-    // A real implementation would handle spanning across blocks
-    char buffer[BLOCK_SIZE] = {0};
-    memcpy(buffer, data, size);
-    fs->write_block(start_block + block_offset, buffer);
+    // Records are staged in memory and go to the journal area at commit
+    size_t offset = static_cast<size_t>(block_offset) * BLOCK_SIZE;
+    if (log.size() < offset + BLOCK_SIZE) {
+        log.resize(offset + BLOCK_SIZE, 0);
+    }
+    memcpy(&log[offset], data, size);
 }
 
 void Journal::read_journal_block(int block_offset, char *data, int size) {
@@ -45,6 +47,8 @@ void Journal::log_metadata_block(int block_num, const char *data) {
     header.size = BLOCK_SIZE; // Assuming full block writes for simplicity
 
     write_journal_block(current_block++, (char *)&header, sizeof(JournalRecordHeader));
+    home_blocks.push_back(block_num);
+    home_offsets.push_back(static_cast<size_t>(current_block) * BLOCK_SIZE);
     write_journal_block(current_block++, data, BLOCK_SIZE);
 }
 
@@ -57,6 +61,8 @@ void Journal::log_data_block(int block_num, const char *data) {
     header.size = BLOCK_SIZE;
 
     write_journal_block(current_block++, (char *)&header, sizeof(JournalRecordHeader));
+    home_blocks.push_back(block_num);
+    home_offsets.push_back(static_cast<size_t>(current_block) * BLOCK_SIZE);
     write_journal_block(current_block++, data, BLOCK_SIZE);
 }
 
@@ -70,16 +76,45 @@ void Journal::commit_transaction() {
 
     write_journal_block(current_block++, (char *)&commit_header, sizeof(JournalRecordHeader));
 
-    // This is where the checkpointing happens.
-    // The journaled blocks are written to their final locations.
-    recover();
+    // The records go down as one run before any home block is touched, so a crash part way
+    // through leaves either nothing or a complete transaction for recover() to replay
+    std::vector<int> journal_blocks(current_block);
+    for (int i = 0; i < current_block; ++i) {
+        journal_blocks[i] = start_block + i;
+    }
+    fs->write_blocks(journal_blocks, log.data());
+
+    // This is where the checkpointing happens. The journaled blocks are written to their
+    // final locations straight from memory, all of them in flight together.
+    std::vector<const char *> buffers;
+    for (size_t offset : home_offsets) {
+        buffers.push_back(&log[offset]);
+    }
+    fs->write_scattered(home_blocks, buffers);
+
+    // Only the records just written need clearing; the rest of the area is already zero
+    std::fill(log.begin(), log.end(), 0);
+    fs->write_blocks(journal_blocks, log.data());
+
+    // Anything beyond the start and commit records means the metadata changed
+    if (current_block > 2) {
+        fs->bump_generation();
+    }
 
     // Reset journal for next transaction
+    log.clear();
+    home_blocks.clear();
+    home_offsets.clear();
     current_block = 0;
     next_transaction_id++;
     active_transaction = false;
 }
 
+int Journal::max_blocks_per_transaction() const {
+    // Start and commit records take one block each, every logged block takes two
+    return (num_blocks - 2) / 2;
+}
+
 void Journal::recover() {
     char header_buffer[sizeof(JournalRecordHeader)];
     JournalRecordHeader header;
@@ -100,10 +135,15 @@ void Journal::recover() {
         memcpy(&header, header_buffer, sizeof(JournalRecordHeader));
 
         if (header.type == TRANSACTION_COMMIT) {
-            // Found commit record, apply changes
+            // Found commit record, apply changes. Neighbouring home blocks (the inode table)
+            // go out together; a block logged twice is written in log order.
+            std::vector<int> block_nums;
+            std::vector<const char *> buffers;
             for (const auto &write : pending_writes) {
-                fs->write_block(write.first, write.second.c_str());
+                block_nums.push_back(write.first);
+                buffers.push_back(write.second.data());
             }
+            fs->write_scattered(block_nums, buffers);
             break; // Recovery successful for this transaction
         }
 
@@ -116,9 +156,18 @@ void Journal::recover() {
             break;
         }
     }
-    // After recovery (or if no commit was found), clear the journal
-    char empty_block[BLOCK_SIZE] = {0};
+    // After recovery (or if no commit was found), clear the journal in one vectored write
+    std::vector<char> empty(static_cast<size_t>(num_blocks) * BLOCK_SIZE, 0);
+    std::vector<int> journal_blocks(num_blocks);
     for (int i = 0; i < num_blocks; ++i) {
-        write_journal_block(i, empty_block, BLOCK_SIZE);
+        journal_blocks[i] = start_block + i;
     }
+    fs->write_blocks(journal_blocks, empty.data());
+}
+
+bool Journal::is_empty() {
+    // A cleared journal reads back as zeros; real transactions start with an id of 1 or more
+    JournalRecordHeader header;
+    read_journal_block(0, (char *)&header, sizeof(JournalRecordHeader));
+    return !(header.type == TRANSACTION_START && header.block_num > 0);
 }
@@ -0,0 +1,270 @@
+#include "core/name_index.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+namespace {
+
+const int NAME_INDEX_MAGIC = 0x4E494458; // "NIDX"
+
+uint32_t pack_trigram(const char *p) {
+    return (static_cast<uint32_t>(std::tolower(static_cast<unsigned char>(p[0]))) << 16) |
+           (static_cast<uint32_t>(std::tolower(static_cast<unsigned char>(p[1]))) << 8) |
+           static_cast<uint32_t>(std::tolower(static_cast<unsigned char>(p[2])));
+}
+
+} // namespace
+
+NameIndex::NameIndex() : dir_entry(NUM_INODES, -1) {
+}
+
+void NameIndex::clear() {
+    entries.clear();
+    free_slots.clear();
+    postings.clear();
+    dir_entry.assign(NUM_INODES, -1);
+    slot_by_key.clear();
+}
+
+std::string NameIndex::entry_key(int dir_inode, const char *name) {
+    return std::to_string(dir_inode) + "/" + std::string(name, strnlen(name, MAX_FILENAME_LENGTH));
+}
+
+void NameIndex::name_trigrams(const char *name, std::vector<uint32_t> &out) {
+    out.clear();
+    size_t length = strnlen(name, MAX_FILENAME_LENGTH);
+    for (size_t i = 0; i + 3 <= length; i++) {
+        out.push_back(pack_trigram(name + i));
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+}
+
+void NameIndex::add_postings(int slot) {
+    std::vector<uint32_t> trigrams;
+    name_trigrams(entries[slot].name, trigrams);
+    for (uint32_t trigram : trigrams) {
+        std::vector<int> &list = postings[trigram];
+        list.insert(std::lower_bound(list.begin(), list.end(), slot), slot);
+    }
+}
+
+void NameIndex::remove_postings(int slot) {
+    std::vector<uint32_t> trigrams;
+    name_trigrams(entries[slot].name, trigrams);
+    for (uint32_t trigram : trigrams) {
+        auto it = postings.find(trigram);
+        if (it == postings.end())
+            continue;
+        std::vector<int> &list = it->second;
+        auto pos = std::lower_bound(list.begin(), list.end(), slot);
+        if (pos != list.end() && *pos == slot) {
+            list.erase(pos);
+        }
+        if (list.empty()) {
+            postings.erase(it);
+        }
+    }
+}
+
+void NameIndex::add(int dir_inode, const char *name, int inode_num, bool is_dir) {
+    // . and .. never match a search and would only bloat the posting lists
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return;
+    }
+    // A name added again replaces its old entry
+    remove(dir_inode, name);
+
+    int slot;
+    if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        slot = entries.size();
+        entries.emplace_back();
+    }
+
+    NameIndexEntry &entry = entries[slot];
+    entry.dir_inode = dir_inode;
+    entry.inode_num = inode_num;
+    entry.is_dir = is_dir ? 1 : 0;
+    strncpy(entry.name, name, MAX_FILENAME_LENGTH);
+    entry.name[MAX_FILENAME_LENGTH - 1] = '\0';
+
+    add_postings(slot);
+    if (is_dir && inode_num >= 0 && inode_num < NUM_INODES) {
+        dir_entry[inode_num] = slot;
+    }
+    slot_by_key[entry_key(dir_inode, entry.name)] = slot;
+}
+
+void NameIndex::remove(int dir_inode, const char *name) {
+    auto it = slot_by_key.find(entry_key(dir_inode, name));
+    if (it == slot_by_key.end()) {
+        return;
+    }
+    int slot = it->second;
+    slot_by_key.erase(it);
+
+    NameIndexEntry &entry = entries[slot];
+    remove_postings(slot);
+    if (entry.is_dir && entry.inode_num >= 0 && entry.inode_num < NUM_INODES &&
+        dir_entry[entry.inode_num] == slot) {
+        dir_entry[entry.inode_num] = -1;
+    }
+    entry.inode_num = -1;
+    free_slots.push_back(slot);
+}
+
+bool NameIndex::candidates(const std::string &literal, std::vector<int> &out) const {
+    out.clear();
+    if (literal.size() < 3) {
+        return false;
+    }
+
+    std::vector<uint32_t> trigrams;
+    for (size_t i = 0; i + 3 <= literal.size(); i++) {
+        trigrams.push_back(pack_trigram(literal.c_str() + i));
+    }
+    std::sort(trigrams.begin(), trigrams.end());
+    trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+
+    // Intersect starting from the shortest posting list
+    std::vector<const std::vector<int> *> lists;
+    for (uint32_t trigram : trigrams) {
+        auto it = postings.find(trigram);
+        if (it == postings.end()) {
+            return true; // Some trigram never occurs, so nothing matches
+        }
+        lists.push_back(&it->second);
+    }
+    std::sort(lists.begin(), lists.end(),
+              [](const std::vector<int> *a, const std::vector<int> *b) {
+                  return a->size() < b->size();
+              });
+
+    out = *lists[0];
+    std::vector<int> next;
+    for (size_t i = 1; i < lists.size() && !out.empty(); i++) {
+        next.clear();
+        std::set_intersection(out.begin(), out.end(), lists[i]->begin(), lists[i]->end(),
+                              std::back_inserter(next));
+        out.swap(next);
+    }
+    return true;
+}
+
+const NameIndexEntry &NameIndex::get_entry(int slot) const {
+    return entries[slot];
+}
+
+int NameIndex::slot_count() const {
+    return entries.size();
+}
+
+std::string NameIndex::path_of(int slot) const {
+    std::string path = entries[slot].name;
+    int dir = entries[slot].dir_inode;
+
+    // Walk up through the slots naming each parent; the depth bound stops corrupt loops
+    for (int depth = 0; dir != 0; depth++) {
+        if (dir < 0 || dir >= NUM_INODES || dir_entry[dir] == -1 || depth >= NUM_INODES) {
+            return "";
+        }
+        const NameIndexEntry &parent = entries[dir_entry[dir]];
+        path = std::string(parent.name) + "/" + path;
+        dir = parent.dir_inode;
+    }
+    return path;
+}
+
+bool NameIndex::save(const std::string &file_name, int stamp) const {
+    std::ofstream out(file_name, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+
+    int header[3] = {NAME_INDEX_MAGIC, stamp, static_cast<int>(entries.size())};
+    out.write((const char *)header, sizeof(header));
+    out.write((const char *)entries.data(), entries.size() * sizeof(NameIndexEntry));
+
+    // Posting lists are written in trigram order so the file is stable between saves
+    std::vector<uint32_t> keys;
+    for (const auto &pair : postings) {
+        keys.push_back(pair.first);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    int num_keys = keys.size();
+    out.write((const char *)&num_keys, sizeof(int));
+    for (uint32_t key : keys) {
+        const std::vector<int> &list = postings.at(key);
+        int count = list.size();
+        out.write((const char *)&key, sizeof(uint32_t));
+        out.write((const char *)&count, sizeof(int));
+        out.write((const char *)list.data(), count * sizeof(int));
+    }
+    return out.good();
+}
+
+bool NameIndex::load(const std::string &file_name, int stamp) {
+    std::ifstream in(file_name, std::ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+
+    int header[3];
+    in.read((char *)header, sizeof(header));
+    if (!in || header[0] != NAME_INDEX_MAGIC || header[1] != stamp || header[2] < 0) {
+        return false;
+    }
+
+    clear();
+    entries.resize(header[2]);
+    in.read((char *)entries.data(), entries.size() * sizeof(NameIndexEntry));
+
+    // Anything out of range means the file doesn't match this image, however it is stamped
+    int num_keys = 0;
+    in.read((char *)&num_keys, sizeof(int));
+    bool valid = static_cast<bool>(in) && num_keys >= 0;
+    for (int i = 0; valid && i < num_keys; i++) {
+        uint32_t key;
+        int count;
+        in.read((char *)&key, sizeof(uint32_t));
+        in.read((char *)&count, sizeof(int));
+        if (!in || count < 0 || count > static_cast<int>(entries.size())) {
+            valid = false;
+            break;
+        }
+        std::vector<int> &list = postings[key];
+        list.resize(count);
+        in.read((char *)list.data(), count * sizeof(int));
+        for (int slot : list) {
+            valid = valid && slot >= 0 && slot < static_cast<int>(entries.size());
+        }
+    }
+    valid = valid && static_cast<bool>(in);
+    for (size_t slot = 0; valid && slot < entries.size(); slot++) {
+        NameIndexEntry &entry = entries[slot];
+        entry.name[MAX_FILENAME_LENGTH - 1] = '\0';
+        if (entry.inode_num == -1) {
+            free_slots.push_back(slot);
+            continue;
+        }
+        if (entry.dir_inode < 0 || entry.dir_inode >= NUM_INODES) {
+            valid = false;
+            break;
+        }
+        if (entry.is_dir && entry.inode_num >= 0 && entry.inode_num < NUM_INODES) {
+            dir_entry[entry.inode_num] = slot;
+        }
+        slot_by_key[entry_key(entry.dir_inode, entry.name)] = slot;
+    }
+    if (!valid) {
+        clear();
+        return false;
+    }
+    return true;
+}
@@ -1,69 +1,284 @@
 #include "core/quota.h"
 #include <algorithm>
+#include <cstring>
 #include <ctime>
+#include <iostream>
 #include <queue>
+#include <vector>
+
+namespace {
+
+const int QUOTA_FILE_MAGIC = 0x51555441; // "QUTA"
+const int QUOTA_USER = 0;
+const int QUOTA_GROUP = 1;
+const int QUOTA_PROJECT = 2;
+
+struct QuotaFileHeader {
+    int magic;
+    int record_count;
+    long long grace_period;
+};
+
+// One user, group or project, 40 bytes. Records are sorted by kind and then id.
+struct QuotaRecord {
+    int kind;
+    int id;
+    int blocks_used;
+    int blocks_soft_limit;
+    int blocks_hard_limit;
+    int inodes_used;
+    int inodes_soft_limit;
+    int inodes_hard_limit;
+    long long grace_period_start;
+};
+
+void append_records(std::vector<QuotaRecord> &records, int kind,
+                    const std::unordered_map<int, QuotaEntry> &quotas) {
+    for (const auto &pair : quotas) {
+        const QuotaEntry &quota = pair.second;
+        // Entries with no usage and no limits carry nothing worth keeping
+        if (quota.blocks_used == 0 && quota.inodes_used == 0 && quota.blocks_soft_limit == 0 &&
+            quota.blocks_hard_limit == 0 && quota.inodes_soft_limit == 0 &&
+            quota.inodes_hard_limit == 0) {
+            continue;
+        }
+        QuotaRecord record;
+        record.kind = kind;
+        record.id = pair.first;
+        record.blocks_used = quota.blocks_used;
+        record.blocks_soft_limit = quota.blocks_soft_limit;
+        record.blocks_hard_limit = quota.blocks_hard_limit;
+        record.inodes_used = quota.inodes_used;
+        record.inodes_soft_limit = quota.inodes_soft_limit;
+        record.inodes_hard_limit = quota.inodes_hard_limit;
+        record.grace_period_start = quota.grace_period_start;
+        records.push_back(record);
+    }
+}
+
+} // namespace
 
 QuotaManager::QuotaManager(FileSystem *fs)
-    : fs(fs), grace_period(7 * 24 * 60 * 60) { // 7 days default
-    // Initialize usage
-    update_usage();
+    : fs(fs), project_roots(NUM_INODES, false), grace_period(7 * 24 * 60 * 60), // 7 days default
+      limits(nullptr) {
+    // Usage comes from the quota file when the image was unmounted cleanly, and from one
+    // scan otherwise; from here on the filesystem reports every change
+    if (!load()) {
+        update_usage();
+    }
+    fs->set_quota_manager(this);
+}
+
+QuotaManager::~QuotaManager() {
+    if (fs->get_quota_manager() == this) {
+        save();
+        fs->set_quota_manager(nullptr);
+    }
+    delete limits.load();
+    for (QuotaTable *table : retired_tables) {
+        delete table;
+    }
 }
 
 void QuotaManager::set_grace_period(time_t seconds) {
-    grace_period = seconds;
+    {
+        std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+        grace_period = seconds;
+        publish_limits();
+    }
+    save();
 }
 
-void QuotaManager::set_user_quota(int uid, int blocks_soft, int blocks_hard, int inodes_soft,
-                                  int inodes_hard) {
-    QuotaEntry &quota = user_quotas[uid];
+bool QuotaManager::load() {
+    std::string data;
+    if (!fs->read_quota_file(data) || data.size() < sizeof(QuotaFileHeader)) {
+        return false;
+    }
 
-    // Preserve current usage values
-    int blocks_used = quota.blocks_used;
-    int inodes_used = quota.inodes_used;
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    QuotaFileHeader header;
+    memcpy(&header, data.data(), sizeof(QuotaFileHeader));
+    size_t expected = sizeof(QuotaFileHeader) + header.record_count * sizeof(QuotaRecord);
+    if (header.magic != QUOTA_FILE_MAGIC || header.record_count < 0 || data.size() != expected) {
+        std::cerr << "Warning: Ignoring a damaged quota file." << std::endl;
+        return false;
+    }
 
-    // Update limits
-    quota.blocks_soft_limit = blocks_soft;
-    quota.blocks_hard_limit = blocks_hard;
-    quota.inodes_soft_limit = inodes_soft;
-    quota.inodes_hard_limit = inodes_hard;
+    user_quotas.clear();
+    group_quotas.clear();
+    project_quotas.clear();
+    project_roots.assign(NUM_INODES, false);
+    grace_period = static_cast<time_t>(header.grace_period);
+    const char *cursor = data.data() + sizeof(QuotaFileHeader);
+    for (int i = 0; i < header.record_count; i++, cursor += sizeof(QuotaRecord)) {
+        QuotaRecord record;
+        memcpy(&record, cursor, sizeof(QuotaRecord));
+        if (record.kind == QUOTA_PROJECT) {
+            if (record.id < 0 || record.id >= NUM_INODES) {
+                continue;
+            }
+            project_roots[record.id] = true;
+        }
+        QuotaEntry &quota = record.kind == QUOTA_USER    ? user_quotas[record.id]
+                            : record.kind == QUOTA_GROUP ? group_quotas[record.id]
+                                                         : project_quotas[record.id];
+        quota.blocks_used = record.blocks_used;
+        quota.blocks_soft_limit = record.blocks_soft_limit;
+        quota.blocks_hard_limit = record.blocks_hard_limit;
+        quota.inodes_used = record.inodes_used;
+        quota.inodes_soft_limit = record.inodes_soft_limit;
+        quota.inodes_hard_limit = record.inodes_hard_limit;
+        quota.grace_period_start = static_cast<time_t>(record.grace_period_start);
+    }
+    publish_limits();
+    return fs->quota_usage_saved();
+}
 
-    // Restore usage values
-    quota.blocks_used = blocks_used;
-    quota.inodes_used = inodes_used;
+bool QuotaManager::save() {
+    // A manager detached by format() would write the old image's figures into the new one
+    if (fs->get_quota_manager() != this) {
+        return false;
+    }
+    // The records are copied under the mutex and written after it is released
+    std::unique_lock<std::recursive_mutex> lock(quota_mutex);
+    std::vector<QuotaRecord> records;
+    append_records(records, QUOTA_USER, user_quotas);
+    append_records(records, QUOTA_GROUP, group_quotas);
+    append_records(records, QUOTA_PROJECT, project_quotas);
+    time_t saved_grace_period = grace_period;
+    lock.unlock();
+    std::sort(records.begin(), records.end(), [](const QuotaRecord &a, const QuotaRecord &b) {
+        return a.kind != b.kind ? a.kind < b.kind : a.id < b.id;
+    });
+
+    QuotaFileHeader header;
+    header.magic = QUOTA_FILE_MAGIC;
+    header.record_count = records.size();
+    header.grace_period = saved_grace_period;
+
+    std::string data((const char *)&header, sizeof(QuotaFileHeader));
+    data.append((const char *)records.data(), records.size() * sizeof(QuotaRecord));
+    return fs->write_quota_file(data);
+}
 
-    // If previously under quota but now over soft limit, start grace period
-    if ((blocks_used > blocks_soft && blocks_soft > 0) ||
-        (inodes_used > inodes_soft && inodes_soft > 0)) {
-        quota.grace_period_start = time(nullptr);
+void QuotaManager::set_user_quota(int uid, int blocks_soft, int blocks_hard, int inodes_soft,
+                                  int inodes_hard) {
+    {
+        std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+        QuotaEntry &quota = user_quotas[uid];
+
+        // Preserve current usage values
+        int blocks_used = quota.blocks_used;
+        int inodes_used = quota.inodes_used;
+
+        // Update limits
+        quota.blocks_soft_limit = blocks_soft;
+        quota.blocks_hard_limit = blocks_hard;
+        quota.inodes_soft_limit = inodes_soft;
+        quota.inodes_hard_limit = inodes_hard;
+
+        // Restore usage values
+        quota.blocks_used = blocks_used;
+        quota.inodes_used = inodes_used;
+
+        // If previously under quota but now over soft limit, start grace period
+        if ((blocks_used > blocks_soft && blocks_soft > 0) ||
+            (inodes_used > inodes_soft && inodes_soft > 0)) {
+            quota.grace_period_start = time(nullptr);
+        }
+
+        publish_limits();
     }
+    save();
 }
 
 void QuotaManager::set_group_quota(int gid, int blocks_soft, int blocks_hard, int inodes_soft,
                                    int inodes_hard) {
-    QuotaEntry &quota = group_quotas[gid];
+    {
+        std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+        QuotaEntry &quota = group_quotas[gid];
+
+        // Preserve current usage values
+        int blocks_used = quota.blocks_used;
+        int inodes_used = quota.inodes_used;
+
+        // Update limits
+        quota.blocks_soft_limit = blocks_soft;
+        quota.blocks_hard_limit = blocks_hard;
+        quota.inodes_soft_limit = inodes_soft;
+        quota.inodes_hard_limit = inodes_hard;
+
+        // Restore usage values
+        quota.blocks_used = blocks_used;
+        quota.inodes_used = inodes_used;
+
+        // If previously under quota but now over soft limit, start grace period
+        if ((blocks_used > blocks_soft && blocks_soft > 0) ||
+            (inodes_used > inodes_soft && inodes_soft > 0)) {
+            quota.grace_period_start = time(nullptr);
+        }
 
-    // Preserve current usage values
-    int blocks_used = quota.blocks_used;
-    int inodes_used = quota.inodes_used;
+        publish_limits();
+    }
+    save();
+}
 
-    // Update limits
-    quota.blocks_soft_limit = blocks_soft;
-    quota.blocks_hard_limit = blocks_hard;
-    quota.inodes_soft_limit = inodes_soft;
-    quota.inodes_hard_limit = inodes_hard;
+bool QuotaManager::set_project_quota(int dir_inode, int blocks_soft, int blocks_hard,
+                                     int inodes_soft, int inodes_hard) {
+    if (!fs->is_valid_inode(dir_inode) || fs->get_inode(dir_inode).mode != 2) {
+        std::cerr << "Error: Project quotas need an existing directory." << std::endl;
+        return false;
+    }
+    if (blocks_soft <= 0 && blocks_hard <= 0 && inodes_soft <= 0 && inodes_hard <= 0) {
+        remove_project_quota(dir_inode);
+        save();
+        return true;
+    }
 
-    // Restore usage values
-    quota.blocks_used = blocks_used;
-    quota.inodes_used = inodes_used;
+    // The subtree is counted once when the project is created; after that the filesystem
+    // reports every change. The scan opens a read view, so it runs outside the mutex.
+    bool is_new;
+    {
+        std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+        is_new = !project_roots[dir_inode];
+    }
+    UsageReport report;
+    if (is_new) {
+        report = UsageScanner(fs).scan();
+    }
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+        QuotaEntry &quota = project_quotas[dir_inode];
+        quota.blocks_soft_limit = blocks_soft;
+        quota.blocks_hard_limit = blocks_hard;
+        quota.inodes_soft_limit = inodes_soft;
+        quota.inodes_hard_limit = inodes_hard;
+        if (is_new && !project_roots[dir_inode]) {
+            quota.blocks_used = report.subtree[dir_inode].blocks;
+            quota.inodes_used = report.subtree[dir_inode].inodes;
+        }
+        project_roots[dir_inode] = true;
+        quota.grace_period_start = 0;
+        start_grace_if_over(quota, time(nullptr));
+        publish_limits();
+    }
+    save();
+    return true;
+}
 
-    // If previously under quota but now over soft limit, start grace period
-    if ((blocks_used > blocks_soft && blocks_soft > 0) ||
-        (inodes_used > inodes_soft && inodes_soft > 0)) {
-        quota.grace_period_start = time(nullptr);
+void QuotaManager::remove_project_quota(int dir_inode) {
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    if (dir_inode < 0 || dir_inode >= NUM_INODES || !project_roots[dir_inode]) {
+        return;
     }
+    project_quotas.erase(dir_inode);
+    project_roots[dir_inode] = false;
+    publish_limits();
 }
 
 QuotaEntry QuotaManager::get_user_quota(int uid) {
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
     auto it = user_quotas.find(uid);
     if (it != user_quotas.end()) {
         return it->second;
@@ -82,6 +297,7 @@ QuotaEntry QuotaManager::get_user_quota(int uid) {
 }
 
 QuotaEntry QuotaManager::get_group_quota(int gid) {
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
     auto it = group_quotas.find(gid);
     if (it != group_quotas.end()) {
         return it->second;
@@ -99,234 +315,273 @@ QuotaEntry QuotaManager::get_group_quota(int gid) {
     return empty;
 }
 
-bool QuotaManager::is_over_quota(const QuotaEntry &quota, bool check_blocks, bool check_inodes) {
-    time_t now = time(nullptr);
+QuotaEntry QuotaManager::get_project_quota(int dir_inode) {
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    auto it = project_quotas.find(dir_inode);
+    if (it != project_quotas.end()) {
+        return it->second;
+    }
+    return QuotaEntry();
+}
+
+std::vector<std::pair<int, QuotaEntry>> QuotaManager::get_project_report() const {
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    std::vector<std::pair<int, QuotaEntry>> report(project_quotas.begin(), project_quotas.end());
+    std::sort(report.begin(), report.end(),
+              [](const std::pair<int, QuotaEntry> &a, const std::pair<int, QuotaEntry> &b) {
+                  return a.first < b.first;
+              });
+    return report;
+}
 
-    if (check_blocks) {
-        // Check hard limit first
-        if (quota.blocks_hard_limit > 0 && quota.blocks_used >= quota.blocks_hard_limit) {
+bool QuotaManager::is_over_quota(const std::unordered_map<int, QuotaCounter> &counters, int id,
+                                 int blocks_needed, int inodes_needed, time_t grace_period) {
+    auto it = counters.find(id);
+    if (it == counters.end()) {
+        return false;
+    }
+    const QuotaCounter &quota = it->second;
+    bool soft_reached = false;
+
+    if (blocks_needed > 0) {
+        // Hard limits apply to the projected usage
+        int blocks_used = quota.blocks_used.load(std::memory_order_relaxed);
+        if (quota.blocks_hard_limit > 0 && blocks_used + blocks_needed > quota.blocks_hard_limit) {
             return true;
         }
+        soft_reached = quota.blocks_soft_limit > 0 && blocks_used >= quota.blocks_soft_limit;
+    }
 
-        // Check soft limit with grace period
-        if (quota.blocks_soft_limit > 0 && quota.blocks_used >= quota.blocks_soft_limit) {
-            // If grace period has started and expired
-            if (quota.grace_period_start > 0 && now - quota.grace_period_start > grace_period) {
-                return true;
-            }
+    if (inodes_needed > 0) {
+        int inodes_used = quota.inodes_used.load(std::memory_order_relaxed);
+        if (quota.inodes_hard_limit > 0 && inodes_used + inodes_needed > quota.inodes_hard_limit) {
+            return true;
         }
+        if (quota.inodes_soft_limit > 0 && inodes_used >= quota.inodes_soft_limit) {
+            soft_reached = true;
+        }
+    }
+
+    // Soft limits only refuse once the grace period has run out
+    if (!soft_reached) {
+        return false;
     }
+    time_t grace_period_start = quota.grace_period_start.load(std::memory_order_relaxed);
+    return grace_period_start > 0 && time(nullptr) - grace_period_start > grace_period;
+}
+
+bool QuotaManager::user_would_exceed(int uid, int blocks_needed, int inodes_needed) const {
+    const QuotaTable *table = limits.load(std::memory_order_acquire);
+    return table && is_over_quota(table->users, uid, blocks_needed, inodes_needed,
+                                  table->grace_period);
+}
 
-    if (check_inodes) {
-        // Check hard limit first
-        if (quota.inodes_hard_limit > 0 && quota.inodes_used >= quota.inodes_hard_limit) {
+bool QuotaManager::group_would_exceed(int gid, int blocks_needed, int inodes_needed) const {
+    const QuotaTable *table = limits.load(std::memory_order_acquire);
+    return table && is_over_quota(table->groups, gid, blocks_needed, inodes_needed,
+                                  table->grace_period);
+}
+
+bool QuotaManager::project_would_exceed(int inode_num, int blocks_needed,
+                                        int inodes_needed) const {
+    const QuotaTable *table = limits.load(std::memory_order_acquire);
+    if (!table || table->projects.empty()) {
+        return false;
+    }
+    // The depth bound guards against a damaged parent chain with a cycle
+    int depth = 0;
+    for (int node = inode_num; node >= 0 && depth < NUM_INODES;
+         node = fs->get_parent_dir(node), depth++) {
+        if (is_over_quota(table->projects, node, blocks_needed, inodes_needed,
+                          table->grace_period)) {
             return true;
         }
+    }
+    return false;
+}
 
-        // Check soft limit with grace period
-        if (quota.inodes_soft_limit > 0 && quota.inodes_used >= quota.inodes_soft_limit) {
-            // If grace period has started and expired
-            if (quota.grace_period_start > 0 && now - quota.grace_period_start > grace_period) {
-                return true;
+bool QuotaManager::would_exceed_quota(int uid, int gid, int blocks_needed,
+                                      int inodes_needed) const {
+    return user_would_exceed(uid, blocks_needed, inodes_needed) ||
+           group_would_exceed(gid, blocks_needed, inodes_needed);
+}
+
+void QuotaManager::publish_limits() {
+    QuotaTable *table = new QuotaTable();
+    table->grace_period = grace_period;
+    auto copy_limited = [](const std::unordered_map<int, QuotaEntry> &quotas,
+                           std::unordered_map<int, QuotaCounter> &counters) {
+        for (const auto &pair : quotas) {
+            const QuotaEntry &quota = pair.second;
+            if (quota.blocks_soft_limit <= 0 && quota.blocks_hard_limit <= 0 &&
+                quota.inodes_soft_limit <= 0 && quota.inodes_hard_limit <= 0) {
+                continue;
             }
+            QuotaCounter &counter = counters[pair.first];
+            counter.blocks_soft_limit = quota.blocks_soft_limit;
+            counter.blocks_hard_limit = quota.blocks_hard_limit;
+            counter.inodes_soft_limit = quota.inodes_soft_limit;
+            counter.inodes_hard_limit = quota.inodes_hard_limit;
+            update_counter(counters, pair.first, quota);
         }
+    };
+    copy_limited(user_quotas, table->users);
+    copy_limited(group_quotas, table->groups);
+    copy_limited(project_quotas, table->projects);
+    if (table->users.empty() && table->groups.empty() && table->projects.empty()) {
+        delete table;
+        table = nullptr;
     }
 
-    return false;
+    QuotaTable *old = limits.exchange(table, std::memory_order_acq_rel);
+    if (old) {
+        retired_tables.push_back(old);
+    }
 }
 
-bool QuotaManager::would_exceed_quota(int uid, int gid, int blocks_needed, int inodes_needed) {
-    // Check user quota
-    QuotaEntry user_quota = get_user_quota(uid);
-    if (is_over_quota(user_quota, blocks_needed > 0, inodes_needed > 0)) {
-        return true;
+void QuotaManager::update_counter(std::unordered_map<int, QuotaCounter> &counters, int id,
+                                  const QuotaEntry &quota) {
+    auto it = counters.find(id);
+    if (it == counters.end()) {
+        return;
     }
+    it->second.blocks_used.store(quota.blocks_used, std::memory_order_relaxed);
+    it->second.inodes_used.store(quota.inodes_used, std::memory_order_relaxed);
+    it->second.grace_period_start.store(quota.grace_period_start, std::memory_order_relaxed);
+}
 
-    // Check projected usage for user
-    if (user_quota.blocks_hard_limit > 0 &&
-        user_quota.blocks_used + blocks_needed > user_quota.blocks_hard_limit) {
-        return true;
+void QuotaManager::start_grace_if_over(QuotaEntry &quota, time_t now) {
+    if (quota.grace_period_start != 0) {
+        return;
     }
-
-    if (user_quota.inodes_hard_limit > 0 &&
-        user_quota.inodes_used + inodes_needed > user_quota.inodes_hard_limit) {
-        return true;
+    if ((quota.blocks_soft_limit > 0 && quota.blocks_used > quota.blocks_soft_limit) ||
+        (quota.inodes_soft_limit > 0 && quota.inodes_used > quota.inodes_soft_limit)) {
+        quota.grace_period_start = now;
     }
+}
 
-    // Check group quota
-    QuotaEntry group_quota = get_group_quota(gid);
-    if (is_over_quota(group_quota, blocks_needed > 0, inodes_needed > 0)) {
-        return true;
+QuotaEntry &QuotaManager::entry_for(std::unordered_map<int, QuotaEntry> &quotas, int id) {
+    auto it = quotas.find(id);
+    if (it == quotas.end()) {
+        it = quotas.emplace(id, QuotaEntry()).first;
     }
+    return it->second;
+}
 
-    // Check projected usage for group
-    if (group_quota.blocks_hard_limit > 0 &&
-        group_quota.blocks_used + blocks_needed > group_quota.blocks_hard_limit) {
-        return true;
+void QuotaManager::charge(int uid, int gid, int blocks, int inodes) {
+    // Concurrent writers charge under the shared namespace lock, so the maps only change
+    // here with the mutex held
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    QuotaEntry &user = entry_for(user_quotas, uid);
+    user.blocks_used += blocks;
+    user.inodes_used += inodes;
+
+    QuotaEntry &group = entry_for(group_quotas, gid);
+    group.blocks_used += blocks;
+    group.inodes_used += inodes;
+
+    if (blocks > 0 || inodes > 0) {
+        time_t now = time(nullptr);
+        start_grace_if_over(user, now);
+        start_grace_if_over(group, now);
     }
 
-    if (group_quota.inodes_hard_limit > 0 &&
-        group_quota.inodes_used + inodes_needed > group_quota.inodes_hard_limit) {
-        return true;
+    if (QuotaTable *table = limits.load(std::memory_order_relaxed)) {
+        update_counter(table->users, uid, user);
+        update_counter(table->groups, gid, group);
     }
-
-    return false;
 }
 
-void QuotaManager::calculate_user_usage() {
-    // Reset all user quotas to zero usage
-    for (auto &pair : user_quotas) {
-        pair.second.blocks_used = 0;
-        pair.second.inodes_used = 0;
+void QuotaManager::charge_projects(int inode_num, int blocks, int inodes) {
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    if (project_quotas.empty() || (blocks == 0 && inodes == 0)) {
+        return;
     }
-
-    // Iterate through all inodes to count usage
-    for (int i = 0; i < NUM_INODES; i++) {
-        Inode inode = fs->get_inode(i);
-
-        // Skip free inodes
-        if (inode.mode == 0)
+    QuotaTable *table = limits.load(std::memory_order_relaxed);
+    time_t now = 0;
+    int depth = 0;
+    for (int node = inode_num; node >= 0 && depth < NUM_INODES;
+         node = fs->get_parent_dir(node), depth++) {
+        auto it = project_quotas.find(node);
+        if (!project_roots[node] || it == project_quotas.end())
             continue;
-
-        // Get user for this inode
-        int uid = inode.uid;
-
-        // Ensure quota entry exists for this user
-        if (user_quotas.find(uid) == user_quotas.end()) {
-            user_quotas[uid] = QuotaEntry();
-            user_quotas[uid].blocks_used = 0;
-            user_quotas[uid].blocks_soft_limit = 0;
-            user_quotas[uid].blocks_hard_limit = 0;
-            user_quotas[uid].inodes_used = 0;
-            user_quotas[uid].inodes_soft_limit = 0;
-            user_quotas[uid].inodes_hard_limit = 0;
-            user_quotas[uid].grace_period_start = 0;
-        }
-
-        // Count inode
-        user_quotas[uid].inodes_used++;
-
-        // Count direct blocks
-        for (int j = 0; j < 10; j++) {
-            if (inode.direct_blocks[j] != 0) {
-                user_quotas[uid].blocks_used++;
+        QuotaEntry &quota = it->second;
+        quota.blocks_used += blocks;
+        quota.inodes_used += inodes;
+        if (blocks > 0 || inodes > 0) {
+            if (now == 0) {
+                now = time(nullptr);
             }
+            start_grace_if_over(quota, now);
         }
-
-        // Count indirect block
-        if (inode.indirect_block != 0) {
-            user_quotas[uid].blocks_used++;
-
-            // Count blocks referenced by indirect block
-            char buffer[BLOCK_SIZE];
-            fs->read_block(inode.indirect_block, buffer);
-            int *block_pointers = (int *)buffer;
-            int pointers_per_block = BLOCK_SIZE / sizeof(int);
-
-            for (int j = 0; j < pointers_per_block; j++) {
-                if (block_pointers[j] != 0) {
-                    user_quotas[uid].blocks_used++;
-                }
-            }
+        if (table) {
+            update_counter(table->projects, node, quota);
         }
     }
 }
 
-void QuotaManager::calculate_group_usage() {
-    // Reset all group quotas to zero usage
-    for (auto &pair : group_quotas) {
+void QuotaManager::apply_usage(std::unordered_map<int, QuotaEntry> &quotas,
+                               const std::unordered_map<int, UsageTotals> &usage) {
+    for (auto &pair : quotas) {
         pair.second.blocks_used = 0;
         pair.second.inodes_used = 0;
     }
-
-    // Iterate through all inodes to count usage
-    for (int i = 0; i < NUM_INODES; i++) {
-        Inode inode = fs->get_inode(i);
-
-        // Skip free inodes
-        if (inode.mode == 0)
-            continue;
-
-        // Get group for this inode
-        int gid = inode.gid;
-
-        // Ensure quota entry exists for this group
-        if (group_quotas.find(gid) == group_quotas.end()) {
-            group_quotas[gid] = QuotaEntry();
-            group_quotas[gid].blocks_used = 0;
-            group_quotas[gid].blocks_soft_limit = 0;
-            group_quotas[gid].blocks_hard_limit = 0;
-            group_quotas[gid].inodes_used = 0;
-            group_quotas[gid].inodes_soft_limit = 0;
-            group_quotas[gid].inodes_hard_limit = 0;
-            group_quotas[gid].grace_period_start = 0;
-        }
-
-        // Count inode
-        group_quotas[gid].inodes_used++;
-
-        // Count direct blocks
-        for (int j = 0; j < 10; j++) {
-            if (inode.direct_blocks[j] != 0) {
-                group_quotas[gid].blocks_used++;
-            }
-        }
-
-        // Count indirect block
-        if (inode.indirect_block != 0) {
-            group_quotas[gid].blocks_used++;
-
-            // Count blocks referenced by indirect block
-            char buffer[BLOCK_SIZE];
-            fs->read_block(inode.indirect_block, buffer);
-            int *block_pointers = (int *)buffer;
-            int pointers_per_block = BLOCK_SIZE / sizeof(int);
-
-            for (int j = 0; j < pointers_per_block; j++) {
-                if (block_pointers[j] != 0) {
-                    group_quotas[gid].blocks_used++;
-                }
-            }
-        }
+    // operator[] value-initializes, so owners seen for the first time get no limits
+    for (const auto &pair : usage) {
+        QuotaEntry &quota = quotas[pair.first];
+        quota.blocks_used = pair.second.blocks;
+        quota.inodes_used = pair.second.inodes;
     }
 }
 
 void QuotaManager::update_usage() {
-    calculate_user_usage();
-    calculate_group_usage();
+    // The scan opens a read view, so it runs outside the mutex
+    apply_report(UsageScanner(fs).scan());
+}
+
+void QuotaManager::apply_report(const UsageReport &report) {
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    apply_usage(user_quotas, report.by_uid);
+    apply_usage(group_quotas, report.by_gid);
+    for (auto &pair : project_quotas) {
+        pair.second.blocks_used = report.subtree[pair.first].blocks;
+        pair.second.inodes_used = report.subtree[pair.first].inodes;
+    }
 
     // Check for new quota violations and start grace periods
     time_t now = time(nullptr);
-
     for (auto &pair : user_quotas) {
-        QuotaEntry &quota = pair.second;
-
-        // Check blocks soft limit
-        if (quota.blocks_soft_limit > 0 && quota.blocks_used > quota.blocks_soft_limit &&
-            quota.grace_period_start == 0) {
-            quota.grace_period_start = now;
-        }
-
-        // Check inodes soft limit
-        if (quota.inodes_soft_limit > 0 && quota.inodes_used > quota.inodes_soft_limit &&
-            quota.grace_period_start == 0) {
-            quota.grace_period_start = now;
-        }
+        start_grace_if_over(pair.second, now);
     }
-
     for (auto &pair : group_quotas) {
-        QuotaEntry &quota = pair.second;
-
-        // Check blocks soft limit
-        if (quota.blocks_soft_limit > 0 && quota.blocks_used > quota.blocks_soft_limit &&
-            quota.grace_period_start == 0) {
-            quota.grace_period_start = now;
-        }
+        start_grace_if_over(pair.second, now);
+    }
+    for (auto &pair : project_quotas) {
+        start_grace_if_over(pair.second, now);
+    }
+    publish_limits();
+}
 
-        // Check inodes soft limit
-        if (quota.inodes_soft_limit > 0 && quota.inodes_used > quota.inodes_soft_limit &&
-            quota.grace_period_start == 0) {
-            quota.grace_period_start = now;
+bool QuotaManager::verify_usage() {
+    UsageReport report = UsageScanner(fs).scan();
+    std::lock_guard<std::recursive_mutex> lock(quota_mutex);
+    std::unordered_map<int, QuotaEntry> users = user_quotas;
+    std::unordered_map<int, QuotaEntry> groups = group_quotas;
+    std::unordered_map<int, QuotaEntry> projects = project_quotas;
+    apply_report(report);
+
+    auto same_usage = [](const std::unordered_map<int, QuotaEntry> &before,
+                         const std::unordered_map<int, QuotaEntry> &after) {
+        for (const auto &pair : after) {
+            auto it = before.find(pair.first);
+            int blocks = it == before.end() ? 0 : it->second.blocks_used;
+            int inodes = it == before.end() ? 0 : it->second.inodes_used;
+            if (blocks != pair.second.blocks_used || inodes != pair.second.inodes_used) {
+                return false;
+            }
         }
-    }
+        return true;
+    };
+    return same_usage(users, user_quotas) && same_usage(groups, group_quotas) &&
+           same_usage(projects, project_quotas);
 }
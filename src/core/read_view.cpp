@@ -0,0 +1,98 @@
+#include "core/read_view.h"
+#include <algorithm>
+#include <cstring>
+
+ReadView::ReadView(FileSystem *fs) : fs(fs), view_id(-1) {
+    view_id = fs->open_read_view(state);
+    if (view_id == -1) {
+        state = std::make_shared<ViewState>();
+    }
+}
+
+ReadView::~ReadView() {
+    if (view_id != -1) {
+        fs->close_read_view(view_id);
+    }
+}
+
+bool ReadView::is_open() const {
+    return view_id != -1 && fs->is_read_view_open(view_id);
+}
+
+unsigned long long ReadView::get_generation() const {
+    return state->generation;
+}
+
+const std::vector<Inode> &ReadView::get_inodes() const {
+    return state->inodes;
+}
+
+const NameIndex *ReadView::get_name_index() const {
+    return state->names;
+}
+
+const InodeIndex *ReadView::get_inode_index() const {
+    return state->attributes;
+}
+
+Inode ReadView::get_inode(int inode_num) const {
+    if (inode_num < 0 || inode_num >= static_cast<int>(state->inodes.size())) {
+        Inode empty = {};
+        return empty;
+    }
+    return state->inodes[inode_num];
+}
+
+int ReadView::get_parent_dir(int inode_num) const {
+    if (inode_num < 0 || inode_num >= static_cast<int>(state->parent_dirs.size())) {
+        return -1;
+    }
+    return state->parent_dirs[inode_num];
+}
+
+std::vector<DirEntry> ReadView::get_dir_entries(int inode_num) const {
+    std::vector<DirEntry> entries;
+    Inode inode = get_inode(inode_num);
+    if (inode.mode != 2 || !is_open()) {
+        return entries;
+    }
+
+    std::vector<int> blocks;
+    for (int i = 0; i < 10 && inode.direct_blocks[i] != 0; ++i) {
+        blocks.push_back(inode.direct_blocks[i]);
+    }
+    std::vector<char> data(blocks.size() * BLOCK_SIZE);
+    fs->read_blocks(blocks, data.data());
+    int per_block = BLOCK_SIZE / sizeof(DirEntry);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        for (int j = 0; j < per_block; ++j) {
+            DirEntry entry;
+            memcpy(&entry, data.data() + i * BLOCK_SIZE + j * sizeof(DirEntry),
+                   sizeof(DirEntry));
+            if (entry.inode_num != -1) {
+                entries.push_back(entry);
+            }
+        }
+    }
+    return entries;
+}
+
+bool ReadView::read_inode_data(int inode_num, std::string &content) const {
+    content.clear();
+    Inode inode = get_inode(inode_num);
+    if (inode.mode != 1 || !is_open()) {
+        return false;
+    }
+
+    // Pinned blocks keep the contents this table points at, indirect block included
+    std::vector<int> blocks;
+    fs->get_file_blocks(inode, blocks);
+    int blocks_needed = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (static_cast<int>(blocks.size()) > blocks_needed) {
+        blocks.resize(blocks_needed);
+    }
+    content.resize(blocks.size() * BLOCK_SIZE);
+    fs->read_blocks(blocks, &content[0]);
+    content.resize(std::min<size_t>(content.size(), inode.size));
+    return true;
+}
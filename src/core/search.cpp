@@ -1,9 +1,19 @@
 #include "core/search.h"
+#include "core/inode_index.h"
+#include "core/name_index.h"
+#include "core/read_view.h"
+#include "core/search_expression.h"
 #include <algorithm>
-#include <queue>
-#include <regex>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
 
-FileSystemSearch::FileSystemSearch(FileSystem *fs) : fs(fs) {
+FileSystemSearch::FileSystemSearch(FileSystem *fs)
+    : fs(fs), thread_count(0), has_parsed_query(false), cache_capacity(16), cache_clock(0) {
 }
 
 void FileSystemSearch::add_name_criteria(const std::string &name) {
@@ -55,121 +65,489 @@ void FileSystemSearch::add_permission(int perm) {
     this->criteria.push_back(criteria);
 }
 
+void FileSystemSearch::add_content_criteria(const std::string &text) {
+    SearchCriteria criteria;
+    criteria.type = SearchCriteriaType::CONTENT;
+    criteria.stringValue = text;
+    this->criteria.push_back(criteria);
+}
+
+bool FileSystemSearch::set_query(const std::string &text, std::string &error) {
+    criteria.clear();
+    has_parsed_query = parsed_query.parse(text, error);
+    return has_parsed_query;
+}
+
 void FileSystemSearch::clear_criteria() {
     criteria.clear();
+    has_parsed_query = false;
+}
+
+void FileSystemSearch::scan_directory(const ReadView &view, int dir_inode,
+                                      const std::string &current_path,
+                                      const QueryExpression &query,
+                                      const std::vector<bool> *candidates,
+                                      std::vector<SearchResult> &results,
+                                      std::vector<std::pair<int, std::string>> &subdirs) {
+    // Get directory entries
+    std::vector<DirEntry> entries = view.get_dir_entries(dir_inode);
+
+    for (const auto &entry : entries) {
+        // Skip . and .. entries
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+            continue;
+        }
+
+        // Get inode for this entry
+        Inode inode = view.get_inode(entry.inode_num);
+        bool candidate = !candidates || (entry.inode_num >= 0 &&
+                                         entry.inode_num < static_cast<int>(candidates->size()) &&
+                                         (*candidates)[entry.inode_num]);
+        if (!candidate && inode.mode != 2) {
+            continue;
+        }
+
+        // Only pay for building the path when something needs it
+        std::string path;
+        if (inode.mode == 2 || query.uses_path()) {
+            path = current_path.empty() ? std::string(entry.name)
+                                        : current_path + "/" + entry.name;
+        }
+
+        // Check if this entry matches search criteria; file data is only read once the
+        // cheaper predicates leave nothing else to decide
+        SearchResult result;
+        if (candidate && query.matches(view, entry.inode_num, inode, entry.name, path,
+                                       &result.content_hits)) {
+            if (path.empty()) {
+                path = current_path.empty() ? std::string(entry.name)
+                                            : current_path + "/" + entry.name;
+            }
+            result.path = path;
+            result.inode_num = entry.inode_num;
+            result.is_dir = inode.mode == 2;
+            result.size = inode.size;
+            result.modification_time = inode.modification_time;
+            results.push_back(result);
+        }
+
+        // Directories become more work for the pool, unless a path predicate rules out
+        // everything inside them
+        if (inode.mode == 2 && query.may_match_below(path)) {
+            subdirs.emplace_back(entry.inode_num, path);
+        }
+    }
 }
 
-bool FileSystemSearch::match_criteria(const Inode &inode, const std::string &name,
-                                      const std::string &path) {
-    // If no criteria, match everything
-    if (criteria.empty()) {
+std::vector<SearchResult> FileSystemSearch::search() {
+    std::vector<SearchResult> results;
+    search([&results](const SearchResult &result) {
+        results.push_back(result);
         return true;
+    });
+
+    // Workers finish in any order; keep the listing stable
+    std::sort(results.begin(), results.end(),
+              [](const SearchResult &a, const SearchResult &b) { return a.path < b.path; });
+    return results;
+}
+
+void FileSystemSearch::set_thread_count(unsigned count) {
+    thread_count = count;
+}
+
+unsigned FileSystemSearch::worker_count() const {
+    if (thread_count != 0) {
+        return thread_count;
     }
+    return std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+}
 
-    // Check all criteria
-    for (const auto &criteria : this->criteria) {
-        switch (criteria.type) {
-            case SearchCriteriaType::NAME: {
-                // Use regex for name matching
-                std::regex pattern(criteria.stringValue, std::regex_constants::icase);
-                if (!std::regex_search(name, pattern)) {
-                    return false;
-                }
+size_t FileSystemSearch::search(const SearchCallback &on_result, size_t limit,
+                                const std::atomic<bool> *cancel) {
+    // The cache is checked against the live generation, so a hit opens no view. Otherwise
+    // the whole search reads one consistent version of the tree and its indexes, which is
+    // also the version its results are cached for. Results only go into the cache when the
+    // search ran to the end.
+    QueryExpression query = current_query();
+    size_t delivered = 0;
+    std::string key = query.canonical();
+    std::vector<SearchResult> collected;
+    bool complete = true;
+    bool collecting = cache_capacity > 0;
+
+    auto cancelled = [cancel]() { return cancel != nullptr && cancel->load(); };
+    auto deliver = [&](const SearchResult &result) {
+        if (cancelled()) {
+            complete = false;
+            return false;
+        }
+        delivered++;
+        if (collecting) {
+            collected.push_back(result);
+        }
+        bool more = on_result(result) && (limit == 0 || delivered < limit);
+        complete = complete && more;
+        return more;
+    };
+
+    // While the filesystem is unchanged, the same query gives the same answer
+    if (const CachedSearch *cached = find_cached(key, fs->get_generation())) {
+        collecting = false;
+        for (const auto &result : cached->results) {
+            if (!deliver(result)) {
                 break;
             }
+        }
+        return delivered;
+    }
 
-            case SearchCriteriaType::SIZE_GREATER_THAN:
-                if (inode.size <= criteria.intValue) {
-                    return false;
-                }
-                break;
+    // Plan the query once for the whole walk
+    ReadView view(fs);
+    query.plan(view.get_inode_index());
+    unsigned long long generation = view.get_generation();
+    auto finish = [&]() {
+        if (collecting && complete && !cancelled()) {
+            store_cached(key, generation, collected);
+        }
+        return delivered;
+    };
 
-            case SearchCriteriaType::SIZE_LESS_THAN:
-                if (inode.size >= criteria.intValue) {
-                    return false;
-                }
-                break;
+    // Index plans produce their whole (small) result list up front
+    std::vector<int> planned;
+    SearchPlan plan = plan_search(view, query.required(), planned);
+    std::vector<bool> candidates;
+    if (plan == SearchPlan::SIZE_INDEX || plan == SearchPlan::MTIME_INDEX) {
+        candidates.assign(NUM_INODES, false);
+        for (int inode_num : planned) {
+            candidates[inode_num] = true;
+        }
+    }
 
-            case SearchCriteriaType::MODIFIED_AFTER:
-                if (inode.modification_time <= criteria.timeValue) {
-                    return false;
-                }
+    std::vector<SearchResult> indexed;
+    bool have_indexed = true;
+    if (plan == SearchPlan::NAME_INDEX) {
+        search_name_index(view, planned, indexed);
+    } else if (plan != SearchPlan::TREE_WALK && planned.empty()) {
+        // Nothing is in range, so there is nothing to walk for
+    } else if (plan != SearchPlan::TREE_WALK && view.get_name_index()) {
+        search_attribute_index(view, candidates, indexed);
+    } else {
+        have_indexed = false;
+    }
+    if (have_indexed) {
+        verify_results(view, query, indexed);
+        for (const auto &result : indexed) {
+            if (!deliver(result)) {
                 break;
+            }
+        }
+        return finish();
+    }
 
-            case SearchCriteriaType::MODIFIED_BEFORE:
-                if (inode.modification_time >= criteria.timeValue) {
-                    return false;
-                }
-                break;
+    // Without a name index to resolve paths, a range plan still walks the tree but only
+    // evaluates the inodes the attribute index returned
+    const std::vector<bool> *filter = candidates.empty() ? nullptr : &candidates;
 
-            case SearchCriteriaType::FILE_TYPE: {
-                bool matches = false;
-                if (criteria.stringValue == "file" && inode.mode == 1) {
-                    matches = true;
-                } else if (criteria.stringValue == "dir" && inode.mode == 2) {
-                    matches = true;
-                } else if (criteria.stringValue == "symlink" && inode.mode == 3) {
-                    matches = true;
-                }
+    // Shared state between the caller and the workers: directories still to scan, results
+    // not yet delivered, and how many workers are in the middle of a directory
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable results_ready;
+    std::deque<std::pair<int, std::string>> pending_dirs;
+    std::vector<SearchResult> pending_results;
+    int active = 0;
+    bool stop = false;
+
+    if (query.may_match_below("")) {
+        pending_dirs.emplace_back(0, ""); // Start search from root directory
+    }
 
-                if (!matches) {
-                    return false;
+    auto worker = [&]() {
+        std::vector<SearchResult> found;
+        std::vector<std::pair<int, std::string>> subdirs;
+        for (;;) {
+            std::pair<int, std::string> dir;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&]() {
+                    return stop || !pending_dirs.empty() || active == 0;
+                });
+                if (stop || pending_dirs.empty()) {
+                    return;
                 }
-                break;
+                dir = std::move(pending_dirs.front());
+                pending_dirs.pop_front();
+                active++;
+            }
+
+            found.clear();
+            subdirs.clear();
+            if (!cancelled()) {
+                scan_directory(view, dir.first, dir.second, query, filter, found, subdirs);
             }
 
-            case SearchCriteriaType::PERMISSION: {
-                // Check if permissions match (assuming mode has UNIX-style perms in lower bits)
-                if ((inode.mode & 0777) != criteria.intValue) {
-                    return false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto &subdir : subdirs) {
+                    pending_dirs.push_back(std::move(subdir));
+                }
+                for (auto &result : found) {
+                    pending_results.push_back(std::move(result));
                 }
+                active--;
+            }
+            work_ready.notify_all();
+            results_ready.notify_one();
+        }
+    };
+
+    unsigned num_threads = worker_count();
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < num_threads; i++) {
+        workers.emplace_back(worker);
+    }
+
+    // Deliver results on the calling thread as they arrive
+    std::vector<SearchResult> batch;
+    for (;;) {
+        bool finished;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            results_ready.wait_for(lock, std::chrono::milliseconds(10), [&]() {
+                return !pending_results.empty() || (pending_dirs.empty() && active == 0);
+            });
+            batch.swap(pending_results);
+            finished = pending_dirs.empty() && active == 0;
+        }
+
+        bool keep_going = !cancelled();
+        for (const auto &result : batch) {
+            if (!keep_going || !deliver(result)) {
+                keep_going = false;
                 break;
             }
         }
+        batch.clear();
+
+        if (!keep_going || finished) {
+            break;
+        }
     }
 
-    // All criteria matched
-    return true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    work_ready.notify_all();
+    for (auto &thread : workers) {
+        thread.join();
+    }
+
+    return finish();
 }
 
-void FileSystemSearch::search_directory(int dir_inode, const std::string &current_path,
-                                        std::vector<SearchResult> &results) {
-    // Get directory entries
-    std::vector<DirEntry> entries = fs->get_dir_entries(dir_inode);
+const FileSystemSearch::CachedSearch *
+FileSystemSearch::find_cached(const std::string &key, unsigned long long generation) {
+    for (auto &entry : cache) {
+        if (entry.key == key && entry.generation == generation) {
+            entry.last_used = ++cache_clock;
+            return &entry;
+        }
+    }
+    return nullptr;
+}
 
-    for (const auto &entry : entries) {
-        // Skip . and .. entries
-        std::string name = entry.name;
-        if (name == "." || name == "..") {
-            continue;
+void FileSystemSearch::store_cached(const std::string &key, unsigned long long generation,
+                                    std::vector<SearchResult> &results) {
+    // Walk workers finish in any order; cached replays come back sorted like search()
+    std::sort(results.begin(), results.end(),
+              [](const SearchResult &a, const SearchResult &b) { return a.path < b.path; });
+
+    // Reuse the query's slot when it is cached for an older generation, otherwise evict the
+    // least recently used entry once the cache is full
+    CachedSearch *slot = nullptr;
+    for (auto &entry : cache) {
+        if (entry.key == key) {
+            slot = &entry;
+            break;
         }
+    }
+    if (!slot && cache.size() < cache_capacity) {
+        cache.emplace_back();
+        slot = &cache.back();
+    }
+    if (!slot) {
+        slot = &*std::min_element(cache.begin(), cache.end(),
+                                  [](const CachedSearch &a, const CachedSearch &b) {
+                                      return a.last_used < b.last_used;
+                                  });
+    }
 
-        // Get inode for this entry
-        Inode inode = fs->get_inode(entry.inode_num);
+    slot->key = key;
+    slot->generation = generation;
+    slot->results.swap(results);
+    slot->last_used = ++cache_clock;
+}
 
-        // Build path for this entry
-        std::string path = current_path.empty() ? name : current_path + "/" + name;
+void FileSystemSearch::set_cache_capacity(size_t entries) {
+    cache_capacity = entries;
+    if (cache.size() > cache_capacity) {
+        cache.clear();
+    }
+}
 
-        // Check if this entry matches search criteria
-        if (match_criteria(inode, name, path)) {
-            SearchResult result;
-            result.path = path;
-            result.inode_num = entry.inode_num;
-            results.push_back(result);
+void FileSystemSearch::clear_cache() {
+    cache.clear();
+}
+
+SearchPlan FileSystemSearch::explain() {
+    ReadView view(fs);
+    std::vector<int> candidates;
+    return plan_search(view, build_query(view).required(), candidates);
+}
+
+std::string FileSystemSearch::describe_query() {
+    ReadView view(fs);
+    return build_query(view).describe();
+}
+
+QueryExpression FileSystemSearch::current_query() const {
+    return has_parsed_query ? parsed_query : QueryExpression(criteria);
+}
+
+QueryExpression FileSystemSearch::build_query(const ReadView &view) {
+    QueryExpression query = current_query();
+    query.plan(view.get_inode_index());
+    return query;
+}
+
+SearchPlan FileSystemSearch::plan_search(const ReadView &view, const CompiledQuery &query,
+                                         std::vector<int> &candidates) {
+    candidates.clear();
+    SearchPlan plan = SearchPlan::TREE_WALK;
+    size_t best = SIZE_MAX;
+
+    // The name index has no cheap count, so its estimate is the candidate list itself
+    const NameIndex *names = view.get_name_index();
+    std::string literal;
+    std::vector<int> slots;
+    if (names && query.index_literal(literal) && names->candidates(literal, slots)) {
+        plan = SearchPlan::NAME_INDEX;
+        best = slots.size();
+    }
+
+    // Range counts are two binary searches each
+    const InodeIndex *attributes = view.get_inode_index();
+    long long size_lower, size_upper, mtime_lower, mtime_upper;
+    if (attributes && query.size_range(size_lower, size_upper)) {
+        size_t count = attributes->by_size().count_range(size_lower, size_upper);
+        if (count < best) {
+            plan = SearchPlan::SIZE_INDEX;
+            best = count;
         }
+    }
+    if (attributes && query.mtime_range(mtime_lower, mtime_upper)) {
+        size_t count = attributes->by_mtime().count_range(mtime_lower, mtime_upper);
+        if (count < best) {
+            plan = SearchPlan::MTIME_INDEX;
+            best = count;
+        }
+    }
+
+    // Only the chosen access path is scanned; every other criterion is checked per candidate
+    if (plan == SearchPlan::NAME_INDEX) {
+        candidates.swap(slots);
+    } else if (plan == SearchPlan::SIZE_INDEX) {
+        attributes->by_size().scan_range(size_lower, size_upper, candidates);
+    } else if (plan == SearchPlan::MTIME_INDEX) {
+        attributes->by_mtime().scan_range(mtime_lower, mtime_upper, candidates);
+    }
+    return plan;
+}
 
-        // If this is a directory, recurse into it
-        if (inode.mode == 2) {
-            search_directory(entry.inode_num, path, results);
+void FileSystemSearch::verify_results(const ReadView &view, const QueryExpression &query,
+                                      std::vector<SearchResult> &results) {
+    // Workers claim results one at a time; keep[] is indexed so no two threads share a slot
+    std::vector<char> keep(results.size(), 0);
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < results.size(); i = next++) {
+            SearchResult &result = results[i];
+            Inode inode = view.get_inode(result.inode_num);
+            size_t slash = result.path.find_last_of('/');
+            const char *name =
+                result.path.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+            keep[i] = query.matches(view, result.inode_num, inode, name, result.path,
+                                    &result.content_hits);
         }
+    };
+
+    // Only reading file data is worth spreading over threads
+    unsigned num_threads = query.uses_content() ? worker_count() : 1;
+    num_threads = std::min<size_t>(num_threads, results.size());
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < num_threads; i++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : workers) {
+        thread.join();
     }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+        if (!keep[i]) {
+            continue;
+        }
+        if (kept != i) {
+            results[kept] = std::move(results[i]);
+        }
+        kept++;
+    }
+    results.resize(kept);
+
+    // Match the ordering of a tree walk as closely as a flat list allows
+    std::sort(results.begin(), results.end(),
+              [](const SearchResult &a, const SearchResult &b) { return a.path < b.path; });
 }
 
-std::vector<SearchResult> FileSystemSearch::search() {
-    std::vector<SearchResult> results;
+void FileSystemSearch::search_attribute_index(const ReadView &view,
+                                              const std::vector<bool> &candidates,
+                                              std::vector<SearchResult> &results) {
+    // Every name of a candidate inode is a separate result, so resolve names through the
+    // entry table instead of walking directories
+    const NameIndex *index = view.get_name_index();
+    std::vector<int> slots;
+    for (int slot = 0; slot < index->slot_count(); slot++) {
+        int inode_num = index->get_entry(slot).inode_num;
+        if (inode_num >= 0 && inode_num < static_cast<int>(candidates.size()) &&
+            candidates[inode_num]) {
+            slots.push_back(slot);
+        }
+    }
+    search_name_index(view, slots, results);
+}
 
-    // Start search from root directory
-    search_directory(0, "", results);
+void FileSystemSearch::search_name_index(const ReadView &view, const std::vector<int> &slots,
+                                         std::vector<SearchResult> &results) {
+    const NameIndex *index = view.get_name_index();
+    for (int slot : slots) {
+        const NameIndexEntry &entry = index->get_entry(slot);
 
-    return results;
+        // Entries under detached directories are not reachable from the root
+        std::string path = index->path_of(slot);
+        if (path.empty()) {
+            continue;
+        }
+
+        Inode inode = view.get_inode(entry.inode_num);
+        SearchResult result;
+        result.path = path;
+        result.inode_num = entry.inode_num;
+        result.is_dir = inode.mode == 2;
+        result.size = inode.size;
+        result.modification_time = inode.modification_time;
+        results.push_back(result);
+    }
 }
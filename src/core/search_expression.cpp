@@ -0,0 +1,787 @@
+#include "core/search_expression.h"
+#include "core/inode_index.h"
+#include "core/read_view.h"
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+// Selectivity guesses for predicates the attribute index can't count
+const double NAME_SELECTIVITY = 0.1;
+const double TYPE_SELECTIVITY = 0.4;
+const double PERMISSION_SELECTIVITY = 0.1;
+const double CONTENT_SELECTIVITY = 0.1;
+const double PATH_SELECTIVITY = 0.2;
+const double RANGE_SELECTIVITY = 0.3;
+const double PATH_COST = 2;
+
+std::string upper_string(const std::string &text) {
+    std::string result = text;
+    std::transform(result.begin(), result.end(), result.begin(),
+                   [](unsigned char c) { return std::toupper(c); });
+    return result;
+}
+
+// Strip the quotes from a value, resolving \" and \\ escapes
+std::string unquote(const std::string &value) {
+    if (value.size() < 2 || value.front() != '"') {
+        return value;
+    }
+    std::string result;
+    for (size_t i = 1; i + 1 < value.size(); i++) {
+        if (value[i] == '\\' && i + 2 < value.size()) {
+            i++;
+        }
+        result += value[i];
+    }
+    return result;
+}
+
+std::string escape_regex(const std::string &text) {
+    std::string result;
+    for (char c : text) {
+        if (strchr("\\^$.|?*+()[]{}", c) != nullptr) {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result;
+}
+
+// Decimal number with an optional K/M/G (binary) suffix
+bool parse_size(const std::string &text, long long &value) {
+    char *end = nullptr;
+    value = strtoll(text.c_str(), &end, 10);
+    if (end == text.c_str()) {
+        return false;
+    }
+    std::string suffix = upper_string(end);
+    if (suffix == "K" || suffix == "KB") {
+        value *= 1024LL;
+    } else if (suffix == "M" || suffix == "MB") {
+        value *= 1024LL * 1024;
+    } else if (suffix == "G" || suffix == "GB") {
+        value *= 1024LL * 1024 * 1024;
+    } else if (!suffix.empty() && suffix != "B") {
+        return false;
+    }
+    return true;
+}
+
+// Turn a comparison into exclusive lower/upper criteria, the only form the criteria support
+void add_range(std::vector<SearchCriteria> &criteria, SearchCriteriaType above,
+               SearchCriteriaType below, const std::string &op, long long value) {
+    long long lower = LLONG_MIN;
+    long long upper = LLONG_MAX;
+    if (op == ">") {
+        lower = value;
+    } else if (op == ">=") {
+        lower = value - 1;
+    } else if (op == "<") {
+        upper = value;
+    } else if (op == "<=") {
+        upper = value + 1;
+    } else {
+        lower = value - 1;
+        upper = value + 1;
+    }
+
+    // Size criteria hold an int; a bound past its range constrains nothing anyway
+    auto clamp = [](long long bound) {
+        return static_cast<int>(std::max<long long>(INT_MIN, std::min<long long>(INT_MAX, bound)));
+    };
+    SearchCriteria criterion;
+    if (lower != LLONG_MIN) {
+        criterion.type = above;
+        criterion.intValue = clamp(lower);
+        criterion.timeValue = static_cast<time_t>(lower);
+        criteria.push_back(criterion);
+    }
+    if (upper != LLONG_MAX) {
+        criterion.type = below;
+        criterion.intValue = clamp(upper);
+        criterion.timeValue = static_cast<time_t>(upper);
+        criteria.push_back(criterion);
+    }
+}
+
+// How a criterion added through the FileSystemSearch API reads in query syntax
+std::string criterion_text(const SearchCriteria &criterion) {
+    switch (criterion.type) {
+        case SearchCriteriaType::NAME:
+            return "name~\"" + criterion.stringValue + "\"";
+        case SearchCriteriaType::SIZE_GREATER_THAN:
+            return "size>" + std::to_string(criterion.intValue);
+        case SearchCriteriaType::SIZE_LESS_THAN:
+            return "size<" + std::to_string(criterion.intValue);
+        case SearchCriteriaType::MODIFIED_AFTER:
+            return "mtime>" + std::to_string(static_cast<long long>(criterion.timeValue));
+        case SearchCriteriaType::MODIFIED_BEFORE:
+            return "mtime<" + std::to_string(static_cast<long long>(criterion.timeValue));
+        case SearchCriteriaType::FILE_TYPE:
+            return "type=" + criterion.stringValue;
+        case SearchCriteriaType::PERMISSION: {
+            char octal[16];
+            snprintf(octal, sizeof(octal), "%o", criterion.intValue);
+            return std::string("perm=") + octal;
+        }
+        case SearchCriteriaType::CONTENT:
+            return "content:\"" + criterion.stringValue + "\"";
+    }
+    return "";
+}
+
+// Paths are compared relative to the root with no leading or trailing slash
+std::string normalize_path(const std::string &path) {
+    size_t first = path.find_first_not_of('/');
+    if (first == std::string::npos) {
+        return "";
+    }
+    size_t last = path.find_last_not_of('/');
+    return path.substr(first, last - first + 1);
+}
+
+bool path_under(const std::string &path, const std::string &prefix) {
+    return prefix.empty() || path == prefix ||
+           (path.size() > prefix.size() && path.compare(0, prefix.size(), prefix) == 0 &&
+            path[prefix.size()] == '/');
+}
+
+} // namespace
+
+QueryExpression::QueryExpression()
+    : root(-1), has_path(false), has_content(false), position(0) {
+}
+
+QueryExpression::QueryExpression(const std::vector<SearchCriteria> &criteria)
+    : root(-1), has_path(false), has_content(false), position(0) {
+    // Content patterns share one predicate so a single pass over the data finds them all
+    std::vector<int> leaves;
+    std::vector<SearchCriteria> content;
+    std::string content_text;
+    for (const auto &criterion : criteria) {
+        if (criterion.type == SearchCriteriaType::CONTENT) {
+            content.push_back(criterion);
+            content_text += (content_text.empty() ? "" : " ") + criterion_text(criterion);
+            continue;
+        }
+        int predicate = add_predicate({criterion}, criterion_text(criterion));
+        leaves.push_back(add_node(QueryNodeType::PREDICATE, predicate));
+    }
+    if (!content.empty()) {
+        int predicate = add_predicate(content, content_text);
+        leaves.push_back(add_node(QueryNodeType::PREDICATE, predicate));
+    }
+    if (leaves.size() == 1) {
+        root = leaves[0];
+    } else if (!leaves.empty()) {
+        root = add_node(QueryNodeType::AND, -1);
+        nodes[root].children = leaves;
+    }
+    finish();
+}
+
+int QueryExpression::add_node(QueryNodeType type, int predicate) {
+    Node node;
+    node.type = type;
+    node.predicate = predicate;
+    node.cost = 0;
+    node.selectivity = 1;
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
+
+int QueryExpression::add_predicate(const std::vector<SearchCriteria> &criteria,
+                                   const std::string &text) {
+    Predicate predicate;
+    predicate.criteria = criteria;
+    predicate.compiled = CompiledQuery(criteria);
+    predicate.is_path = false;
+    predicate.text = text;
+    has_content = has_content || !predicate.compiled.content().empty();
+    predicates.push_back(predicate);
+    return predicates.size() - 1;
+}
+
+int QueryExpression::add_path_predicate(const std::string &prefix, const std::string &text) {
+    Predicate predicate;
+    predicate.is_path = true;
+    predicate.path_prefix = normalize_path(prefix);
+    predicate.text = text;
+    predicates.push_back(predicate);
+    return predicates.size() - 1;
+}
+
+bool QueryExpression::parse(const std::string &text, std::string &error) {
+    nodes.clear();
+    predicates.clear();
+    root = -1;
+    has_path = false;
+    has_content = false;
+    parse_error.clear();
+    position = 0;
+
+    if (tokenize(text)) {
+        if (!tokens.empty()) {
+            root = parse_or();
+            if (root != -1 && position < tokens.size()) {
+                parse_error = "Unexpected '" + tokens[position] + "'";
+                root = -1;
+            }
+        }
+    }
+
+    if (!parse_error.empty()) {
+        nodes.clear();
+        predicates.clear();
+        root = -1;
+        has_path = false;
+        has_content = false;
+        error = parse_error;
+        finish();
+        return false;
+    }
+    finish();
+    return true;
+}
+
+bool QueryExpression::tokenize(const std::string &text) {
+    tokens.clear();
+    size_t i = 0;
+    while (i < text.size()) {
+        if (std::isspace(static_cast<unsigned char>(text[i]))) {
+            i++;
+            continue;
+        }
+        if (text[i] == '(' || text[i] == ')') {
+            tokens.push_back(std::string(1, text[i]));
+            i++;
+            continue;
+        }
+
+        // A term runs to the next space or parenthesis outside quotes
+        std::string token;
+        while (i < text.size() && !std::isspace(static_cast<unsigned char>(text[i])) &&
+               text[i] != '(' && text[i] != ')') {
+            if (text[i] != '"') {
+                token += text[i++];
+                continue;
+            }
+            size_t close = i + 1;
+            while (close < text.size() && text[close] != '"') {
+                close += text[close] == '\\' ? 2 : 1;
+            }
+            if (close >= text.size()) {
+                parse_error = "Unterminated quote";
+                return false;
+            }
+            token += text.substr(i, close - i + 1);
+            i = close + 1;
+        }
+        tokens.push_back(token);
+    }
+    return true;
+}
+
+int QueryExpression::parse_or() {
+    int left = parse_and();
+    if (left == -1) {
+        return -1;
+    }
+    std::vector<int> terms = {left};
+    while (position < tokens.size() && upper_string(tokens[position]) == "OR") {
+        position++;
+        int right = parse_and();
+        if (right == -1) {
+            return -1;
+        }
+        terms.push_back(right);
+    }
+    if (terms.size() == 1) {
+        return left;
+    }
+    int node = add_node(QueryNodeType::OR, -1);
+    nodes[node].children = terms;
+    return node;
+}
+
+int QueryExpression::parse_and() {
+    int left = parse_not();
+    if (left == -1) {
+        return -1;
+    }
+    std::vector<int> terms = {left};
+    while (position < tokens.size() && tokens[position] != ")" &&
+           upper_string(tokens[position]) != "OR") {
+        if (upper_string(tokens[position]) == "AND") {
+            position++;
+        }
+        int right = parse_not();
+        if (right == -1) {
+            return -1;
+        }
+        terms.push_back(right);
+    }
+    if (terms.size() == 1) {
+        return left;
+    }
+    int node = add_node(QueryNodeType::AND, -1);
+    nodes[node].children = terms;
+    return node;
+}
+
+int QueryExpression::parse_not() {
+    if (position >= tokens.size() || tokens[position] == ")" ||
+        upper_string(tokens[position]) == "AND" || upper_string(tokens[position]) == "OR") {
+        parse_error = position < tokens.size() ? "Expected a search term before '" +
+                                                     tokens[position] + "'"
+                                               : "Expected a search term at the end";
+        return -1;
+    }
+
+    const std::string &token = tokens[position++];
+    if (upper_string(token) == "NOT") {
+        int child = parse_not();
+        if (child == -1) {
+            return -1;
+        }
+        int node = add_node(QueryNodeType::NOT, -1);
+        nodes[node].children.push_back(child);
+        return node;
+    }
+    if (token == "(") {
+        int inner = parse_or();
+        if (inner == -1) {
+            return -1;
+        }
+        if (position >= tokens.size() || tokens[position] != ")") {
+            parse_error = "Expected ')'";
+            return -1;
+        }
+        position++;
+        return inner;
+    }
+    return parse_predicate(token);
+}
+
+int QueryExpression::parse_predicate(const std::string &token) {
+    // field, then an operator; anything else is a bare name pattern
+    size_t field_end = 0;
+    while (field_end < token.size() &&
+           std::isalpha(static_cast<unsigned char>(token[field_end]))) {
+        field_end++;
+    }
+    std::string op;
+    if (field_end > 0 && field_end < token.size()) {
+        if (token.compare(field_end, 2, ">=") == 0 || token.compare(field_end, 2, "<=") == 0) {
+            op = token.substr(field_end, 2);
+        } else if (strchr("~=<>:", token[field_end]) != nullptr) {
+            op = token.substr(field_end, 1);
+        }
+    }
+
+    std::vector<SearchCriteria> criteria;
+    SearchCriteria criterion;
+    if (op.empty()) {
+        criterion.type = SearchCriteriaType::NAME;
+        criterion.stringValue = unquote(token);
+        criteria.push_back(criterion);
+        return add_node(QueryNodeType::PREDICATE, add_predicate(criteria, token));
+    }
+
+    std::string field = upper_string(token.substr(0, field_end));
+    std::string value = unquote(token.substr(field_end + op.size()));
+    bool comparison = op == ">" || op == "<" || op == ">=" || op == "<=" || op == "=";
+    bool matching = op == "~" || op == ":" || op == "=";
+    auto fail = [&](const std::string &message) {
+        parse_error = message + " in '" + token + "'";
+        return -1;
+    };
+
+    if (field == "NAME" && matching) {
+        criterion.type = SearchCriteriaType::NAME;
+        criterion.stringValue = op == "=" ? "^" + escape_regex(value) + "$" : value;
+        criteria.push_back(criterion);
+    } else if (field == "CONTENT" && matching) {
+        criterion.type = SearchCriteriaType::CONTENT;
+        criterion.stringValue = value;
+        criteria.push_back(criterion);
+    } else if (field == "PATH" && (op == ":" || op == "=")) {
+        has_path = true;
+        return add_node(QueryNodeType::PREDICATE, add_path_predicate(value, token));
+    } else if (field == "SIZE" && comparison) {
+        long long size;
+        if (!parse_size(value, size)) {
+            return fail("Invalid size");
+        }
+        add_range(criteria, SearchCriteriaType::SIZE_GREATER_THAN,
+                  SearchCriteriaType::SIZE_LESS_THAN, op, size);
+    } else if (field == "MTIME" && comparison) {
+        char *end = nullptr;
+        long long seconds = strtoll(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0') {
+            return fail("Invalid time");
+        }
+        add_range(criteria, SearchCriteriaType::MODIFIED_AFTER,
+                  SearchCriteriaType::MODIFIED_BEFORE, op, seconds);
+    } else if (field == "TYPE" && (op == "=" || op == ":")) {
+        if (value != "file" && value != "dir" && value != "symlink") {
+            return fail("Unknown type");
+        }
+        criterion.type = SearchCriteriaType::FILE_TYPE;
+        criterion.stringValue = value;
+        criteria.push_back(criterion);
+    } else if (field == "PERM" && (op == "=" || op == ":")) {
+        char *end = nullptr;
+        long permission = strtol(value.c_str(), &end, 8);
+        if (value.empty() || *end != '\0') {
+            return fail("Invalid permission");
+        }
+        criterion.type = SearchCriteriaType::PERMISSION;
+        criterion.intValue = static_cast<int>(permission);
+        criteria.push_back(criterion);
+    } else {
+        return fail("Unknown field or operator");
+    }
+    return add_node(QueryNodeType::PREDICATE, add_predicate(criteria, token));
+}
+
+void QueryExpression::finish() {
+    tokens.clear();
+
+    // A top-level AND (or a lone predicate) gives criteria every match must satisfy
+    std::vector<SearchCriteria> required;
+    std::vector<int> conjuncts;
+    if (root != -1 && nodes[root].type == QueryNodeType::AND) {
+        conjuncts = nodes[root].children;
+    } else if (root != -1) {
+        conjuncts.push_back(root);
+    }
+    for (int node : conjuncts) {
+        if (nodes[node].type == QueryNodeType::PREDICATE) {
+            const Predicate &predicate = predicates[nodes[node].predicate];
+            required.insert(required.end(), predicate.criteria.begin(), predicate.criteria.end());
+        }
+    }
+    required_query = CompiledQuery(required);
+
+    plan(nullptr);
+}
+
+void QueryExpression::plan(const InodeIndex *attributes) {
+    if (root != -1) {
+        plan_node(root, attributes);
+    }
+}
+
+void QueryExpression::plan_node(int node_index, const InodeIndex *attributes) {
+    Node &node = nodes[node_index];
+    switch (node.type) {
+        case QueryNodeType::PREDICATE: {
+            const Predicate &predicate = predicates[node.predicate];
+            if (predicate.is_path) {
+                node.cost = PATH_COST;
+                node.selectivity = PATH_SELECTIVITY;
+                return;
+            }
+
+            node.cost = predicate.compiled.estimated_cost();
+            node.selectivity = 1;
+            bool ranged = false;
+            for (const auto &criterion : predicate.criteria) {
+                switch (criterion.type) {
+                    case SearchCriteriaType::NAME:
+                        node.selectivity *= NAME_SELECTIVITY;
+                        break;
+                    case SearchCriteriaType::FILE_TYPE:
+                        node.selectivity *= TYPE_SELECTIVITY;
+                        break;
+                    case SearchCriteriaType::PERMISSION:
+                        node.selectivity *= PERMISSION_SELECTIVITY;
+                        break;
+                    case SearchCriteriaType::CONTENT:
+                        node.selectivity *= CONTENT_SELECTIVITY;
+                        break;
+                    default:
+                        ranged = true;
+                        break;
+                }
+            }
+            if (!ranged) {
+                return;
+            }
+
+            // Count ranges exactly when the index is available
+            long long lower, upper;
+            if (attributes && attributes->by_size().size() > 0 &&
+                predicate.compiled.size_range(lower, upper)) {
+                node.selectivity *= static_cast<double>(attributes->by_size().count_range(
+                                        lower, upper)) /
+                                    attributes->by_size().size();
+            } else if (predicate.compiled.size_range(lower, upper)) {
+                node.selectivity *= RANGE_SELECTIVITY;
+            }
+            if (attributes && attributes->by_mtime().size() > 0 &&
+                predicate.compiled.mtime_range(lower, upper)) {
+                node.selectivity *= static_cast<double>(attributes->by_mtime().count_range(
+                                        lower, upper)) /
+                                    attributes->by_mtime().size();
+            } else if (predicate.compiled.mtime_range(lower, upper)) {
+                node.selectivity *= RANGE_SELECTIVITY;
+            }
+            return;
+        }
+
+        case QueryNodeType::NOT:
+            plan_node(node.children[0], attributes);
+            nodes[node_index].cost = nodes[node.children[0]].cost;
+            nodes[node_index].selectivity = 1 - nodes[node.children[0]].selectivity;
+            return;
+
+        case QueryNodeType::AND:
+        case QueryNodeType::OR: {
+            for (int child : node.children) {
+                plan_node(child, attributes);
+            }
+
+            // Evaluate first whatever settles the outcome for the least work: for AND the
+            // children most likely to fail, for OR those most likely to succeed
+            bool is_and = node.type == QueryNodeType::AND;
+            auto rank = [&](int child) {
+                double decisive = is_and ? 1 - nodes[child].selectivity : nodes[child].selectivity;
+                return nodes[child].cost / std::max(decisive, 1e-6);
+            };
+            Node &group = nodes[node_index];
+            std::stable_sort(group.children.begin(), group.children.end(),
+                             [&](int a, int b) { return rank(a) < rank(b); });
+
+            // Expected cost given short-circuiting, and the combined selectivity
+            double reached = 1;
+            double cost = 0;
+            for (int child : group.children) {
+                cost += reached * nodes[child].cost;
+                reached *= is_and ? nodes[child].selectivity : 1 - nodes[child].selectivity;
+            }
+            group.cost = cost;
+            group.selectivity = is_and ? reached : 1 - reached;
+            return;
+        }
+    }
+}
+
+bool QueryExpression::empty() const {
+    return root == -1;
+}
+
+bool QueryExpression::uses_path() const {
+    return has_path;
+}
+
+bool QueryExpression::uses_content() const {
+    return has_content;
+}
+
+const CompiledQuery &QueryExpression::required() const {
+    return required_query;
+}
+
+bool QueryExpression::matches(const ReadView &view, int inode_num, const Inode &inode,
+                              const char *name, const std::string &path,
+                              std::vector<ContentHit> *hits) const {
+    if (root == -1) {
+        return true;
+    }
+    std::string data;
+    bool data_loaded = false;
+    bool matched = evaluate(root, view, inode_num, inode, name, path, data, data_loaded, hits);
+
+    // Several content predicates each report their own hits
+    if (matched && hits) {
+        std::stable_sort(hits->begin(), hits->end(), [](const ContentHit &a, const ContentHit &b) {
+            return a.offset < b.offset;
+        });
+    }
+    return matched;
+}
+
+bool QueryExpression::evaluate(int node_index, const ReadView &view, int inode_num,
+                               const Inode &inode, const char *name, const std::string &path,
+                               std::string &data, bool &data_loaded,
+                               std::vector<ContentHit> *hits) const {
+    const int MAX_HITS_PER_FILE = 256;
+
+    const Node &node = nodes[node_index];
+    switch (node.type) {
+        case QueryNodeType::AND:
+            for (int child : node.children) {
+                if (!evaluate(child, view, inode_num, inode, name, path, data, data_loaded, hits))
+                    return false;
+            }
+            return true;
+
+        case QueryNodeType::OR:
+            for (int child : node.children) {
+                if (evaluate(child, view, inode_num, inode, name, path, data, data_loaded, hits))
+                    return true;
+            }
+            return false;
+
+        case QueryNodeType::NOT:
+            // Hits found under a NOT describe a non-match, so they aren't reported
+            return !evaluate(node.children[0], view, inode_num, inode, name, path, data,
+                             data_loaded, nullptr);
+
+        case QueryNodeType::PREDICATE:
+            break;
+    }
+
+    const Predicate &predicate = predicates[node.predicate];
+    if (predicate.is_path) {
+        return path_under(path, predicate.path_prefix);
+    }
+    if (!predicate.compiled.matches(inode, name)) {
+        return false;
+    }
+
+    const ContentMatcher &content = predicate.compiled.content();
+    if (content.empty()) {
+        return true;
+    }
+    if (!data_loaded) {
+        data_loaded = true;
+        if (!view.read_inode_data(inode_num, data)) {
+            return false;
+        }
+    }
+    std::vector<ContentHit> found;
+    bool matched = content.scan(data.data(), data.size(), found, MAX_HITS_PER_FILE) ==
+                   content.all_patterns();
+    if (matched && hits) {
+        hits->insert(hits->end(), found.begin(), found.end());
+    }
+    return matched;
+}
+
+bool QueryExpression::may_match_below(const std::string &dir_path) const {
+    return root == -1 || !has_path || evaluate_below(root, dir_path) != Tristate::NEVER;
+}
+
+QueryExpression::Tristate QueryExpression::evaluate_below(int node_index,
+                                                          const std::string &dir_path) const {
+    const Node &node = nodes[node_index];
+    switch (node.type) {
+        case QueryNodeType::AND: {
+            Tristate result = Tristate::ALWAYS;
+            for (int child : node.children) {
+                Tristate outcome = evaluate_below(child, dir_path);
+                if (outcome == Tristate::NEVER)
+                    return Tristate::NEVER;
+                if (outcome == Tristate::MAYBE)
+                    result = Tristate::MAYBE;
+            }
+            return result;
+        }
+
+        case QueryNodeType::OR: {
+            Tristate result = Tristate::NEVER;
+            for (int child : node.children) {
+                Tristate outcome = evaluate_below(child, dir_path);
+                if (outcome == Tristate::ALWAYS)
+                    return Tristate::ALWAYS;
+                if (outcome == Tristate::MAYBE)
+                    result = Tristate::MAYBE;
+            }
+            return result;
+        }
+
+        case QueryNodeType::NOT: {
+            Tristate outcome = evaluate_below(node.children[0], dir_path);
+            if (outcome == Tristate::MAYBE)
+                return outcome;
+            return outcome == Tristate::ALWAYS ? Tristate::NEVER : Tristate::ALWAYS;
+        }
+
+        case QueryNodeType::PREDICATE:
+            break;
+    }
+
+    // Only path predicates can be decided for a whole subtree
+    const Predicate &predicate = predicates[node.predicate];
+    if (!predicate.is_path) {
+        return Tristate::MAYBE;
+    }
+    if (path_under(dir_path, predicate.path_prefix)) {
+        return Tristate::ALWAYS;
+    }
+    // An ancestor of the prefix still has matching entries somewhere below it
+    if (path_under(predicate.path_prefix, dir_path)) {
+        return Tristate::MAYBE;
+    }
+    return Tristate::NEVER;
+}
+
+std::string QueryExpression::describe() const {
+    return root == -1 ? "(all)" : describe_node(root);
+}
+
+std::string QueryExpression::describe_node(int node_index) const {
+    const Node &node = nodes[node_index];
+    switch (node.type) {
+        case QueryNodeType::PREDICATE:
+            return predicates[node.predicate].text;
+        case QueryNodeType::NOT:
+            return "NOT " + describe_node(node.children[0]);
+        case QueryNodeType::AND:
+        case QueryNodeType::OR:
+            break;
+    }
+
+    std::string text = "(";
+    for (size_t i = 0; i < node.children.size(); i++) {
+        if (i > 0) {
+            text += node.type == QueryNodeType::AND ? " AND " : " OR ";
+        }
+        text += describe_node(node.children[i]);
+    }
+    return text + ")";
+}
+
+std::string QueryExpression::canonical() const {
+    return root == -1 ? "" : canonical_node(root);
+}
+
+std::string QueryExpression::canonical_node(int node_index) const {
+    const Node &node = nodes[node_index];
+    if (node.type == QueryNodeType::NOT) {
+        return "NOT " + canonical_node(node.children[0]);
+    }
+
+    std::vector<std::string> parts;
+    std::string separator;
+    if (node.type == QueryNodeType::PREDICATE) {
+        const Predicate &predicate = predicates[node.predicate];
+        if (predicate.is_path) {
+            return "path:/" + predicate.path_prefix;
+        }
+        for (const auto &criterion : predicate.criteria) {
+            parts.push_back(criterion_text(criterion));
+        }
+        separator = " AND ";
+    } else {
+        for (int child : node.children) {
+            parts.push_back(canonical_node(child));
+        }
+        separator = node.type == QueryNodeType::AND ? " AND " : " OR ";
+    }
+
+    std::sort(parts.begin(), parts.end());
+    std::string text = parts.size() > 1 ? "(" : "";
+    for (size_t i = 0; i < parts.size(); i++) {
+        text += (i > 0 ? separator : "") + parts[i];
+    }
+    return parts.size() > 1 ? text + ")" : text;
+}
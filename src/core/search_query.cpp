@@ -0,0 +1,383 @@
+#include "core/search_query.h"
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+
+namespace {
+
+const char *REGEX_METACHARACTERS = "\\^$.|?*+()[]{}";
+
+// Lower-case a directory entry name into a fixed buffer. Names are bounded by
+// MAX_FILENAME_LENGTH, so this never allocates.
+size_t lower_name(const char *name, char *out) {
+    size_t length = 0;
+    while (length < MAX_FILENAME_LENGTH - 1 && name[length] != '\0') {
+        out[length] = std::tolower(static_cast<unsigned char>(name[length]));
+        length++;
+    }
+    out[length] = '\0';
+    return length;
+}
+
+std::string lower_string(const std::string &text) {
+    std::string result = text;
+    std::transform(result.begin(), result.end(), result.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+bool has_metacharacters(const std::string &text) {
+    return text.find_first_of(REGEX_METACHARACTERS) != std::string::npos;
+}
+
+// Relative cost of each matcher kind, used to order name checks
+int match_cost(NameMatchKind kind) {
+    switch (kind) {
+        case NameMatchKind::EXACT:
+        case NameMatchKind::PREFIX:
+        case NameMatchKind::SUFFIX:
+            return 0;
+        case NameMatchKind::SUBSTRING:
+            return 1;
+        case NameMatchKind::GLOB:
+            return 2;
+        case NameMatchKind::REGEX:
+            return 3;
+    }
+    return 3;
+}
+
+} // namespace
+
+NameMatcher::NameMatcher(const std::string &pattern_text) : kind(NameMatchKind::REGEX) {
+    std::string body = pattern_text;
+    bool anchored_start = !body.empty() && body.front() == '^';
+    if (anchored_start) {
+        body.erase(0, 1);
+    }
+    bool anchored_end = body.size() > 0 && body.back() == '$' &&
+                        (body.size() < 2 || body[body.size() - 2] != '\\');
+    if (anchored_end) {
+        body.pop_back();
+    }
+
+    if (!has_metacharacters(body)) {
+        literal = lower_string(body);
+        if (anchored_start && anchored_end) {
+            kind = NameMatchKind::EXACT;
+        } else if (anchored_start) {
+            kind = NameMatchKind::PREFIX;
+        } else if (anchored_end) {
+            kind = NameMatchKind::SUFFIX;
+        } else {
+            kind = NameMatchKind::SUBSTRING;
+        }
+        return;
+    }
+
+    // "*.txt" is what people type into a search box; it isn't a valid regex anyway
+    bool glob_like = pattern_text.find_first_of("\\^$|+()[]{}") == std::string::npos &&
+                     !pattern_text.empty() && pattern_text.front() == '*';
+    if (!glob_like) {
+        try {
+            pattern = std::regex(pattern_text, std::regex_constants::icase |
+                                                   std::regex_constants::optimize);
+            kind = NameMatchKind::REGEX;
+            return;
+        } catch (const std::regex_error &) {
+            // Fall through and treat the pattern as a glob
+        }
+    }
+
+    literal = lower_string(pattern_text);
+    kind = NameMatchKind::GLOB;
+}
+
+NameMatchKind NameMatcher::get_kind() const {
+    return kind;
+}
+
+const std::string &NameMatcher::get_literal() const {
+    return literal;
+}
+
+bool NameMatcher::glob_match(const char *glob, const char *name) {
+    // Iterative '*' / '?' matcher that backtracks only to the most recent star
+    const char *star = nullptr;
+    const char *star_name = nullptr;
+    while (*name != '\0') {
+        if (*glob == '?' || *glob == *name) {
+            glob++;
+            name++;
+        } else if (*glob == '*') {
+            star = glob++;
+            star_name = name;
+        } else if (star != nullptr) {
+            glob = star + 1;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*glob == '*') {
+        glob++;
+    }
+    return *glob == '\0';
+}
+
+bool NameMatcher::matches(const char *name) const {
+    if (kind == NameMatchKind::REGEX) {
+        return std::regex_search(name, pattern);
+    }
+
+    char lowered[MAX_FILENAME_LENGTH];
+    size_t length = lower_name(name, lowered);
+
+    switch (kind) {
+        case NameMatchKind::SUBSTRING:
+            return literal.empty() ||
+                   memmem(lowered, length, literal.data(), literal.size()) != nullptr;
+        case NameMatchKind::PREFIX:
+            return length >= literal.size() &&
+                   memcmp(lowered, literal.data(), literal.size()) == 0;
+        case NameMatchKind::SUFFIX:
+            return length >= literal.size() &&
+                   memcmp(lowered + length - literal.size(), literal.data(), literal.size()) ==
+                       0;
+        case NameMatchKind::EXACT:
+            return length == literal.size() && memcmp(lowered, literal.data(), length) == 0;
+        case NameMatchKind::GLOB:
+            return glob_match(literal.c_str(), lowered);
+        case NameMatchKind::REGEX:
+            break;
+    }
+    return false;
+}
+
+ContentMatcher::ContentMatcher() : window(0) {
+    std::fill(shift, shift + 256, 0);
+}
+
+void ContentMatcher::add_pattern(const std::string &pattern) {
+    // The hit mask has one bit per pattern
+    if (pattern.empty() || patterns.size() >= 64) {
+        return;
+    }
+    patterns.push_back(pattern);
+
+    // The window, and with it every skip distance, depends on the shortest pattern
+    window = patterns[0].size();
+    for (const auto &p : patterns) {
+        window = std::min(window, p.size());
+    }
+    std::fill(shift, shift + 256, window);
+    for (auto &list : ending_with) {
+        list.clear();
+    }
+    for (size_t i = 0; i < patterns.size(); i++) {
+        const std::string &p = patterns[i];
+        for (size_t j = 0; j + 1 < window; j++) {
+            size_t &skip = shift[static_cast<unsigned char>(p[j])];
+            skip = std::min(skip, window - 1 - j);
+        }
+        ending_with[static_cast<unsigned char>(p[window - 1])].push_back(i);
+    }
+}
+
+bool ContentMatcher::empty() const {
+    return patterns.empty();
+}
+
+size_t ContentMatcher::pattern_count() const {
+    return patterns.size();
+}
+
+unsigned long long ContentMatcher::all_patterns() const {
+    return patterns.size() == 64 ? ~0ULL : (1ULL << patterns.size()) - 1;
+}
+
+unsigned long long ContentMatcher::scan(const char *data, size_t length,
+                                        std::vector<ContentHit> &hits, size_t max_hits) const {
+    unsigned long long found = 0;
+    if (patterns.empty() || length < window) {
+        return found;
+    }
+
+    size_t start = 0;
+    while (start + window <= length) {
+        unsigned char last = static_cast<unsigned char>(data[start + window - 1]);
+        for (int index : ending_with[last]) {
+            const std::string &p = patterns[index];
+            if (start + p.size() <= length && memcmp(data + start, p.data(), p.size()) == 0) {
+                found |= 1ULL << index;
+                if (hits.size() < max_hits) {
+                    hits.push_back({static_cast<int>(start), index});
+                }
+            }
+        }
+        start += shift[last];
+    }
+    return found;
+}
+
+CompiledQuery::CompiledQuery() {
+}
+
+CompiledQuery::CompiledQuery(const std::vector<SearchCriteria> &criteria) {
+    for (const auto &criterion : criteria) {
+        switch (criterion.type) {
+            case SearchCriteriaType::NAME:
+                name_matchers.emplace_back(criterion.stringValue);
+                break;
+
+            case SearchCriteriaType::CONTENT:
+                content_matcher.add_pattern(criterion.stringValue);
+                break;
+
+            case SearchCriteriaType::SIZE_GREATER_THAN:
+            case SearchCriteriaType::SIZE_LESS_THAN:
+            case SearchCriteriaType::PERMISSION:
+                attribute_predicates.push_back({criterion.type, criterion.intValue});
+                break;
+
+            case SearchCriteriaType::MODIFIED_AFTER:
+            case SearchCriteriaType::MODIFIED_BEFORE:
+                attribute_predicates.push_back(
+                    {criterion.type, static_cast<long long>(criterion.timeValue)});
+                break;
+
+            case SearchCriteriaType::FILE_TYPE: {
+                // Resolve the type name to an inode mode now; unknown names match nothing
+                long long mode = -1;
+                if (criterion.stringValue == "file") {
+                    mode = 1;
+                } else if (criterion.stringValue == "dir") {
+                    mode = 2;
+                } else if (criterion.stringValue == "symlink") {
+                    mode = 3;
+                }
+                attribute_predicates.push_back({criterion.type, mode});
+                break;
+            }
+        }
+    }
+
+    // Type checks reject the most entries for the least work, so they go first
+    std::stable_sort(attribute_predicates.begin(), attribute_predicates.end(),
+                     [](const AttributePredicate &a, const AttributePredicate &b) {
+                         return (a.type == SearchCriteriaType::FILE_TYPE) >
+                                (b.type == SearchCriteriaType::FILE_TYPE);
+                     });
+    std::stable_sort(name_matchers.begin(), name_matchers.end(),
+                     [](const NameMatcher &a, const NameMatcher &b) {
+                         return match_cost(a.get_kind()) < match_cost(b.get_kind());
+                     });
+}
+
+bool CompiledQuery::empty() const {
+    return attribute_predicates.empty() && name_matchers.empty() && content_matcher.empty();
+}
+
+bool CompiledQuery::matches(const Inode &inode, const char *name) const {
+    if (!content_matcher.empty() && inode.mode != 1) {
+        return false;
+    }
+    for (const auto &predicate : attribute_predicates) {
+        switch (predicate.type) {
+            case SearchCriteriaType::SIZE_GREATER_THAN:
+                if (inode.size <= predicate.value)
+                    return false;
+                break;
+            case SearchCriteriaType::SIZE_LESS_THAN:
+                if (inode.size >= predicate.value)
+                    return false;
+                break;
+            case SearchCriteriaType::MODIFIED_AFTER:
+                if (inode.modification_time <= predicate.value)
+                    return false;
+                break;
+            case SearchCriteriaType::MODIFIED_BEFORE:
+                if (inode.modification_time >= predicate.value)
+                    return false;
+                break;
+            case SearchCriteriaType::FILE_TYPE:
+                if (inode.mode != predicate.value)
+                    return false;
+                break;
+            case SearchCriteriaType::PERMISSION:
+                // Assumes mode has UNIX-style perms in lower bits
+                if ((inode.mode & 0777) != predicate.value)
+                    return false;
+                break;
+            case SearchCriteriaType::NAME:
+            case SearchCriteriaType::CONTENT:
+                break;
+        }
+    }
+
+    for (const auto &matcher : name_matchers) {
+        if (!matcher.matches(name)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const ContentMatcher &CompiledQuery::content() const {
+    return content_matcher;
+}
+
+double CompiledQuery::estimated_cost() const {
+    // An attribute check is a compare; a regex is dozens of times slower than a memcmp, and
+    // reading file data dwarfs everything
+    double cost = attribute_predicates.size();
+    for (const auto &matcher : name_matchers) {
+        int kind_cost = match_cost(matcher.get_kind());
+        cost += kind_cost == 3 ? 40 : 2 + kind_cost;
+    }
+    if (!content_matcher.empty()) {
+        cost += 500;
+    }
+    return cost;
+}
+
+bool CompiledQuery::index_literal(std::string &literal) const {
+    literal.clear();
+    for (const auto &matcher : name_matchers) {
+        bool literal_kind = matcher.get_kind() != NameMatchKind::GLOB &&
+                            matcher.get_kind() != NameMatchKind::REGEX;
+        if (literal_kind && matcher.get_literal().size() > literal.size()) {
+            literal = matcher.get_literal();
+        }
+    }
+    return !literal.empty();
+}
+
+bool CompiledQuery::attribute_range(SearchCriteriaType above, SearchCriteriaType below,
+                                    long long &lower, long long &upper) const {
+    lower = LLONG_MIN;
+    upper = LLONG_MAX;
+    bool constrained = false;
+    for (const auto &predicate : attribute_predicates) {
+        if (predicate.type == above) {
+            lower = std::max(lower, predicate.value);
+            constrained = true;
+        } else if (predicate.type == below) {
+            upper = std::min(upper, predicate.value);
+            constrained = true;
+        }
+    }
+    return constrained;
+}
+
+bool CompiledQuery::size_range(long long &lower, long long &upper) const {
+    return attribute_range(SearchCriteriaType::SIZE_GREATER_THAN,
+                           SearchCriteriaType::SIZE_LESS_THAN, lower, upper);
+}
+
+bool CompiledQuery::mtime_range(long long &lower, long long &upper) const {
+    return attribute_range(SearchCriteriaType::MODIFIED_AFTER,
+                           SearchCriteriaType::MODIFIED_BEFORE, lower, upper);
+}
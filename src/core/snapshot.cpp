@@ -1,305 +1,79 @@
 #include "core/snapshot.h"
-#include <algorithm>
 #include <cstring>
+#include <fstream>
 #include <iostream>
-#include <sstream>
 
-SnapshotManager::SnapshotManager(FileSystem *fs) : fs(fs), snapshot_dir(".snapshots") {
-    // Ensure snapshot directory exists
-    ensure_snapshot_directory();
-}
-
-int SnapshotManager::ensure_snapshot_directory() {
-    // Check if .snapshots directory exists in root
-    int root_inode = 0;
-    std::vector<DirEntry> entries = fs->get_dir_entries(root_inode);
-
-    for (const auto &entry : entries) {
-        if (std::string(entry.name) == snapshot_dir) {
-            return entry.inode_num;
-        }
-    }
-
-    // Directory doesn't exist, create it
-    // We don't have direct access to create_directory with a specific path
-    // In a real implementation, we would need additional methods
-    // For now, we'll use the existing public API
-
-    // Save current directory
-    int current_dir = 0; // Assuming we start at root
-
-    // Create the snapshot directory
-    fs->mkdir(snapshot_dir);
-
-    // Find the new directory's inode
-    entries = fs->get_dir_entries(root_inode);
-    for (const auto &entry : entries) {
-        if (std::string(entry.name) == snapshot_dir) {
-            return entry.inode_num;
+namespace {
+
+const int STREAM_MAGIC = 0x53534E44; // "SSND"
+const int STREAM_VERSION = 1;
+
+enum StreamRecordType {
+    STREAM_INODE = 1,        // An Inode, then count runs of {first index, length} and data
+    STREAM_ADD_ENTRY = 2,    // A DirEntry for directory inode_num
+    STREAM_REMOVE_ENTRY = 3, // Likewise
+    STREAM_END = 4
+};
+
+struct StreamHeader {
+    int magic;
+    int version;
+    char base[MAX_FILENAME_LENGTH]; // Empty for a full stream
+    char name[MAX_FILENAME_LENGTH];
+    unsigned long long base_fingerprint;
+};
+
+struct StreamRecord {
+    int type;
+    int inode_num;
+    int count;
+};
+
+// FNV-1a over the number and generation of every inode in use, which identifies a tree
+// without reading any data
+unsigned long long fingerprint(const std::vector<Inode> &table) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < static_cast<int>(table.size()); ++i) {
+        if (table[i].mode == 0)
+            continue;
+        int values[3] = {i, table[i].mode, table[i].generation};
+        const unsigned char *bytes = (const unsigned char *)values;
+        for (size_t k = 0; k < sizeof(values); ++k) {
+            hash = (hash ^ bytes[k]) * 1099511628211ULL;
         }
     }
-
-    return -1; // Failed to find or create directory
+    return hash;
 }
 
-void SnapshotManager::copy_blocks(const Inode &src_inode, int dest_inode_num) {
-    // Get destination inode
-    Inode dest_inode = fs->get_inode(dest_inode_num);
-
-    // Copy direct blocks
-    for (int i = 0; i < 10; i++) {
-        if (src_inode.direct_blocks[i] != 0) {
-            // For a full implementation, we would:
-            // 1. Allocate a new block
-            // 2. Copy data from source to new block
-            // 3. Update the destination inode
-
-            // For now, we'll directly copy the block reference
-            // This is not a true "snapshot" since blocks are shared
-            dest_inode.direct_blocks[i] = src_inode.direct_blocks[i];
-        }
-    }
-
-    // Copy indirect block if present
-    if (src_inode.indirect_block != 0) {
-        // In a full implementation, we'd allocate a new block
-        // and copy all the data. For now, we'll share the indirect block.
-        dest_inode.indirect_block = src_inode.indirect_block;
-    }
-
-    // Update destination inode size and other metadata
-    dest_inode.size = src_inode.size;
-
-    // Write back inode changes
-    // In a full implementation, we'd need a method to update the inode
-    // For now, we can't do this without more access to the filesystem internals
+void write_entry(std::ofstream &out, int type, int dir, const std::string &name, int inode_num) {
+    StreamRecord record = {type, dir, 0};
+    DirEntry entry;
+    memset(&entry, 0, sizeof(DirEntry));
+    strncpy(entry.name, name.c_str(), MAX_FILENAME_LENGTH - 1);
+    entry.inode_num = inode_num;
+    out.write((const char *)&record, sizeof(record));
+    out.write((const char *)&entry, sizeof(entry));
 }
 
-void SnapshotManager::copy_directory(int src_dir_inode, int dest_dir_inode) {
-    // Get entries in source directory
-    std::vector<DirEntry> entries = fs->get_dir_entries(src_dir_inode);
-
-    for (const auto &entry : entries) {
-        // Skip . and .. entries
-        std::string name = entry.name;
-        if (name == "." || name == "..") {
-            continue;
-        }
-
-        // Get source inode
-        Inode src_inode = fs->get_inode(entry.inode_num);
+} // namespace
 
-        if (src_inode.mode == 1) {
-            // Regular file
-            // Create new file in destination directory
-            // We need to save current directory, change to destination, create file, then restore
-            int current_dir_inode = 0; // Would get from filesystem in real implementation
-
-            // Change to destination directory
-            // fs->cd_to_inode(dest_dir_inode); // Would be implemented in filesystem
-
-            // Create new file
-            fs->create(name);
-
-            // Find new file's inode
-            std::vector<DirEntry> dest_entries = fs->get_dir_entries(dest_dir_inode);
-            int new_file_inode = -1;
-            for (const auto &dest_entry : dest_entries) {
-                if (std::string(dest_entry.name) == name) {
-                    new_file_inode = dest_entry.inode_num;
-                    break;
-                }
-            }
-
-            if (new_file_inode != -1) {
-                // Copy the data blocks
-                copy_blocks(src_inode, new_file_inode);
-            }
-
-            // Restore original directory
-            // fs->cd_to_inode(current_dir_inode);
-        } else if (src_inode.mode == 2) {
-            // Directory
-            // Create new directory in destination
-            int current_dir_inode = 0; // Would get from filesystem in real implementation
-
-            // Change to destination directory
-            // fs->cd_to_inode(dest_dir_inode);
-
-            // Create new directory
-            fs->mkdir(name);
-
-            // Find new directory's inode
-            std::vector<DirEntry> dest_entries = fs->get_dir_entries(dest_dir_inode);
-            int new_dir_inode = -1;
-            for (const auto &dest_entry : dest_entries) {
-                if (std::string(dest_entry.name) == name) {
-                    new_dir_inode = dest_entry.inode_num;
-                    break;
-                }
-            }
-
-            if (new_dir_inode != -1) {
-                // Recursively copy directory contents
-                copy_directory(entry.inode_num, new_dir_inode);
-            }
-
-            // Restore original directory
-            // fs->cd_to_inode(current_dir_inode);
-        } else if (src_inode.mode == 3) {
-            // Symbolic link
-            // Create new symlink in destination
-            int current_dir_inode = 0;
-
-            // Change to destination directory
-            // fs->cd_to_inode(dest_dir_inode);
-
-            // Create new symlink - we need the target
-            char buffer[BLOCK_SIZE];
-            fs->read_block(src_inode.direct_blocks[0], buffer);
-            std::string target(buffer);
-
-            // Create symlink
-            fs->symlink(target, name);
-
-            // Restore original directory
-            // fs->cd_to_inode(current_dir_inode);
-        }
-    }
+SnapshotManager::SnapshotManager(FileSystem *fs) : fs(fs) {
 }
 
 bool SnapshotManager::create_snapshot(const std::string &name) {
-    // Make sure snapshot directory exists
-    int snapshot_dir_inode = ensure_snapshot_directory();
-    if (snapshot_dir_inode == -1) {
-        return false;
-    }
-
-    // Check if snapshot with this name already exists
-    std::vector<DirEntry> entries = fs->get_dir_entries(snapshot_dir_inode);
-    for (const auto &entry : entries) {
-        if (std::string(entry.name) == name) {
-            // Snapshot already exists
-            return false;
-        }
-    }
-
-    // Save current directory
-    int current_dir = fs->find_inode_by_path(".");
-
-    // Change to snapshot directory
-    fs->cd(snapshot_dir);
-
-    // Create new directory for the snapshot
-    fs->mkdir(name);
-
-    // Find the new directory's inode
-    entries = fs->get_dir_entries(snapshot_dir_inode);
-    int snapshot_inode = -1;
-    for (const auto &entry : entries) {
-        if (std::string(entry.name) == name) {
-            snapshot_inode = entry.inode_num;
-            break;
-        }
-    }
-
-    if (snapshot_inode == -1) {
-        // Failed to create snapshot directory
-        fs->cd(".");
-        return false;
-    }
-
-    // Copy root directory to snapshot directory
-    copy_directory(0, snapshot_inode);
-
-    // Return to original directory
-    fs->cd(".");
-
-    return true;
+    // Only the inode table is saved; data blocks are shared until the live tree changes them
+    return fs->create_snapshot(name);
 }
 
 bool SnapshotManager::restore_snapshot(const std::string &name) {
-    // This is a simplified implementation
-    // A real implementation would need to:
-    // 1. Unmount the current filesystem
-    // 2. Make a backup of the current state
-    // 3. Copy the snapshot over the current state
-    // 4. Remount the filesystem
-
-    // Find snapshot directory
-    int snapshot_dir_inode = ensure_snapshot_directory();
-    if (snapshot_dir_inode == -1) {
-        return false;
-    }
-
-    // Check if snapshot exists
-    std::vector<DirEntry> entries = fs->get_dir_entries(snapshot_dir_inode);
-    int snapshot_inode = -1;
-    for (const auto &entry : entries) {
-        if (std::string(entry.name) == name) {
-            snapshot_inode = entry.inode_num;
-            break;
-        }
-    }
-
-    if (snapshot_inode == -1) {
-        // Snapshot doesn't exist
-        return false;
-    }
-
-    // Save current directory
-    int current_dir = fs->find_inode_by_path(".");
-
-    // For a real implementation, we would:
-    // 1. Back up important data
-    // 2. Clear the root directory (except the snapshot directory)
-    // 3. Copy everything from the snapshot to the root
-
-    // For now, just report success
-    std::cout << "Restoring snapshot '" << name << "'" << std::endl;
-
-    // Return to original directory
-    fs->cd(".");
-
-    return true;
+    // The saved inode table becomes the live one; nothing is copied, and the blocks only the
+    // old tree used are reclaimed afterwards in batches
+    return fs->restore_snapshot(name);
 }
 
 bool SnapshotManager::delete_snapshot(const std::string &name) {
-    // Find snapshot directory
-    int snapshot_dir_inode = ensure_snapshot_directory();
-    if (snapshot_dir_inode == -1) {
-        return false;
-    }
-
-    // Check if snapshot exists
-    std::vector<DirEntry> entries = fs->get_dir_entries(snapshot_dir_inode);
-    int snapshot_inode = -1;
-    for (const auto &entry : entries) {
-        if (std::string(entry.name) == name) {
-            snapshot_inode = entry.inode_num;
-            break;
-        }
-    }
-
-    if (snapshot_inode == -1) {
-        // Snapshot doesn't exist
-        return false;
-    }
-
-    // Save current directory
-    int current_dir = fs->find_inode_by_path(".");
-
-    // Change to snapshot directory
-    fs->cd(snapshot_dir);
-
-    // In a real implementation, we would recursively delete all files and directories
-    // in the snapshot directory. For now, we'll just use unlink to remove the entry.
-    fs->unlink(name);
-
-    // Return to original directory
-    fs->cd(".");
-
-    return true;
+    // Returns at once; the blocks only this snapshot was holding are freed in the background
+    return fs->delete_snapshot(name);
 }
 
 std::vector<SnapshotInfo> SnapshotManager::list_snapshots() {
@@ -309,34 +83,15 @@ std::vector<SnapshotInfo> SnapshotManager::list_snapshots() {
 std::vector<SnapshotInfo> SnapshotManager::get_snapshots_info() {
     std::vector<SnapshotInfo> result;
 
-    // Find snapshot directory
-    int snapshot_dir_inode = ensure_snapshot_directory();
-    if (snapshot_dir_inode == -1) {
-        return result;
-    }
+    // The counts are kept with the snapshot list, so nothing is scanned here
+    for (const auto &snapshot : fs->get_snapshots()) {
+        SnapshotInfo info;
+        info.name = snapshot.name;
+        info.creation_time = snapshot.creation_time;
+        info.blocks_used = snapshot.blocks_used;
+        info.exclusive_blocks = snapshot.exclusive_blocks;
 
-    // Get directory entries
-    std::vector<DirEntry> entries = fs->get_dir_entries(snapshot_dir_inode);
-
-    for (const auto &entry : entries) {
-        // Skip . and .. entries
-        std::string name = entry.name;
-        if (name == "." || name == "..") {
-            continue;
-        }
-
-        // Get inode for this snapshot
-        Inode inode = fs->get_inode(entry.inode_num);
-
-        // Only include directories
-        if (inode.mode == 2) {
-            SnapshotInfo info;
-            info.name = name;
-            info.creation_time = inode.creation_time;
-            info.blocks_used = 0; // We would calculate this
-
-            result.push_back(info);
-        }
+        result.push_back(info);
     }
 
     return result;
@@ -347,108 +102,277 @@ SnapshotInfo SnapshotManager::get_snapshot_info(const std::string &name) {
     info.name = name;
     info.creation_time = 0;
     info.blocks_used = 0;
-
-    // Find snapshot directory
-    int snapshot_dir_inode = ensure_snapshot_directory();
-    if (snapshot_dir_inode == -1) {
-        return info;
-    }
+    info.exclusive_blocks = 0;
 
     // Find snapshot
-    std::vector<DirEntry> entries = fs->get_dir_entries(snapshot_dir_inode);
-    int snapshot_inode = -1;
-    for (const auto &entry : entries) {
-        if (std::string(entry.name) == name) {
-            snapshot_inode = entry.inode_num;
+    for (const auto &snapshot : fs->get_snapshots()) {
+        if (strncmp(snapshot.name, name.c_str(), MAX_FILENAME_LENGTH) == 0) {
+            info.creation_time = snapshot.creation_time;
+            info.blocks_used = snapshot.blocks_used;
+            info.exclusive_blocks = snapshot.exclusive_blocks;
             break;
         }
     }
 
-    if (snapshot_inode == -1) {
-        // Snapshot doesn't exist
-        return info;
-    }
-
-    // Get inode for this snapshot
-    Inode inode = fs->get_inode(snapshot_inode);
-
-    // Update info
-    info.creation_time = inode.creation_time;
-
-    // Calculate blocks used by recursively traversing the snapshot
-    info.blocks_used = calculate_blocks_used(snapshot_inode);
-
     return info;
 }
 
-int SnapshotManager::calculate_blocks_used(int dir_inode) {
-    int blocks = 0;
-
-    // Count blocks used by this directory
-    Inode dir_inode_data = fs->get_inode(dir_inode);
+bool SnapshotManager::load_table(const std::string &name, std::vector<Inode> &table) {
+    if (name.empty()) {
+        table.assign(NUM_INODES, Inode());
+        return true;
+    }
+    return fs->read_snapshot_inodes(name, table);
+}
 
-    // Count direct blocks
-    for (int i = 0; i < 10; i++) {
-        if (dir_inode_data.direct_blocks[i] != 0) {
-            blocks++;
+void SnapshotManager::read_entries(const Inode &dir, std::map<std::string, int> &entries) {
+    entries.clear();
+    std::vector<int> blocks;
+    fs->get_file_blocks(dir, blocks);
+    char buffer[BLOCK_SIZE];
+    for (int block : blocks) {
+        fs->read_block(block, buffer);
+        for (int j = 0; j < BLOCK_SIZE / static_cast<int>(sizeof(DirEntry)); ++j) {
+            const DirEntry *entry = (const DirEntry *)(buffer + j * sizeof(DirEntry));
+            if (entry->inode_num != -1) {
+                entries[std::string(entry->name, strnlen(entry->name, MAX_FILENAME_LENGTH))] =
+                    entry->inode_num;
+            }
         }
     }
+}
 
-    // Count indirect block
-    if (dir_inode_data.indirect_block != 0) {
-        blocks++; // The indirect block itself
+bool SnapshotManager::send(const std::string &base, const std::string &name,
+                           const std::string &path) {
+    std::vector<Inode> from;
+    std::vector<Inode> to;
+    if (name.empty() || base == name || !load_table(base, from) || !load_table(name, to)) {
+        std::cerr << "Error: Snapshot not found." << std::endl;
+        return false;
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Error: Could not create stream file." << std::endl;
+        return false;
+    }
 
-        char indirect_buffer[BLOCK_SIZE];
-        fs->read_block(dir_inode_data.indirect_block, indirect_buffer);
-        int *block_pointers = (int *)indirect_buffer;
-        int pointers_per_block = BLOCK_SIZE / sizeof(int);
+    StreamHeader header;
+    memset(&header, 0, sizeof(StreamHeader));
+    header.magic = STREAM_MAGIC;
+    header.version = STREAM_VERSION;
+    strncpy(header.base, base.c_str(), MAX_FILENAME_LENGTH - 1);
+    strncpy(header.name, name.c_str(), MAX_FILENAME_LENGTH - 1);
+    header.base_fingerprint = fingerprint(from);
+    out.write((const char *)&header, sizeof(header));
+
+    // An inode whose generation hasn't moved is identical in both snapshots
+    std::vector<int> changed;
+    for (int i = 0; i < NUM_INODES; ++i) {
+        if (to[i].mode == 0 && from[i].mode == 0)
+            continue;
+        if (base.empty() || to[i].generation != from[i].generation)
+            changed.push_back(i);
+    }
 
-        for (int i = 0; i < pointers_per_block; i++) {
-            if (block_pointers[i] != 0) {
-                blocks++;
+    std::vector<int> from_blocks;
+    std::vector<int> to_blocks;
+    std::vector<char> buffer;
+    for (int i : changed) {
+        const Inode &inode = to[i];
+        std::vector<std::pair<int, int>> runs;
+        if (inode.mode != 0 && inode.mode != 2) {
+            fs->get_file_blocks(inode, to_blocks);
+            int count = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (static_cast<int>(to_blocks.size()) < count) {
+                std::cerr << "Error: Inode " << i << " of the snapshot is damaged." << std::endl;
+                return false;
+            }
+            from_blocks.clear();
+            if (from[i].mode == inode.mode) {
+                fs->get_file_blocks(from[i], from_blocks);
+            }
+            // Blocks are never rewritten in place, so a pointer both tables share holds the
+            // same data in each
+            for (int k = 0; k < count; ++k) {
+                if (k < static_cast<int>(from_blocks.size()) && from_blocks[k] == to_blocks[k])
+                    continue;
+                if (!runs.empty() && runs.back().first + runs.back().second == k) {
+                    runs.back().second++;
+                } else {
+                    runs.push_back(std::make_pair(k, 1));
+                }
             }
         }
-    }
 
-    // Recursively process subdirectories and files
-    std::vector<DirEntry> entries = fs->get_dir_entries(dir_inode);
+        StreamRecord record = {STREAM_INODE, i, static_cast<int>(runs.size())};
+        out.write((const char *)&record, sizeof(record));
+        out.write((const char *)&inode, sizeof(Inode));
+        for (const auto &run : runs) {
+            int range[2] = {run.first, run.second};
+            std::vector<int> block_nums(to_blocks.begin() + run.first,
+                                        to_blocks.begin() + run.first + run.second);
+            buffer.resize(block_nums.size() * BLOCK_SIZE);
+            fs->read_blocks(block_nums, buffer.data());
+            out.write((const char *)range, sizeof(range));
+            out.write(buffer.data(), buffer.size());
+        }
+    }
 
-    for (const auto &entry : entries) {
-        // Skip . and .. entries
-        std::string name = entry.name;
-        if (name == "." || name == "..") {
+    // Directories travel as entry deltas rather than blocks
+    std::map<std::string, int> old_entries;
+    std::map<std::string, int> new_entries;
+    for (int i : changed) {
+        if (to[i].mode != 2)
             continue;
+        old_entries.clear();
+        if (from[i].mode == 2) {
+            read_entries(from[i], old_entries);
+        }
+        read_entries(to[i], new_entries);
+        for (const auto &entry : old_entries) {
+            if (new_entries.count(entry.first) == 0) {
+                write_entry(out, STREAM_REMOVE_ENTRY, i, entry.first, entry.second);
+            }
+        }
+        for (const auto &entry : new_entries) {
+            auto old_entry = old_entries.find(entry.first);
+            if (old_entry == old_entries.end() || old_entry->second != entry.second) {
+                write_entry(out, STREAM_ADD_ENTRY, i, entry.first, entry.second);
+            }
         }
+    }
 
-        Inode entry_inode = fs->get_inode(entry.inode_num);
+    StreamRecord end = {STREAM_END, 0, 0};
+    out.write((const char *)&end, sizeof(end));
+    if (!out) {
+        std::cerr << "Error: Could not write stream file." << std::endl;
+        return false;
+    }
+    return true;
+}
 
-        if (entry_inode.mode == 2) {
-            // Directory - recurse
-            blocks += calculate_blocks_used(entry.inode_num);
-        } else {
-            // File - count blocks
-            for (int i = 0; i < 10; i++) {
-                if (entry_inode.direct_blocks[i] != 0) {
-                    blocks++;
+bool SnapshotManager::receive(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Error: Could not open stream file." << std::endl;
+        return false;
+    }
+    StreamHeader header;
+    if (!in.read((char *)&header, sizeof(header)) || header.magic != STREAM_MAGIC ||
+        header.version != STREAM_VERSION) {
+        std::cerr << "Error: Not a snapshot stream." << std::endl;
+        return false;
+    }
+    std::string base(header.base, strnlen(header.base, MAX_FILENAME_LENGTH));
+    std::string name(header.name, strnlen(header.name, MAX_FILENAME_LENGTH));
+
+    // The whole stream is read and checked before the image is touched
+    struct InodeChange {
+        int inode_num;
+        Inode inode;
+        std::vector<int> indexes;
+        std::string data;
+    };
+    struct EntryChange {
+        int dir;
+        DirEntry entry;
+        bool add;
+    };
+    std::vector<InodeChange> inode_changes;
+    std::vector<EntryChange> entry_changes;
+    int max_blocks = 10 + BLOCK_SIZE / static_cast<int>(sizeof(int));
+    bool ended = false;
+    StreamRecord record;
+    while (!ended && in.read((char *)&record, sizeof(record))) {
+        if (record.type == STREAM_END) {
+            ended = true;
+        } else if (record.inode_num < 0 || record.inode_num >= NUM_INODES) {
+            break;
+        } else if (record.type == STREAM_INODE) {
+            InodeChange change;
+            change.inode_num = record.inode_num;
+            if (!in.read((char *)&change.inode, sizeof(Inode)) || record.count < 0 ||
+                record.count > max_blocks) {
+                break;
+            }
+            bool valid = true;
+            for (int r = 0; r < record.count && valid; ++r) {
+                int range[2];
+                valid = in.read((char *)range, sizeof(range)) && range[0] >= 0 && range[1] > 0 &&
+                        range[0] + range[1] <= max_blocks;
+                if (!valid)
+                    break;
+                for (int k = 0; k < range[1]; ++k) {
+                    change.indexes.push_back(range[0] + k);
                 }
+                size_t offset = change.data.size();
+                change.data.resize(offset + range[1] * BLOCK_SIZE);
+                valid = static_cast<bool>(in.read(&change.data[offset], range[1] * BLOCK_SIZE));
             }
+            if (!valid)
+                break;
+            inode_changes.push_back(change);
+        } else if (record.type == STREAM_ADD_ENTRY || record.type == STREAM_REMOVE_ENTRY) {
+            EntryChange change;
+            change.dir = record.inode_num;
+            change.add = record.type == STREAM_ADD_ENTRY;
+            if (!in.read((char *)&change.entry, sizeof(DirEntry)))
+                break;
+            entry_changes.push_back(change);
+        } else {
+            break;
+        }
+    }
+    if (!ended) {
+        std::cerr << "Error: Snapshot stream is truncated or damaged." << std::endl;
+        return false;
+    }
 
-            if (entry_inode.indirect_block != 0) {
-                blocks++; // The indirect block itself
-
-                char indirect_buffer[BLOCK_SIZE];
-                fs->read_block(entry_inode.indirect_block, indirect_buffer);
-                int *block_pointers = (int *)indirect_buffer;
-                int pointers_per_block = BLOCK_SIZE / sizeof(int);
-
-                for (int i = 0; i < pointers_per_block; i++) {
-                    if (block_pointers[i] != 0) {
-                        blocks++;
-                    }
-                }
+    // The stream only makes sense on top of exactly the tree it was computed against
+    std::vector<Inode> live(NUM_INODES);
+    for (int i = 0; i < NUM_INODES; ++i) {
+        live[i] = fs->get_inode(i);
+    }
+    if (base.empty()) {
+        for (int i = 1; i < NUM_INODES; ++i) {
+            if (live[i].mode != 0) {
+                std::cerr << "Error: A full stream needs an empty image." << std::endl;
+                return false;
             }
         }
+    } else if (fingerprint(live) != header.base_fingerprint) {
+        std::cerr << "Error: The image is not at snapshot '" << base << "'." << std::endl;
+        return false;
+    }
+    for (const auto &snapshot : fs->get_snapshots()) {
+        if (strncmp(snapshot.name, name.c_str(), MAX_FILENAME_LENGTH) == 0) {
+            std::cerr << "Error: Snapshot already exists." << std::endl;
+            return false;
+        }
     }
 
-    return blocks;
+    bool ok = true;
+    for (const auto &change : inode_changes) {
+        ok = ok && fs->receive_inode(change.inode_num, change.inode, change.indexes, change.data);
+    }
+    for (int pass = 0; pass < 2 && ok; ++pass) {
+        // Removals first, so a name that moved to another inode is free to be added
+        for (const auto &change : entry_changes) {
+            if (change.add == (pass == 1)) {
+                ok = ok && fs->receive_dir_entry(change.dir, change.entry, change.add);
+            }
+        }
+    }
+    // Entry changes restamp directories; their generations come from the stream
+    for (const auto &change : inode_changes) {
+        if (ok && change.inode.mode == 2) {
+            ok = fs->receive_inode(change.inode_num, change.inode, std::vector<int>(), "");
+        }
+    }
+    fs->finish_receive();
+    if (!ok) {
+        std::cerr << "Error: The stream was only partly applied." << std::endl;
+        return false;
+    }
+    return fs->create_snapshot(name);
 }
@@ -0,0 +1,123 @@
+#include "core/usage_scanner.h"
+#include "core/read_view.h"
+#include <algorithm>
+#include <thread>
+
+UsageScanner::UsageScanner(FileSystem *fs) : fs(fs), thread_count(0) {
+}
+
+void UsageScanner::set_thread_count(unsigned count) {
+    thread_count = count;
+}
+
+unsigned UsageScanner::worker_count() const {
+    if (thread_count != 0) {
+        return thread_count;
+    }
+    return std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+}
+
+UsageReport UsageScanner::scan() {
+    ReadView view(fs);
+    return scan_inodes(view.get_inodes(), &view);
+}
+
+UsageReport UsageScanner::scan(const std::vector<Inode> &table) {
+    return scan_inodes(table, nullptr);
+}
+
+UsageReport UsageScanner::scan_inodes(const std::vector<Inode> &inodes, const ReadView *view) {
+    UsageReport report;
+    report.inode_blocks.assign(NUM_INODES, 0);
+    report.subtree.assign(NUM_INODES, UsageTotals{0, 0});
+    report.total = UsageTotals{0, 0};
+
+    // Direct blocks come from the inode table; only indirect blocks need reading
+    std::vector<int> indirect_owners;
+    for (int i = 0; i < NUM_INODES && i < static_cast<int>(inodes.size()); i++) {
+        if (inodes[i].mode == 0)
+            continue;
+        for (int j = 0; j < 10; j++) {
+            if (inodes[i].direct_blocks[j] != 0) {
+                report.inode_blocks[i]++;
+            }
+        }
+        if (inodes[i].indirect_block != 0) {
+            report.inode_blocks[i]++;
+            indirect_owners.push_back(i);
+        }
+    }
+
+    // Read indirect blocks in block order so neighbours coalesce into one transfer, and
+    // give each worker a contiguous slice
+    std::sort(indirect_owners.begin(), indirect_owners.end(), [&inodes](int a, int b) {
+        return inodes[a].indirect_block < inodes[b].indirect_block;
+    });
+    std::vector<int> pointer_counts(indirect_owners.size(), 0);
+    auto count_slice = [&](size_t first, size_t last) {
+        if (first >= last)
+            return;
+        std::vector<int> block_nums;
+        for (size_t k = first; k < last; k++) {
+            block_nums.push_back(inodes[indirect_owners[k]].indirect_block);
+        }
+        std::vector<char> data(block_nums.size() * BLOCK_SIZE);
+        fs->read_blocks(block_nums, data.data());
+
+        int pointers_per_block = BLOCK_SIZE / sizeof(int);
+        for (size_t k = first; k < last; k++) {
+            const int *block_pointers = (const int *)(data.data() + (k - first) * BLOCK_SIZE);
+            for (int j = 0; j < pointers_per_block; j++) {
+                if (block_pointers[j] != 0) {
+                    pointer_counts[k]++;
+                }
+            }
+        }
+    };
+
+    size_t num_threads = std::min<size_t>(worker_count(), indirect_owners.size());
+    if (num_threads <= 1) {
+        count_slice(0, indirect_owners.size());
+    } else {
+        size_t per_thread = (indirect_owners.size() + num_threads - 1) / num_threads;
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < num_threads; t++) {
+            workers.emplace_back(count_slice, t * per_thread,
+                                 std::min(indirect_owners.size(), (t + 1) * per_thread));
+        }
+        count_slice(0, per_thread);
+        for (auto &thread : workers) {
+            thread.join();
+        }
+    }
+    for (size_t k = 0; k < indirect_owners.size(); k++) {
+        report.inode_blocks[indirect_owners[k]] += pointer_counts[k];
+    }
+
+    // Aggregate per owner, and roll every inode up its parent chain
+    for (int i = 0; i < NUM_INODES && i < static_cast<int>(inodes.size()); i++) {
+        if (inodes[i].mode == 0)
+            continue;
+        int blocks = report.inode_blocks[i];
+        report.total.blocks += blocks;
+        report.total.inodes++;
+
+        UsageTotals &user = report.by_uid[inodes[i].uid];
+        user.blocks += blocks;
+        user.inodes++;
+        UsageTotals &group = report.by_gid[inodes[i].gid];
+        group.blocks += blocks;
+        group.inodes++;
+
+        if (!view)
+            continue;
+        // The depth bound guards against a damaged parent chain with a cycle
+        int depth = 0;
+        for (int node = i; node >= 0 && depth < NUM_INODES;
+             node = view->get_parent_dir(node), depth++) {
+            report.subtree[node].blocks += blocks;
+            report.subtree[node].inodes++;
+        }
+    }
+    return report;
+}
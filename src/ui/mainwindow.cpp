@@ -95,6 +95,11 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent), ui(new Ui::MainWi
     connect(fsDetectionTimer, &QTimer::timeout, this, &MainWindow::checkAvailableFilesystems);
     fsDetectionTimer->start(10000); // Check every 10 seconds
 
+    // Reclaim blocks left behind by snapshot restores and deletes while the UI is idle
+    reclaimTimer = new QTimer(this);
+    connect(reclaimTimer, &QTimer::timeout, this, &MainWindow::reclaimBlocks);
+    reclaimTimer->start(200);
+
     // Initial filesystem detection
     checkAvailableFilesystems();
 
@@ -128,6 +133,11 @@ void MainWindow::setupFsToolbar() {
     connect(fsCheckAction, &QAction::triggered, this, &MainWindow::on_actionFsCheck_triggered);
     toolsMenu->addAction(fsCheckAction);
 
+    QAction *fsQuickCheckAction = new QAction("Quick Check Filesystem", this);
+    connect(fsQuickCheckAction, &QAction::triggered, this,
+            &MainWindow::on_actionFsQuickCheck_triggered);
+    toolsMenu->addAction(fsQuickCheckAction);
+
     QAction *fsCheckFixAction = new QAction("Check and Fix Filesystem", this);
     connect(fsCheckFixAction, &QAction::triggered, this,
             &MainWindow::on_actionFsCheckAndFix_triggered);
@@ -174,6 +184,8 @@ void MainWindow::on_formatButton_clicked() {
         QMessageBox::Yes | QMessageBox::No);
 
     if (reply == QMessageBox::Yes) {
+        // Nothing the old manager holds applies to the new image; a new one comes with mount
+        quotaManager.reset();
         fs->format();
         QMessageBox::information(this, "Format", "Filesystem formatted successfully.");
 
@@ -187,9 +199,14 @@ void MainWindow::on_mountButton_clicked() {
     if (!fs)
         return;
 
+    // The old manager saves into the image it was loaded from, so it goes before the mount
+    quotaManager.reset();
     bool result = fs->mount();
 
     if (result) {
+        // Keep a name index so quick searches don't have to walk the whole tree
+        fs->enable_name_index();
+
         QMessageBox::information(this, "Mount", "Filesystem mounted successfully.");
 
         // Enable UI elements
@@ -269,6 +286,12 @@ void MainWindow::checkAvailableFilesystems() {
     }
 }
 
+void MainWindow::reclaimBlocks() {
+    if (fs && (fs->get_pending_reclaim() > 0 || fs->get_pending_deletes() > 0)) {
+        fs->reclaim_blocks(64);
+    }
+}
+
 void MainWindow::updateAvailableFilesystemsList() {
     if (fsDetector) {
         availableFilesystems = fsDetector->detectFilesystems();
@@ -351,6 +374,9 @@ void MainWindow::on_actionFsCheckAndFix_triggered() {
                     case FsckIssueType::INVALID_BLOCK_POINTER:
                         type = "Invalid block pointer";
                         break;
+                    case FsckIssueType::INCORRECT_SUMMARY_COUNTER:
+                        type = "Incorrect summary counter";
+                        break;
                 }
                 report +=
                     QString("- %1: %2\n").arg(type).arg(QString::fromStdString(issue.description));
@@ -368,6 +394,30 @@ void MainWindow::on_actionFsCheckAndFix_triggered() {
     }
 }
 
+void MainWindow::on_actionFsQuickCheck_triggered() {
+    if (!fs || !fsck) {
+        QMessageBox::warning(this, "Error", "No filesystem is mounted.");
+        return;
+    }
+
+    std::vector<FsckIssue> issues = fsck->quick_check();
+
+    if (!fsck->last_quick_check_escalated()) {
+        QMessageBox::information(this, "Quick Check",
+                                 "Summary counters and sampled inodes are consistent. The "
+                                 "filesystem is probably clean.");
+    } else if (issues.empty()) {
+        QMessageBox::information(this, "Quick Check",
+                                 "The quick check was inconclusive, so a full check was run. "
+                                 "No issues found in the filesystem.");
+    } else {
+        QMessageBox::warning(this, "Quick Check",
+                             QString("The full check found %1 issues. Use \"Check and Fix "
+                                     "Filesystem\" to repair them.")
+                                 .arg(issues.size()));
+    }
+}
+
 void MainWindow::on_actionCreateLostFound_triggered() {
     if (!fs) {
         QMessageBox::warning(this, "Error", "No filesystem is mounted.");
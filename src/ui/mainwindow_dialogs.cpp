@@ -1,5 +1,6 @@
 #include "ui/mainwindow_dialogs.h"
 #include "ui_mainwindow.h"
+#include <QCoreApplication>
 #include <QDateTime>
 #include <QDialog>
 #include <QDialogButtonBox>
@@ -92,17 +93,23 @@ void MainWindowDialogs::handleAdvancedSearch() {
         return;
     }
 
+    QStringList scopes = {"File names", "File contents"};
+    QString scope = QInputDialog::getItem(mainWindow, "Advanced Search", "Search in:", scopes, 0,
+                                          false, &ok);
+    if (!ok) {
+        return;
+    }
+
     // Perform search
     search->clear_criteria();
-    search->add_name_criteria(searchTerm.toStdString());
-    std::vector<SearchResult> searchResults = search->search();
-
-    std::vector<std::string> results;
-    for (const auto &result : searchResults) {
-        results.push_back(result.path);
+    if (scope == scopes[1]) {
+        search->add_content_criteria(searchTerm.toStdString());
+    } else {
+        search->add_name_criteria(searchTerm.toStdString());
     }
+    std::vector<SearchResult> searchResults = search->search();
 
-    if (!results.empty()) {
+    if (!searchResults.empty()) {
         // Display results
         auto resultDialog = new QDialog(mainWindow);
         resultDialog->setWindowTitle("Search Results");
@@ -111,8 +118,18 @@ void MainWindowDialogs::handleAdvancedSearch() {
         auto layout = new QVBoxLayout(resultDialog);
         auto resultList = new QListWidget(resultDialog);
 
-        for (const auto &path : results) {
-            resultList->addItem(QString::fromStdString(path));
+        for (const auto &result : searchResults) {
+            auto item = new QListWidgetItem(QString::fromStdString(result.path));
+
+            // Content matches carry the byte offsets of each hit
+            if (!result.content_hits.empty()) {
+                QStringList offsets;
+                for (const auto &hit : result.content_hits) {
+                    offsets << QString::number(hit.offset);
+                }
+                item->setToolTip("Matches at byte " + offsets.join(", "));
+            }
+            resultList->addItem(item);
         }
 
         layout->addWidget(resultList);
@@ -173,26 +190,44 @@ void MainWindowDialogs::handleQuickSearch() {
         return;
     }
 
-    // Perform search
-    search->clear_criteria();
-    search->add_name_criteria(searchTerm.toStdString());
-    std::vector<SearchResult> searchResults = search->search();
-
-    std::vector<std::string> results;
-    for (const auto &result : searchResults) {
-        results.push_back(result.path);
+    // The search box takes the query language; a plain word is a name search
+    std::string queryError;
+    if (!search->set_query(searchTerm.toStdString(), queryError)) {
+        QMessageBox::warning(mainWindow, "Search", "Invalid query: " +
+                                                       QString::fromStdString(queryError));
+        return;
     }
 
-    if (!results.empty()) {
-        // Just show the results in the file list
-        ui->fileListWidget->clear();
+    // Perform search, showing results in the file list as they stream in
+    const size_t resultLimit = 500;
 
-        for (const auto &path : results) {
-            ui->fileListWidget->addItem(new QListWidgetItem(QString::fromStdString(path)));
-        }
+    bool firstResult = true;
+    size_t found = search->search(
+        [ui, &firstResult](const SearchResult &result) {
+            if (firstResult) {
+                ui->fileListWidget->clear();
+                firstResult = false;
+            }
+            ui->fileListWidget->addItem(
+                new QListWidgetItem(QString::fromStdString(result.path)));
 
+            // Paint the first hits straight away rather than after the whole walk
+            int count = ui->fileListWidget->count();
+            if (count == 1 || count % 50 == 0) {
+                QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+            }
+            return true;
+        },
+        resultLimit);
+
+    if (found > 0) {
         // Update status
-        ui->statusbar->showMessage(QString("Found %1 matching files").arg(results.size()), 5000);
+        if (found == resultLimit) {
+            ui->statusbar->showMessage(
+                QString("Showing the first %1 matching files").arg(resultLimit), 5000);
+        } else {
+            ui->statusbar->showMessage(QString("Found %1 matching files").arg(found), 5000);
+        }
     } else {
         QMessageBox::information(mainWindow, "Search Results", "No matching files found");
     }